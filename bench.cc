@@ -0,0 +1,650 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <list>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cgicc/CgiInput.h>
+#include <Magick++/Blob.h>
+#include <Magick++/Drawable.h>
+#include <Magick++/Functions.h>
+#include <Magick++/Geometry.h>
+#include <Magick++/Image.h>
+#include <Magick++/STL.h>
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "convert.h"
+#include "dither.h"
+#include "gray.h"
+#include "img2brl.h"
+#include "pack.h"
+#include "response.h"
+#include "timings.h"
+#include "ubrl.h"
+
+typedef std::chrono::steady_clock clock_type;
+
+// Results are printed as text, or with --json as one JSON object per line,
+// so tools can compare runs and catch regressions.
+static bool json_output = false;
+
+class record
+{
+  std::string name;
+  std::vector<std::pair<std::string, std::string>> fields; // values as JSON
+
+public:
+  explicit record(std::string const &name): name{name} {}
+
+  record &set(std::string const &key, double value)
+  {
+    char text[32];
+    std::snprintf(text, sizeof text, "%.6g", value);
+    fields.emplace_back(key, text);
+    return *this;
+  }
+
+  record &set(std::string const &key, std::string const &value)
+  {
+    std::string quoted(1, '"');
+    append_json_escaped(quoted, value.data(), value.size());
+    fields.emplace_back(key, quoted + '"');
+    return *this;
+  }
+
+  void print() const
+  {
+    if (json_output) {
+      std::cout << "{\"bench\":\"" << name << '"';
+      for (auto const &field: fields)
+        std::cout << ",\"" << field.first << "\":" << field.second;
+      std::cout << '}' << std::endl;
+    } else {
+      std::cout << name;
+      for (auto const &field: fields)
+        std::cout << ' ' << field.first << '=' << field.second;
+      std::cout << std::endl;
+    }
+  }
+};
+
+// Pack and encode a large scanned diagram sized luminance buffer with every
+// kernel the CPU supports.
+static void
+bench_pack_kernels(std::size_t width, std::size_t height, std::size_t repetitions)
+{
+  std::mt19937 random;
+  std::uniform_int_distribution<int> byte(0, 255);
+  std::vector<unsigned char> pixels(width * height);
+  for (unsigned char &pixel: pixels) pixel = byte(random);
+
+  std::size_t const columns = (width + 1) / 2;
+  std::vector<unsigned char> cells(columns);
+  std::string utf8((height + 3) / 4 * (columns * 3 + 1), '\0');
+
+  double scalar_seconds = 0;
+  for (pack_kernel const &kernel: pack_kernels()) {
+    clock_type::duration best = clock_type::duration::max();
+    for (std::size_t i = 0; i < repetitions; ++i) {
+      clock_type::time_point const start = clock_type::now();
+      char *out = &utf8[0];
+      for (std::size_t y = 0; y + 4 <= height; y += 4) {
+        unsigned char const *const row[4] = {
+          &pixels[y * width], &pixels[(y + 1) * width],
+          &pixels[(y + 2) * width], &pixels[(y + 3) * width]
+        };
+        kernel.pack(row, width, 0x80, cells.data());
+        out = kernel.encode(cells.data(), columns, out);
+        *out++ = '\n';
+      }
+      best = std::min(best, clock_type::now() - start);
+    }
+    double const seconds =
+      std::chrono::duration_cast<std::chrono::duration<double>>(best).count();
+    if (not scalar_seconds) scalar_seconds = seconds;
+    record("pack").set("kernel", kernel.name)
+                  .set("width", width).set("height", height)
+                  .set("ms", seconds * 1000)
+                  .set("mpixel_per_second", pixels.size() / seconds / 1e6)
+                  .set("speedup", scalar_seconds / seconds)
+                  .print();
+  }
+}
+
+// Every dither engine on a photo sized gradient with noise, the kind of
+// picture which comes out as solid blocks with a fixed threshold
+static void
+bench_dither_engines(std::size_t width, std::size_t height, std::size_t repetitions)
+{
+  std::mt19937 random;
+  std::uniform_int_distribution<int> noise(-24, 24);
+  std::vector<unsigned char> pixels(width * height);
+  for (std::size_t y = 0; y < height; ++y)
+    for (std::size_t x = 0; x < width; ++x)
+      pixels[y * width + x] =
+        std::max(0, std::min(255, int(x * 255 / width) + noise(random)));
+
+  for (dither_mode mode: { dither_mode::bilevel, dither_mode::otsu
+                         , dither_mode::bayer, dither_mode::floyd_steinberg
+                         }) {
+    braille_cells cells;
+    clock_type::duration best = clock_type::duration::max();
+    for (std::size_t i = 0; i < repetitions; ++i) {
+      clock_type::time_point const start = clock_type::now();
+      dither(pixels.data(), width, height, mode, cells);
+      best = std::min(best, clock_type::now() - start);
+    }
+    double const seconds =
+      std::chrono::duration_cast<std::chrono::duration<double>>(best).count();
+    record("dither").set("mode", dither_name(mode))
+                    .set("width", width).set("height", height)
+                    .set("ms", seconds * 1000)
+                    .set("mpixel_per_second", pixels.size() / seconds / 1e6)
+                    .print();
+  }
+}
+
+// Seconds of every stage for each repetition, stage::total is wall time
+struct measurement
+{
+  std::vector<std::array<double, stage_count>> runs;
+  long peak_kilobytes;
+
+  std::vector<double> seconds(stage which) const
+  {
+    std::vector<double> result;
+    for (auto const &run: runs) result.push_back(run[std::size_t(which)]);
+    return result;
+  }
+};
+
+static double
+percentile(std::vector<double> values, double fraction)
+{
+  if (values.empty()) return 0;
+  std::sort(values.begin(), values.end());
+  std::size_t const rank = std::size_t(std::ceil(fraction * values.size()));
+  return values[std::max<std::size_t>(rank, 1) - 1];
+}
+
+// Run work repetitions times in a child process, after one unmeasured run
+// to load coders and warm caches, so peak memory use of one measurement
+// does not hide the next one.  Magick++ must not have started any threads
+// yet.
+static measurement
+measure( std::function<void(stage_timings &)> const &work
+       , std::size_t repetitions = 1, bool warm_up = false
+       )
+{
+  measurement result;
+  result.peak_kilobytes = 0;
+  int channel[2];
+  if (pipe(channel) == -1) return result;
+  pid_t const child = fork();
+  if (child == 0) {
+    close(channel[0]);
+    if (warm_up) {
+      stage_timings ignored;
+      work(ignored);
+    }
+    for (std::size_t i = 0; i < repetitions; ++i) {
+      stage_timings timings;
+      clock_type::time_point const start = clock_type::now();
+      work(timings);
+      timings.add(stage::total, clock_type::now() - start);
+      std::array<double, stage_count> run;
+      for (std::size_t j = 0; j < stage_count; ++j)
+        run[j] = std::chrono::duration_cast<std::chrono::duration<double>>
+                 (timings[stage(j)]).count();
+      if (write(channel[1], run.data(), sizeof run) != sizeof run) _exit(1);
+    }
+    _exit(0);
+  }
+  close(channel[1]);
+  std::array<double, stage_count> run;
+  while (read(channel[0], run.data(), sizeof run) == sizeof run)
+    result.runs.push_back(run);
+  close(channel[0]);
+  int status;
+  rusage usage;
+  if (child != -1 and wait4(child, &status, 0, &usage) == child)
+    result.peak_kilobytes = usage.ru_maxrss;
+  return result;
+}
+
+static std::string
+read_file(std::string const &name)
+{
+  std::ifstream file(name, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(file),
+                     std::istreambuf_iterator<char>());
+}
+
+// Decode a large photo sized image and resize it to a braille display's
+// width, once the way it used to be done and once with shrink-on-load.
+static void
+bench_shrink_on_load( std::size_t width, std::size_t height
+                    , std::string const &format, std::size_t columns
+                    )
+{
+  std::string const name = "img2brl_bench." + format;
+  measure([&](stage_timings &) {
+    Magick::Image image;
+    image.size(Magick::Geometry(width, height));
+    image.read("plasma:");
+    image.magick(format);
+    image.write(name);
+  });
+  std::string const data = read_file(name);
+  std::remove(name.c_str());
+  if (data.empty()) return;
+
+  conversion_options options;
+  options.columns = columns;
+  measurement const full = measure([&](stage_timings &) {
+    Magick::Image image(Magick::Blob(data.data(), data.size()));
+    Magick::Geometry geometry(columns * 2, 0);
+    geometry.less(false);
+    geometry.greater(true);
+    image.resize(geometry);
+  });
+  measurement const shrunk = measure([&](stage_timings &) {
+    prepare_image(data, options);
+  });
+  if (full.runs.empty() or shrunk.runs.empty()) return;
+
+  double const full_seconds = full.runs.front()[std::size_t(stage::total)];
+  double const shrunk_seconds = shrunk.runs.front()[std::size_t(stage::total)];
+  record("shrink_on_load").set("format", format)
+                          .set("width", width).set("height", height)
+                          .set("columns", columns)
+                          .set("full_ms", full_seconds * 1000)
+                          .set("full_peak_kb", full.peak_kilobytes)
+                          .set("shrunk_ms", shrunk_seconds * 1000)
+                          .set("shrunk_peak_kb", shrunk.peak_kilobytes)
+                          .set("speedup", full_seconds / shrunk_seconds)
+                          .print();
+}
+
+// The generated corpus.  Pixels come from a seeded generator, so every run
+// and every machine benchmarks the same files.
+struct corpus_image
+{
+  std::string name, file;
+  std::size_t width, height, frames;
+  std::size_t repetitions;
+};
+
+// Smooth gradients with some grain, which compresses like a photo
+static Magick::Image
+synthetic_photo(std::size_t width, std::size_t height, unsigned seed)
+{
+  std::mt19937 random(seed);
+  std::uniform_int_distribution<int> grain(-12, 12);
+  std::uniform_real_distribution<double> phase(0, 6.283);
+  double const a = phase(random), b = phase(random), c = phase(random);
+  std::vector<unsigned char> pixels(width * height * 3);
+  for (std::size_t y = 0; y < height; ++y)
+    for (std::size_t x = 0; x < width; ++x) {
+      double const u = double(x) / width, v = double(y) / height;
+      double const channel[3] = {
+        std::sin(6 * u + a) + std::cos(4 * v + b),
+        std::sin(9 * u * v + c) + std::cos(3 * u - 5 * v),
+        std::cos(7 * v + a + b) + std::sin(2 * u + c)
+      };
+      for (std::size_t i = 0; i < 3; ++i) {
+        int const value = int(64 * (channel[i] + 2)) + grain(random);
+        pixels[(y * width + x) * 3 + i] = std::min(255, std::max(0, value));
+      }
+    }
+  return Magick::Image(width, height, "RGB", Magick::CharPixel, pixels.data());
+}
+
+// Thin black lines on white, like a scanned floor plan or map
+static Magick::Image
+synthetic_drawing(std::size_t width, std::size_t height, std::size_t lines)
+{
+  std::mt19937 random(1);
+  std::uniform_real_distribution<double> x(0, width), y(0, height);
+  Magick::Image image(Magick::Geometry(width, height), Magick::Color("white"));
+  std::list<Magick::Drawable> drawing;
+  drawing.push_back(Magick::DrawableStrokeColor(Magick::Color("black")));
+  drawing.push_back(Magick::DrawableStrokeWidth(3));
+  for (std::size_t i = 0; i < lines; ++i) {
+    // Mostly horizontal and vertical, like walls and streets
+    double const x1 = x(random), y1 = y(random);
+    bool const horizontal = i % 2;
+    drawing.push_back(Magick::DrawableLine(x1, y1,
+                                           horizontal? x(random): x1,
+                                           horizontal? y1: y(random)));
+  }
+  image.draw(drawing);
+  image.type(Magick::BilevelType);
+  return image;
+}
+
+static std::vector<corpus_image>
+make_corpus(std::string const &directory)
+{
+  std::vector<corpus_image> corpus = {
+    { "icon", directory + "/icon.png", 16, 16, 1, 500 },
+    { "photo", directory + "/photo.jpg", 1920, 1080, 1, 20 },
+    { "drawing", directory + "/drawing.png", 8000, 6000, 1, 3 },
+    { "animation", directory + "/animation.gif", 320, 240, 24, 20 }
+  };
+  mkdir(directory.c_str(), 0700);
+  for (corpus_image const &image: corpus) {
+    struct stat info;
+    if (stat(image.file.c_str(), &info) == 0) continue;
+    measure([&](stage_timings &) {
+      if (image.frames > 1) {
+        std::vector<Magick::Image> frames;
+        for (std::size_t i = 0; i < image.frames; ++i) {
+          frames.push_back(synthetic_photo(image.width, image.height, i));
+          frames.back().animationDelay(4);
+        }
+        Magick::writeImages(frames.begin(), frames.end(), image.file);
+      } else if (image.name == "drawing") {
+        synthetic_drawing(image.width, image.height, 2000).write(image.file);
+      } else {
+        synthetic_photo(image.width, image.height, 0).write(image.file);
+      }
+    });
+  }
+  return corpus;
+}
+
+static void
+report( std::string const &bench, corpus_image const &image
+      , std::size_t bytes, measurement const &result
+      )
+{
+  if (result.runs.empty()) {
+    record(bench).set("image", image.name).set("error", "no runs").print();
+    return;
+  }
+  std::vector<double> const total = result.seconds(stage::total);
+  double sum = 0;
+  for (double seconds: total) sum += seconds;
+  record line(bench);
+  line.set("image", image.name)
+      .set("width", image.width).set("height", image.height)
+      .set("frames", image.frames).set("bytes", bytes)
+      .set("runs", result.runs.size())
+      .set("images_per_second", result.runs.size() / sum)
+      .set("mpixel_per_second",
+           result.runs.size() * image.width * image.height / sum / 1e6)
+      .set("peak_rss_kb", result.peak_kilobytes);
+  for (std::size_t i = 0; i < stage_count; ++i) {
+    std::vector<double> const seconds = result.seconds(stage(i));
+    if (*std::max_element(seconds.begin(), seconds.end()) == 0) continue;
+    std::string const name = stage_name(stage(i));
+    line.set(name + "_p50_ms", percentile(seconds, 0.50) * 1000)
+        .set(name + "_p95_ms", percentile(seconds, 0.95) * 1000)
+        .set(name + "_p99_ms", percentile(seconds, 0.99) * 1000);
+  }
+  line.print();
+}
+
+// Every image operation, to 80 columns, and the plain conversion at full
+// resolution
+static void
+bench_convert(corpus_image const &image, std::string const &data)
+{
+  conversion_options all;
+  all.trim = all.normalize = all.negate = true;
+  all.columns = 80;
+  report("convert", image, data.size(),
+         measure([&](stage_timings &timings) { convert(data, all, &timings); },
+                 image.repetitions, true));
+  report("convert_full", image, data.size(),
+         measure([&](stage_timings &timings) {
+                   convert(data, conversion_options(), &timings);
+                 }, image.repetitions, true));
+  // The same operations one ImageMagick pass after the other, which the
+  // fused grey pipeline of convert() replaces
+  report("convert_reference", image, data.size(),
+         measure([&](stage_timings &timings) {
+                   Magick::Image const prepared = prepare_image(data, all, &timings);
+                   stage_timer timer(&timings, stage::convert);
+                   ubrl const dots(prepared);
+                 }, image.repetitions, true));
+}
+
+// Peak memory of a conversion at full resolution, decoding row by row into
+// grey against decoding into ImageMagick's pixel cache first.  A child doing
+// nothing gives the memory every child starts with.
+static void
+bench_memory(corpus_image const &image, std::string const &data)
+{
+  conversion_options const options;
+  measurement const baseline = measure([](stage_timings &) {});
+  measurement const streamed = measure([&](stage_timings &) {
+    convert(data, options);
+  });
+  measurement const cached = measure([&](stage_timings &) {
+    Magick::Image const decoded = read_image(data);
+    gray_pipeline(decoded, options);
+  });
+  if (streamed.runs.empty() or cached.runs.empty()) return;
+
+  double const base = baseline.peak_kilobytes;
+  record("memory").set("image", image.name)
+                  .set("width", image.width).set("height", image.height)
+                  .set("baseline_peak_kb", baseline.peak_kilobytes)
+                  .set("streamed_peak_kb", streamed.peak_kilobytes)
+                  .set("cached_peak_kb", cached.peak_kilobytes)
+                  .set("saving", (cached.peak_kilobytes - base)
+                                 / std::max(streamed.peak_kilobytes - base, 1.0))
+                  .print();
+}
+
+// The whole conversion with every dither mode, against ImageMagick's
+// bilevel reduction the ubrl coder uses
+static void
+bench_dither(corpus_image const &image, std::string const &data)
+{
+  for (dither_mode mode: { dither_mode::bilevel, dither_mode::otsu
+                         , dither_mode::bayer, dither_mode::floyd_steinberg
+                         }) {
+    conversion_options options;
+    options.dither = mode;
+    report(std::string("dither_") + dither_name(mode), image, data.size(),
+           measure([&](stage_timings &timings) { convert(data, options, &timings); },
+                   image.repetitions, true));
+  }
+}
+
+// A CGI request as a web server would pass it: environment variables and
+// the request body on standard input.
+class bench_input: public cgicc::CgiInput
+{
+  std::map<std::string, std::string> environment;
+  std::string const &body;
+  std::size_t position;
+
+public:
+  // A GET request for query if content_type is empty
+  bench_input( std::string const &content_type, std::string const &body
+             , std::string const &query = std::string()
+             )
+  : body(body), position{0}
+  {
+    environment["GATEWAY_INTERFACE"] = "CGI/1.1";
+    environment["SERVER_SOFTWARE"] = "img2brl_bench";
+    environment["SERVER_NAME"] = "localhost";
+    environment["SERVER_PORT"] = "80";
+    environment["SERVER_PROTOCOL"] = "HTTP/1.1";
+    environment["REQUEST_METHOD"] = content_type.empty()? "GET": "POST";
+    environment["QUERY_STRING"] = query;
+    environment["SCRIPT_NAME"] = "/img2brl.cgi";
+    environment["REMOTE_ADDR"] = "127.0.0.1";
+    environment["CONTENT_TYPE"] = content_type;
+    environment["CONTENT_LENGTH"] = std::to_string(body.size());
+  }
+
+  size_t read(char *data, size_t length) override
+  {
+    length = std::min(length, body.size() - position);
+    std::memcpy(data, body.data() + position, length);
+    position += length;
+    return length;
+  }
+
+  std::string getenv(char const *name) override
+  {
+    auto const value = environment.find(name);
+    return value != environment.end()? value->second: std::string();
+  }
+};
+
+// Upload the image with mode=json, every operation and 80 columns, and
+// throw the response away
+static void
+bench_request(corpus_image const &image, std::string const &data)
+{
+  std::string const boundary = "img2brl-bench-boundary";
+  std::ostringstream body;
+  for (char const *field: { "mode=json", "trim=on", "normalize=on",
+                            "negate=on", "resize=on", "cols=80" }) {
+    char const *value = std::strchr(field, '=');
+    body << "--" << boundary << "\r\n"
+         << "Content-Disposition: form-data; name=\""
+         << std::string(field, value) << "\"\r\n\r\n"
+         << value + 1 << "\r\n";
+  }
+  body << "--" << boundary << "\r\n"
+       << "Content-Disposition: form-data; name=\"img\"; filename=\""
+       << image.file.substr(image.file.rfind('/') + 1) << "\"\r\n"
+       << "Content-Type: application/octet-stream\r\n\r\n"
+       << data << "\r\n"
+       << "--" << boundary << "--\r\n";
+  std::string const request = body.str();
+  std::string const content_type = "multipart/form-data; boundary=" + boundary;
+
+  report("request", image, data.size(),
+         measure([&](stage_timings &) {
+                   bench_input input(content_type, request);
+                   std::ostringstream response;
+                   handle_request(&input, response, serving::server);
+                 }, image.repetitions, true));
+}
+
+// What a CGI process spends before and on its single request.  Every
+// scenario runs in a fresh child of a process which has not initialized
+// anything, so only loading the executable is left out.
+static void
+bench_startup(std::string const &program)
+{
+  auto const request = [&program](std::string const &query) {
+    return [&program, query](stage_timings &) {
+      initialize(program.c_str());
+      bench_input input("", "", query);
+      std::ostringstream response;
+      handle_request(&input, response, serving::cgi);
+    };
+  };
+  std::pair<char const *, std::function<void(stage_timings &)>> const scenarios[] = {
+    { "initialize", [&program](stage_timings &) { initialize(program.c_str()); } },
+    { "magick", [&program](stage_timings &) { convert_initialize(program.c_str()); } },
+    // What show=formats used to do on every request
+    { "magick_formats", [&program](stage_timings &) {
+        convert_initialize(program.c_str());
+        std::size_t formats;
+        MagickCore::ExceptionInfo *exception = MagickCore::AcquireExceptionInfo();
+        if (MagickCore::MagickInfo const **info =
+            MagickCore::GetMagickInfoList("*", &formats, exception))
+          MagickCore::RelinquishMagickMemory(info);
+        MagickCore::DestroyExceptionInfo(exception);
+      } },
+    { "landing", request("") },
+    { "landing_de", request("lang=de") },
+    { "formats", request("show=formats") }
+  };
+  for (auto const &scenario: scenarios) {
+    measurement const cold = measure(scenario.second);
+    if (cold.runs.empty()) continue;
+    record("startup").set("scenario", scenario.first)
+                     .set("ms", cold.runs.front()[std::size_t(stage::total)] * 1000)
+                     .set("peak_rss_kb", cold.peak_kilobytes)
+                     .print();
+  }
+}
+
+// img2brl_bench [--json] [--corpus DIRECTORY] [pack] [shrink] [corpus]
+//               [dither] [memory] [startup]
+//
+// Without suite names everything runs.  The corpus is generated into
+// DIRECTORY (default img2brl_bench_corpus) unless it is already there.
+int main(int argc, char *argv[])
+{
+  std::string directory = "img2brl_bench_corpus";
+  std::vector<std::string> suites;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--json") == 0) json_output = true;
+    else if (std::strcmp(argv[i], "--corpus") == 0 and i + 1 < argc)
+      directory = argv[++i];
+    else suites.push_back(argv[i]);
+  }
+  auto const run = [&suites](char const *suite) {
+    return suites.empty() or
+           std::find(suites.begin(), suites.end(), suite) != suites.end();
+  };
+
+  // Requests must neither hit nor fill any cache
+  setenv("IMG2BRL_CACHE_DIR", "", 1);
+  setenv("IMG2BRL_SHARED_CACHE", "", 1);
+
+  if (run("pack")) {
+    bench_pack_kernels(12000, 8000, 5);
+    bench_pack_kernels(640, 480, 200);
+  }
+  if (run("dither")) {
+    bench_dither_engines(5472, 3648, 5);
+    bench_dither_engines(640, 480, 200);
+  }
+
+  // Before anything is initialized in this process
+  if (run("startup")) bench_startup(argv[0]);
+
+  initialize(argv[0]);
+  convert_initialize(argv[0]);
+  if (run("shrink")) {
+    bench_shrink_on_load(5472, 3648, "JPEG", 80);
+    bench_shrink_on_load(5472, 3648, "PNG", 80);
+  }
+  if (run("corpus") or run("dither") or run("memory")) {
+    for (corpus_image const &image: make_corpus(directory)) {
+      std::string const data = read_file(image.file);
+      if (data.empty()) {
+        record("corpus").set("image", image.name)
+                        .set("error", "could not be generated").print();
+        continue;
+      }
+      if (run("corpus")) {
+        bench_convert(image, data);
+        bench_request(image, data);
+      }
+      if (run("dither") and image.frames == 1) bench_dither(image, data);
+      if (run("memory")) bench_memory(image, data);
+    }
+  }
+  finalize();
+}
@@ -0,0 +1,85 @@
+#include "cells.h"
+#include "fields.h"
+#include "pack.h"
+
+#include <algorithm>
+#include <ostream>
+
+std::string
+braille_cells::utf8() const
+{
+  pack_kernel const &kernel = best_pack_kernel();
+  std::string result(rows() * (columns() * 3 + 1), '\0');
+  char *out = &result[0];
+  for (std::size_t y = 0; y < rows(); ++y) {
+    out = kernel.encode(row(y), columns(), out);
+    *out++ = '\n';
+  }
+  return result;
+}
+
+void
+write_utf8(std::ostream &out, braille_cells const &cells)
+{
+  pack_kernel const &kernel = best_pack_kernel();
+  std::string line(cells.columns() * 3 + 1, '\n');
+  for (std::size_t y = 0; y < cells.rows(); ++y) {
+    kernel.encode(cells.row(y), cells.columns(), &line[0]);
+    out.write(line.data(), line.size());
+  }
+}
+
+void
+write_binary(std::ostream &out, braille_cells const &cells)
+{
+  out.write(reinterpret_cast<char const *>(cells.bytes().data()),
+            cells.bytes().size());
+}
+
+bool
+diff_cells( braille_cells const &before, braille_cells const &after
+          , std::vector<cell_run> &runs
+          )
+{
+  if (before.width() != after.width() or before.height() != after.height())
+    return false;
+
+  std::size_t const gap = 4;
+  runs.clear();
+  for (std::size_t y = 0; y < after.rows(); ++y) {
+    unsigned char const *const old_row = before.row(y), *const new_row = after.row(y);
+    if (std::equal(new_row, new_row + after.columns(), old_row)) continue;
+    for (std::size_t x = 0; x < after.columns(); ++x) {
+      if (old_row[x] == new_row[x]) continue;
+      if (not runs.empty() and runs.back().row == y and
+          x - (runs.back().column + runs.back().count) <= gap)
+        runs.back().count = x + 1 - runs.back().column;
+      else
+        runs.push_back(cell_run{y, x, 1});
+    }
+  }
+  return true;
+}
+
+void
+serialize(std::ostream &out, braille_cells const &cells)
+{
+  write_field(out, cells.width());
+  write_field(out, cells.height());
+  write_field(out, std::string(cells.bytes().begin(), cells.bytes().end()));
+}
+
+bool
+deserialize(std::istream &in, braille_cells &cells)
+{
+  std::size_t width, height;
+  std::string bytes;
+  if (not (read_field(in, width) and read_field(in, height) and
+           read_field(in, bytes)))
+    return false;
+  braille_cells result(width, height);
+  if (bytes.size() != result.bytes().size()) return false;
+  std::copy(bytes.begin(), bytes.end(), result.row(0));
+  cells = std::move(result);
+  return true;
+}
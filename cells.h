@@ -0,0 +1,63 @@
+#ifndef IMG2BRL_CELLS_H
+#define IMG2BRL_CELLS_H
+
+#include <cstddef>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+// Packed braille, one byte per cell with the bit layout of the low byte of
+// the Unicode braille code point (see pack.h).  Rows of columns() cells are
+// stored next to each other.  This is what conversions produce and caches
+// store; UTF-8 is only written on output.
+class braille_cells
+{
+  std::size_t w, h; // in dots
+  std::vector<unsigned char> data;
+
+public:
+  braille_cells(): w{0}, h{0} {}
+  // Blank cells for width x height dots
+  braille_cells(std::size_t width, std::size_t height)
+  : w{width}, h{height}, data((width + 1) / 2 * ((height + 3) / 4), 0)
+  {}
+
+  std::size_t width() const { return w; }
+  std::size_t height() const { return h; }
+  std::size_t columns() const { return (w + 1) / 2; }
+  std::size_t rows() const { return (h + 3) / 4; }
+
+  unsigned char *row(std::size_t y) { return data.data() + y * columns(); }
+  unsigned char const *row(std::size_t y) const
+  { return data.data() + y * columns(); }
+  std::vector<unsigned char> const &bytes() const { return data; }
+
+  // Unicode braille, one line per row
+  std::string utf8() const;
+};
+
+// Write cells as UTF-8 without building the whole text first
+void write_utf8(std::ostream &, braille_cells const &);
+
+// Write the cells as they are, rows() * columns() bytes
+void write_binary(std::ostream &, braille_cells const &);
+
+// count cells of one row in which two frames of an animation differ
+struct cell_run
+{
+  std::size_t row, column, count;
+};
+
+// Collect the runs of cells in which after differs from before.  Runs less
+// than a few cells apart are merged, as describing a run costs more than
+// repeating those cells.  Returns false without touching runs if the sizes
+// differ, after then has to be sent whole.
+bool diff_cells( braille_cells const &before, braille_cells const &after
+               , std::vector<cell_run> &runs
+               );
+
+// Binary safe representation for the caches
+void serialize(std::ostream &, braille_cells const &);
+bool deserialize(std::istream &, braille_cells &);
+
+#endif
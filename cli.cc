@@ -0,0 +1,428 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Magick++/Include.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "convert.h"
+#include "response.h"
+#include "timings.h"
+#include "work_stealing.h"
+
+typedef std::chrono::steady_clock clock_type;
+
+namespace /* anonymous */ {
+
+char const usage[] =
+  "Usage: img2brl [OPTION]... [FILE|DIRECTORY]...\n"
+  "Convert images to braille, reading the files to convert one per line from\n"
+  "standard input if none are given or one is -.  Directories are searched\n"
+  "recursively.\n"
+  "\n"
+  "  --trim, --normalize, --negate   as on the web form\n"
+  "  --cols N           resize to at most N braille cells wide\n"
+  "  --dither MODE      bilevel, otsu, bayer or floyd-steinberg (bilevel)\n"
+  "  --frames RANGE     convert frames or pages N, N-M or N- instead of the first\n"
+  "  --diff             in JSON, give frames as changes to their predecessor\n"
+  "  --format LIST      comma separated outputs: txt, brl, json (txt)\n"
+  "  --output DIR       write outputs below DIR instead of beside the images\n"
+  "  --threads N        convert on N threads (one per core)\n"
+  "  --force            convert even if the outputs are up to date\n"
+  "  --quiet            only report errors\n";
+
+// A file to convert and where its outputs go, without their extension
+struct job
+{
+  std::string source, target;
+};
+
+struct settings
+{
+  conversion_options options;
+  frame_range frames;
+  bool animated, diff;
+  bool txt, brl, json;
+  std::string output;
+  std::size_t threads;
+  bool force, quiet;
+
+  settings(): animated{false}, diff{false}
+            , txt{false}, brl{false}, json{false}, threads{0}
+            , force{false}, quiet{false}
+  {}
+};
+
+bool
+ends_with(std::string const &text, char const *suffix)
+{
+  std::size_t const length = std::strlen(suffix);
+  return text.size() >= length and
+         text.compare(text.size() - length, length, suffix) == 0;
+}
+
+// Where the outputs for source go.  relative is the part of its path which
+// is kept below --output.
+std::string
+target_for(settings const &config, std::string const &source, std::string relative)
+{
+  if (config.output.empty()) return source;
+  while (relative.compare(0, 2, "./") == 0) relative.erase(0, 2);
+  return config.output + '/' + relative;
+}
+
+// All regular files below directory in name order, so related files stay
+// together.  Our own outputs and hidden files are left out.
+void
+collect( settings const &config, std::string const &directory
+       , std::string const &relative, std::vector<job> &jobs
+       )
+{
+  DIR *stream = opendir(directory.c_str());
+  if (not stream) {
+    std::cerr << directory << ": " << std::strerror(errno) << std::endl;
+    return;
+  }
+  std::vector<std::string> names;
+  while (dirent *entry = readdir(stream))
+    if (entry->d_name[0] != '.') names.push_back(entry->d_name);
+  closedir(stream);
+  std::sort(names.begin(), names.end());
+
+  for (std::string const &name: names) {
+    std::string const path = directory + '/' + name;
+    std::string const inner = relative.empty()? name: relative + '/' + name;
+    struct stat info;
+    if (stat(path.c_str(), &info) == -1) continue;
+    if (S_ISDIR(info.st_mode)) {
+      collect(config, path, inner, jobs);
+    } else if (S_ISREG(info.st_mode) and not ends_with(name, ".txt") and
+               not ends_with(name, ".brl") and not ends_with(name, ".json")) {
+      jobs.push_back(job{path, target_for(config, path, inner)});
+    }
+  }
+}
+
+void
+add(settings const &config, std::string const &path, std::vector<job> &jobs)
+{
+  struct stat info;
+  if (stat(path.c_str(), &info) == 0 and S_ISDIR(info.st_mode)) {
+    collect(config, path, "", jobs);
+  } else {
+    std::string::size_type const slash = path.rfind('/');
+    jobs.push_back(job{path, target_for(config, path,
+                                        slash == std::string::npos
+                                        ? path: path.substr(slash + 1))});
+  }
+}
+
+// Create the directories leading to path
+void
+make_parents(std::string const &path)
+{
+  for (std::string::size_type slash = path.find('/', 1);
+       slash != std::string::npos; slash = path.find('/', slash + 1))
+    mkdir(path.substr(0, slash).c_str(), 0777);
+}
+
+std::vector<std::string>
+extensions(settings const &config)
+{
+  std::vector<std::string> result;
+  if (config.txt) result.push_back(".txt");
+  if (config.brl) result.push_back(".brl");
+  if (config.json) result.push_back(".json");
+  return result;
+}
+
+// True if every output exists and is not older than the source
+bool
+up_to_date(settings const &config, job const &item)
+{
+  struct stat source;
+  if (stat(item.source.c_str(), &source) == -1) return false;
+  for (std::string const &extension: extensions(config)) {
+    struct stat target;
+    if (stat((item.target + extension).c_str(), &target) == -1 or
+        target.st_mtime < source.st_mtime)
+      return false;
+  }
+  return true;
+}
+
+// Write contents to path through a temporary file, so an interrupted run
+// never leaves an output behind which looks up to date
+void
+store(std::string const &path, std::string const &contents)
+{
+  std::string const temporary = path + ".tmp" + std::to_string(getpid());
+  {
+    std::ofstream file(temporary, std::ios::binary);
+    file << contents;
+    if (not file.flush()) {
+      std::remove(temporary.c_str());
+      throw std::runtime_error(path + ": " + std::strerror(errno));
+    }
+  }
+  if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+    std::remove(temporary.c_str());
+    throw std::runtime_error(path + ": " + std::strerror(errno));
+  }
+}
+
+// The same fields as mode=json of the web interface
+std::string
+json_for( settings const &config, job const &item
+        , std::vector<conversion> const &results
+        )
+{
+  std::ostringstream text;
+  if (config.animated) {
+    response_writer json(text);
+    json.raw('{')
+        .key("src").raw('{')
+        .key("file").json(item.source);
+    if (not results.empty())
+      json.raw(',')
+          .key("format").json(results.front().format)
+          .raw(',')
+          .key("width").number(results.front().source_width)
+          .raw(',')
+          .key("height").number(results.front().source_height);
+    json.raw('}')
+        .raw(',')
+        .key("frames");
+    write_json_frames(json, results, config.frames.first, config.diff);
+    json.raw("}\n");
+    json.flush();
+  } else {
+    conversion const &result = results.front();
+    response_writer json(text);
+    json.raw('{')
+        .key("src").raw('{')
+        .key("file").json(item.source)
+        .raw(',')
+        .key("format").json(result.format)
+        .raw(',');
+    if (not result.label.empty())
+      json.key("label").json(result.label)
+          .raw(',');
+    if (not result.comment.empty())
+      json.key("comment").json(result.comment)
+          .raw(',');
+    json.key("width").number(result.source_width)
+        .raw(',')
+        .key("height").number(result.source_height)
+        .raw('}')
+        .raw(',')
+        .key("width").number(result.braille.width())
+        .raw(',')
+        .key("height").number(result.braille.height())
+        .raw(',')
+        .key("braille").json_braille(result.braille)
+        .raw("}\n");
+    json.flush();
+  }
+  return text.str();
+}
+
+// Totals of a run, updated from all workers
+struct progress
+{
+  std::atomic<std::size_t> converted, skipped, failed;
+  std::atomic<unsigned long long> bytes, pixels;
+  std::mutex mutex; // for timings and standard error
+  stage_timings timings;
+
+  progress(): converted{0}, skipped{0}, failed{0}, bytes{0}, pixels{0} {}
+};
+
+void
+convert_one(settings const &config, job const &item, progress &totals)
+{
+  if (not config.force and up_to_date(config, item)) {
+    ++totals.skipped;
+    return;
+  }
+
+  try {
+    std::ifstream file(item.source, std::ios::binary);
+    if (not file) throw std::runtime_error(std::strerror(errno));
+    std::string const data((std::istreambuf_iterator<char>(file)),
+                           std::istreambuf_iterator<char>());
+    stage_timings timings;
+    std::vector<conversion> const results =
+      // Files already keep every core busy
+      config.animated? convert_frames(data, config.options, config.frames, &timings,
+                                      config.threads > 1? 1: 0)
+                     : std::vector<conversion>(1, convert(data, config.options,
+                                                          &timings));
+
+    // Frames follow each other, in text separated by form feeds
+    if (not config.output.empty()) make_parents(item.target);
+    if (config.txt) {
+      std::string braille;
+      for (conversion const &result: results)
+        braille += (braille.empty()? "": "\f\n") + result.braille.utf8();
+      store(item.target + ".txt", braille);
+    }
+    if (config.brl) {
+      std::ostringstream cells;
+      for (conversion const &result: results) serialize(cells, result.braille);
+      store(item.target + ".brl", cells.str());
+    }
+    if (config.json) store(item.target + ".json", json_for(config, item, results));
+
+    ++totals.converted;
+    totals.bytes += data.size();
+    for (conversion const &result: results)
+      totals.pixels += result.source_width * result.source_height;
+    std::lock_guard<std::mutex> lock(totals.mutex);
+    totals.timings.add(timings);
+  } catch (std::exception const &e) {
+    ++totals.failed;
+    std::lock_guard<std::mutex> lock(totals.mutex);
+    std::cerr << item.source << ": " << e.what() << std::endl;
+  }
+}
+
+void
+report( progress const &totals, std::size_t threads
+      , clock_type::duration elapsed
+      )
+{
+  double const seconds =
+    std::max(1e-9, std::chrono::duration<double>(elapsed).count());
+  char line[256];
+  std::snprintf(line, sizeof line,
+                "img2brl: %zu converted, %zu up to date, %zu failed"
+                " on %zu threads in %.2f s\n",
+                totals.converted.load(), totals.skipped.load(),
+                totals.failed.load(), threads, seconds);
+  std::cerr << line;
+  std::snprintf(line, sizeof line,
+                "img2brl: %.1f images/s, %.1f Mpixel/s, %.1f MB/s read\n",
+                totals.converted / seconds, totals.pixels / seconds / 1e6,
+                totals.bytes / seconds / 1e6);
+  std::cerr << line;
+
+  // Summed over all threads, so this shows where the time goes rather than
+  // how long it took
+  for (std::size_t i = 0; i < stage_count; ++i) {
+    stage const step = static_cast<stage>(i);
+    double const spent = std::chrono::duration<double>(totals.timings[step]).count();
+    if (step == stage::total or spent == 0) continue;
+    std::snprintf(line, sizeof line, "img2brl: %-10s %8.2f s cpu\n",
+                  stage_name(step), spent);
+    std::cerr << line;
+  }
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+  settings config;
+  std::vector<std::string> paths;
+  for (int i = 1; i < argc; ++i) {
+    std::string const argument = argv[i];
+    if (argument == "--trim") {
+      config.options.trim = true;
+    } else if (argument == "--normalize") {
+      config.options.normalize = true;
+    } else if (argument == "--negate") {
+      config.options.negate = true;
+    } else if (argument == "--cols" and i + 1 < argc) {
+      config.options.columns = std::strtoul(argv[++i], nullptr, 10);
+    } else if (argument == "--dither" and i + 1 < argc) {
+      if (not parse_dither_mode(argv[++i], config.options.dither)) {
+        std::cerr << "img2brl: unknown dither mode " << argv[i] << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (argument == "--frames" and i + 1 < argc) {
+      config.animated = true;
+      if (not parse_frame_range(argv[++i], config.frames)) {
+        std::cerr << "img2brl: invalid frame range " << argv[i] << std::endl;
+        return EXIT_FAILURE;
+      }
+    } else if (argument == "--diff") {
+      config.diff = true;
+    } else if (argument == "--format" and i + 1 < argc) {
+      std::istringstream list(argv[++i]);
+      for (std::string format; std::getline(list, format, ',');) {
+        if (format == "txt") config.txt = true;
+        else if (format == "brl") config.brl = true;
+        else if (format == "json") config.json = true;
+        else {
+          std::cerr << "img2brl: unknown format " << format << std::endl;
+          return EXIT_FAILURE;
+        }
+      }
+    } else if (argument == "--output" and i + 1 < argc) {
+      config.output = argv[++i];
+      while (config.output.size() > 1 and config.output.back() == '/')
+        config.output.pop_back();
+    } else if (argument == "--threads" and i + 1 < argc) {
+      config.threads = std::strtoul(argv[++i], nullptr, 10);
+    } else if (argument == "--force") {
+      config.force = true;
+    } else if (argument == "--quiet") {
+      config.quiet = true;
+    } else if (argument == "--help") {
+      std::cout << usage;
+      return EXIT_SUCCESS;
+    } else if (argument.compare(0, 2, "--") == 0) {
+      std::cerr << usage;
+      return EXIT_FAILURE;
+    } else {
+      paths.push_back(argument);
+    }
+  }
+  if (not config.txt and not config.brl and not config.json) config.txt = true;
+  if (not config.threads)
+    config.threads = std::max(1U, std::thread::hardware_concurrency());
+
+  clock_type::time_point const start = clock_type::now();
+  std::vector<job> jobs;
+  if (paths.empty()) paths.push_back("-");
+  for (std::string const &path: paths) {
+    if (path == "-") {
+      for (std::string line; std::getline(std::cin, line);)
+        if (not line.empty()) add(config, line, jobs);
+    } else {
+      add(config, path, jobs);
+    }
+  }
+
+  convert_initialize(argv[0]);
+  // Whole images in parallel scale better than ImageMagick's own threads
+  if (config.threads > 1)
+    MagickCore::SetMagickResourceLimit(MagickCore::ThreadResource, 1);
+
+  progress totals;
+  steal_work(jobs.size(), config.threads, [&](std::size_t i) {
+    convert_one(config, jobs[i], totals);
+  });
+  if (not config.quiet)
+    report(totals, std::max<std::size_t>(1, std::min(config.threads, jobs.size())),
+           clock_type::now() - start);
+
+  return totals.failed? EXIT_FAILURE: EXIT_SUCCESS;
+}
@@ -0,0 +1,24 @@
+#include "conversion.h"
+#include "fields.h"
+
+void
+serialize(std::ostream &out, conversion const &result)
+{
+  write_field(out, result.content_type);
+  write_field(out, result.format);
+  write_field(out, result.label);
+  write_field(out, result.comment);
+  write_field(out, result.source_width);
+  write_field(out, result.source_height);
+  serialize(out, result.braille);
+}
+
+bool
+deserialize(std::istream &in, conversion &result)
+{
+  return read_field(in, result.content_type) and read_field(in, result.format)
+     and read_field(in, result.label) and read_field(in, result.comment)
+     and read_field(in, result.source_width)
+     and read_field(in, result.source_height)
+     and deserialize(in, result.braille);
+}
@@ -0,0 +1,52 @@
+#ifndef IMG2BRL_CONVERSION_H
+#define IMG2BRL_CONVERSION_H
+
+#include <cstddef>
+#include <iosfwd>
+#include <string>
+
+#include "cells.h"
+#include "dither.h"
+
+// What to do with an image before packing it into braille
+struct conversion_options
+{
+  bool trim, normalize, negate;
+  std::size_t columns; // maximum width in braille cells, 0 keeps the size
+  dither_mode dither;
+
+  conversion_options()
+  : trim{false}, normalize{false}, negate{false}, columns{0}
+  , dither{dither_mode::bilevel}
+  {}
+
+  // Canonical text form, part of cache keys.  pipeline names the version
+  // of the conversion itself: it changes whenever the same options give
+  // different dots, so results cached by an older version are not served.
+  std::string key() const
+  {
+    return std::string("pipeline=2 trim=") + (trim? "1": "0")
+         + " normalize=" + (normalize? "1": "0")
+         + " negate=" + (negate? "1": "0")
+         + " cols=" + std::to_string(columns)
+         + (dither != dither_mode::bilevel? std::string(" dither=")
+                                            + dither_name(dither)
+                                          : std::string());
+  }
+};
+
+// The braille rendition of an image along with what we know about its source
+struct conversion
+{
+  std::string content_type, format, label, comment;
+  std::size_t source_width, source_height;
+  braille_cells braille;
+
+  conversion(): source_width{0}, source_height{0} {}
+};
+
+// Binary safe representation for the caches
+void serialize(std::ostream &, conversion const &);
+bool deserialize(std::istream &, conversion &);
+
+#endif
@@ -0,0 +1,376 @@
+#include "convert.h"
+#include "gray.h"
+#include "stream_convert.h"
+#include "ubrl.h"
+#include "work_stealing.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <mutex>
+
+#include <Magick++/Exception.h>
+#include <Magick++/Functions.h>
+#include <Magick++/Geometry.h>
+
+void
+convert_initialize(char const *path)
+{
+  static std::once_flag once;
+  std::call_once(once, [path] { Magick::InitializeMagick(path); });
+}
+
+void
+set_resource_limits(decode_limits const &limits, bool with_time)
+{
+  using namespace MagickCore;
+  SetMagickResourceLimit(MemoryResource, limits.memory);
+  SetMagickResourceLimit(MapResource, limits.map);
+  SetMagickResourceLimit(DiskResource, limits.disk);
+  SetMagickResourceLimit(AreaResource, limits.max_area);
+  if (with_time and limits.time.count())
+    SetMagickResourceLimit(TimeResource, limits.time.count());
+}
+
+image_header
+ping_image(std::string const &data, std::size_t max_frames)
+{
+  std::unique_ptr<MagickCore::ExceptionInfo,
+                  MagickCore::ExceptionInfo *(*)(MagickCore::ExceptionInfo *)>
+    exception(MagickCore::AcquireExceptionInfo(), MagickCore::DestroyExceptionInfo);
+  std::unique_ptr<MagickCore::ImageInfo,
+                  MagickCore::ImageInfo *(*)(MagickCore::ImageInfo *)>
+    info(MagickCore::AcquireImageInfo(), MagickCore::DestroyImageInfo);
+  info->number_scenes = max_frames;
+  std::unique_ptr<MagickCore::Image, MagickCore::Image *(*)(MagickCore::Image *)>
+    list(MagickCore::PingBlob(info.get(), data.data(), data.size(),
+                              exception.get()),
+         MagickCore::DestroyImageList);
+  if (exception->severity >= MagickCore::ErrorException)
+    Magick::throwException(exception.get());
+  if (not list) throw Magick::ErrorMissingDelegate("No image was loaded");
+
+  image_header header{ list->magick, 0, 0, 0 };
+  for (MagickCore::Image const *frame = list.get(); frame; frame = frame->next) {
+    // Composing an animation allocates the whole canvas for every frame
+    header.width = std::max({ header.width, frame->columns, frame->page.width });
+    header.height = std::max({ header.height, frame->rows, frame->page.height });
+    ++header.frames;
+  }
+  return header;
+}
+
+Magick::Image
+read_image(std::string const &data, std::size_t width_hint)
+{
+  std::unique_ptr<MagickCore::ExceptionInfo,
+                  MagickCore::ExceptionInfo *(*)(MagickCore::ExceptionInfo *)>
+    exception(MagickCore::AcquireExceptionInfo(), MagickCore::DestroyExceptionInfo);
+  std::unique_ptr<MagickCore::ImageInfo,
+                  MagickCore::ImageInfo *(*)(MagickCore::ImageInfo *)>
+    info(MagickCore::AcquireImageInfo(), MagickCore::DestroyImageInfo);
+  if (width_hint) {
+    // libjpeg scales by up to 1/8 while decoding, never below the hint
+    std::string const size = std::to_string(width_hint) + 'x'
+                           + std::to_string(width_hint);
+    MagickCore::SetImageOption(info.get(), "jpeg:size", size.c_str());
+  }
+  MagickCore::Image *image = MagickCore::BlobToImage(info.get(),
+                                                     data.data(), data.size(),
+                                                     exception.get());
+  if (exception->severity >= MagickCore::ErrorException) {
+    if (image) MagickCore::DestroyImageList(image);
+    Magick::throwException(exception.get());
+  }
+  if (not image) throw Magick::ErrorMissingDelegate("No image was loaded");
+  if (MagickCore::Image *rest = image->next) {
+    image->next = rest->previous = nullptr;
+    MagickCore::DestroyImageList(rest);
+  }
+  return Magick::Image(image);
+}
+
+void
+prepare( Magick::Image &image, conversion_options const &options
+       , stage_timings *timings
+       )
+{
+  std::size_t const width = options.columns * 2;
+  if (options.trim) {
+    stage_timer timer(timings, stage::trim);
+    image.trim();
+  }
+  if (width and image.columns() > 2 * width) {
+    // Averaging whole blocks of pixels is cheap and leaves only a small
+    // image for the properly filtered resize below
+    stage_timer timer(timings, stage::scale);
+    image.scale(Magick::Geometry(2 * width, 0));
+  }
+  if (options.normalize) {
+    stage_timer timer(timings, stage::normalize);
+    image.normalize();
+  }
+  if (options.negate) {
+    stage_timer timer(timings, stage::negate);
+    //  image.threshold(50.0);
+    image.negate(true);
+  }
+  if (width) {
+    stage_timer timer(timings, stage::resize);
+    Magick::Geometry geometry(width, 0);
+    geometry.less(false);
+    geometry.greater(true);
+    image.resize(geometry);
+  }
+}
+
+Magick::Image
+prepare_image( std::string const &data, conversion_options const &options
+             , stage_timings *timings
+             )
+{
+  Magick::Image image;
+  {
+    stage_timer timer(timings, stage::decode);
+    // Trimming needs every pixel to find the edges
+    image = read_image(data, options.trim? 0: options.columns * 2);
+  }
+  prepare(image, options, timings);
+  return image;
+}
+
+namespace /* anonymous */ {
+
+// Pack grey pixels into the braille of result
+void
+pack( gray_image const &gray, conversion_options const &options
+    , stage_timings *timings, conversion &result
+    )
+{
+  stage_timer timer(timings, stage::convert);
+  if (gray.pixels.empty()) return;
+  if (options.dither == dither_mode::bilevel) {
+    // ImageMagick's reduction to two colours needs an image, by now a small
+    // one with a single channel
+    Magick::Image const small(gray.width, gray.height, "I", Magick::CharPixel,
+                              gray.pixels.data());
+    result.braille = ubrl(small).cells();
+  } else {
+    dither(gray.pixels.data(), gray.width, gray.height, options.dither,
+           result.braille);
+  }
+}
+
+// Apply options through the fused grey pipeline and pack the result
+conversion
+pack( Magick::Image const &image, conversion_options const &options
+    , stage_timings *timings
+    )
+{
+  conversion result;
+  result.format = image.format();
+  result.label = image.label();
+  result.comment = image.comment();
+  result.source_width = image.baseColumns();
+  result.source_height = image.baseRows();
+  pack(gray_pipeline(image, options, timings), options, timings, result);
+  return result;
+}
+
+typedef std::unique_ptr<MagickCore::ExceptionInfo,
+                        MagickCore::ExceptionInfo *(*)(MagickCore::ExceptionInfo *)>
+        exception_pointer;
+typedef std::unique_ptr<MagickCore::Image,
+                        MagickCore::Image *(*)(MagickCore::Image *)>
+        image_list;
+
+// Formats whose frames build on each other
+bool
+animation(char const *magick)
+{
+  for (char const *format: { "GIF", "GIF87", "MNG", "APNG", "WEBP" })
+    if (std::strcmp(magick, format) == 0) return true;
+  return false;
+}
+
+}
+
+conversion
+convert( std::string const &data, conversion_options const &options
+       , stage_timings *timings
+       )
+{
+  conversion result;
+  gray_image gray;
+  {
+    gray_image source;
+    {
+      stage_timer timer(timings, stage::decode);
+      source = read_gray(data, options.trim? 0: options.columns * 2, result);
+    }
+    gray = gray_pipeline(source, options, timings);
+  }
+  pack(gray, options, timings, result);
+  return result;
+}
+
+bool
+parse_frame_range(std::string const &text, frame_range &range)
+{
+  char const *const begin = text.c_str();
+  char *end;
+  if (text.empty() or not std::isdigit(static_cast<unsigned char>(*begin)))
+    return false;
+  errno = 0;
+  range.first = std::strtoul(begin, &end, 10);
+  range.count = 1;
+  if (*end == '-') {
+    range.count = 0;
+    if (*++end) {
+      if (not std::isdigit(static_cast<unsigned char>(*end))) return false;
+      std::size_t const last = std::strtoul(end, &end, 10);
+      // A count of every possible frame would wrap around to 0, meaning all
+      if (last < range.first or
+          last - range.first == std::numeric_limits<std::size_t>::max())
+        return false;
+      range.count = last - range.first + 1;
+    }
+  }
+  return errno != ERANGE and *end == '\0';
+}
+
+image_header
+admit_image(std::string const &data, decode_limits const &limits)
+{
+  frame_range first;
+  first.count = 1;
+  return admit_image(data, limits, first);
+}
+
+image_header
+admit_image( std::string const &data, decode_limits const &limits
+           , frame_range &range
+           )
+{
+  // Compared without adding to first, which could wrap around
+  if (range.first >= limits.max_frames or
+      (range.count and range.count > limits.max_frames - range.first))
+    throw image_too_large("frames beyond the limit of "
+                          + std::to_string(limits.max_frames) + " asked for",
+                          image_header{ std::string(), 0, 0, 0 });
+
+  // One frame beyond the limit is enough to know it is exceeded
+  image_header const header =
+    ping_image(data, range.first + (range.count? range.count
+                                               : limits.max_frames - range.first + 1));
+  std::uintmax_t const area = std::uintmax_t(header.width) * header.height;
+  if (header.width > limits.max_side or header.height > limits.max_side)
+    throw image_too_large(std::to_string(header.width) + 'x'
+                          + std::to_string(header.height)
+                          + " pixels exceed the limit of "
+                          + std::to_string(limits.max_side) + " per side",
+                          header);
+  if (area > limits.max_area)
+    throw image_too_large(std::to_string(area) + " pixels exceed the limit of "
+                          + std::to_string(limits.max_area), header);
+
+  std::size_t end = header.frames;
+  if (range.count) end = std::min(end, range.first + range.count);
+  else if (range.first < end) range.count = end - range.first;
+  std::size_t const decoded = animation(header.format.c_str())? end
+                            : end > range.first? end - range.first: 0;
+  if (decoded > limits.max_frames)
+    throw image_too_large(std::to_string(decoded) + " frames exceed the limit of "
+                          + std::to_string(limits.max_frames), header);
+  return header;
+}
+
+std::vector<Magick::Image>
+read_frames(std::string const &data, frame_range const &range)
+{
+  exception_pointer exception(MagickCore::AcquireExceptionInfo(),
+                              MagickCore::DestroyExceptionInfo);
+  std::unique_ptr<MagickCore::ImageInfo,
+                  MagickCore::ImageInfo *(*)(MagickCore::ImageInfo *)>
+    info(MagickCore::AcquireImageInfo(), MagickCore::DestroyImageInfo);
+  auto check = [&exception](MagickCore::Image *list) {
+    image_list owner(list, MagickCore::DestroyImageList);
+    if (exception->severity >= MagickCore::ErrorException)
+      Magick::throwException(exception.get());
+    if (not owner) throw Magick::ErrorMissingDelegate("No image was loaded");
+    return owner;
+  };
+
+  // Pinging the first frame tells the format without decoding any pixels
+  info->scene = 0;
+  info->number_scenes = 1;
+  bool const composed = animation(check(MagickCore::PingBlob(info.get(),
+                                                             data.data(),
+                                                             data.size(),
+                                                             exception.get()))
+                                  ->magick);
+
+  // Coders which honour scene and number_scenes skip the other frames
+  std::size_t const first = composed? 0: range.first;
+  info->scene = first;
+  // All frames from first on if the last one asked for is out of reach
+  bool const to_end = not range.count or
+    range.count > std::numeric_limits<std::size_t>::max() - range.first;
+  info->number_scenes = to_end? 0: range.first + range.count - first;
+  image_list list = check(MagickCore::BlobToImage(info.get(),
+                                                  data.data(), data.size(),
+                                                  exception.get()));
+  if (composed) {
+    list = check(MagickCore::CoalesceImages(list.get(), exception.get()));
+  }
+
+  // Take the frames apart, counting them ourselves as not all coders skip
+  std::vector<Magick::Image> frames;
+  std::size_t index = list->scene == first? first: 0;
+  for (MagickCore::Image *frame = list.release(); frame; ++index) {
+    MagickCore::Image *const next = frame->next;
+    frame->next = frame->previous = nullptr;
+    if (next) next->previous = nullptr;
+    if (index >= range.first and
+        (not range.count or index - range.first < range.count))
+      frames.push_back(Magick::Image(frame));
+    else
+      MagickCore::DestroyImage(frame);
+    frame = next;
+  }
+  return frames;
+}
+
+std::vector<conversion>
+convert_frames( std::string const &data, conversion_options const &options
+              , frame_range const &range, stage_timings *timings
+              , std::size_t threads
+              )
+{
+  std::vector<Magick::Image> frames;
+  {
+    stage_timer timer(timings, stage::decode);
+    frames = read_frames(data, range);
+  }
+
+  std::vector<conversion> results(frames.size());
+  std::vector<stage_timings> spent(frames.size());
+  std::vector<std::exception_ptr> errors(frames.size());
+  steal_work(frames.size(), threads, [&](std::size_t i) {
+    try {
+      results[i] = pack(frames[i], options, &spent[i]);
+    } catch (...) {
+      errors[i] = std::current_exception();
+    }
+  });
+  for (std::size_t i = 0; i < frames.size(); ++i) {
+    if (errors[i]) std::rethrow_exception(errors[i]);
+    if (timings) timings->add(spent[i]);
+  }
+  return results;
+}
@@ -0,0 +1,128 @@
+#ifndef IMG2BRL_CONVERT_H
+#define IMG2BRL_CONVERT_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <Magick++/Image.h>
+
+#include "conversion.h"
+#include "timings.h"
+
+// Set up ImageMagick for this process.  Only the first call has an effect,
+// so every front end and embedding program may call it before converting;
+// they then share one initialized context.  path is argv[0] or null.
+void convert_initialize(char const *path);
+
+// What the headers of an image tell without decoding any pixels
+struct image_header
+{
+  std::string format;        // ImageMagick's name of it, like "PNG"
+  std::size_t width, height; // the largest frame or canvas
+  std::size_t frames;
+};
+
+// Ping data, reading no more than max_frames frames (all if 0).  Throws like
+// read_image() if data is no image.
+image_header ping_image(std::string const &data, std::size_t max_frames = 0);
+
+// How large an image a request may decode, and the resources ImageMagick
+// may use while doing so
+struct decode_limits
+{
+  std::size_t max_side;    // width or height of a frame in pixels
+  std::uintmax_t max_area; // pixels of a frame
+  std::size_t max_frames;  // decoded at once
+  std::uintmax_t memory, map, disk; // bytes of pixel cache
+  std::chrono::seconds time;        // of the whole process, 0 for no limit
+
+  decode_limits()
+  : max_side{32768}, max_area{100000000}, max_frames{256}
+  , memory{std::uintmax_t(1) << 30}, map{std::uintmax_t(2) << 30}, disk{0}
+  , time{60}
+  {}
+};
+
+// Thrown by admit_image() for an image beyond decode_limits
+class image_too_large: public std::runtime_error
+{
+public:
+  image_header header;
+  image_too_large(std::string const &what, image_header const &header)
+  : std::runtime_error(what), header(header)
+  {}
+};
+
+// Set ImageMagick's memory, map, disk and area limits, and the time limit
+// if with_time is true.  They hold for the whole process.  ImageMagick
+// counts time from the first pixel cache of the process, so only processes
+// answering a single request should limit it.
+void set_resource_limits(decode_limits const &, bool with_time);
+
+// Decode data straight from memory.  Like Magick::Image(Blob const &),
+// warnings are ignored and only the first frame is kept.  Formats which can
+// decode at reduced resolution (JPEG) deliver not much less than
+// width_hint pixels wide if it is not zero.
+Magick::Image read_image(std::string const &data, std::size_t width_hint = 0);
+
+// Apply options to a decoded image with one ImageMagick operation after the
+// other, see prepare_image().  convert() does the same in a single pass,
+// see gray.h, this is the reference it is checked against.
+void prepare( Magick::Image &, conversion_options const &
+            , stage_timings *timings = nullptr
+            );
+
+// Decode data and apply options, ready to be packed into braille.  The
+// time spent in each step is added to timings unless it is null.
+Magick::Image prepare_image( std::string const &data, conversion_options const &
+                           , stage_timings *timings = nullptr
+                           );
+
+// The complete conversion, except for the content type which only the
+// caller knows.  data is decoded by read_gray() and options are applied by
+// gray_pipeline().
+conversion convert( std::string const &data, conversion_options const &
+                  , stage_timings *timings = nullptr
+                  );
+
+// Frames (or pages) first up to first + count - 1 of an image, counted from
+// 0.  A count of 0 means all frames from first on.
+struct frame_range
+{
+  std::size_t first, count;
+
+  frame_range(): first{0}, count{0} {}
+};
+
+// Parse "N", "N-M" or "N-" into range, false if text is none of them
+bool parse_frame_range(std::string const &text, frame_range &range);
+
+// Ping data and throw image_too_large if decoding its first frame, or the
+// frames in range, would exceed limits.  Animations count every frame up to
+// the last one in range, as they are decoded from frame 0.  A count of 0 in
+// range is replaced by the number of frames from first on.
+image_header admit_image(std::string const &data, decode_limits const &);
+image_header admit_image( std::string const &data, decode_limits const &
+                        , frame_range &
+                        );
+
+// Decode the frames in range, complete frames in order, fewer if the image
+// ends earlier.  Documents (TIFF, PDF) only decode the pages asked for.
+// Animation frames (GIF, MNG, WebP) which only store what changed are
+// composed onto their predecessors, which means decoding from frame 0.
+std::vector<Magick::Image> read_frames(std::string const &data, frame_range const &);
+
+// convert() every frame in range, in parallel on threads as with
+// steal_work().  The first exception of any frame is rethrown.
+std::vector<conversion> convert_frames( std::string const &data
+                                      , conversion_options const &
+                                      , frame_range const &
+                                      , stage_timings *timings = nullptr
+                                      , std::size_t threads = 0
+                                      );
+
+#endif
@@ -0,0 +1,190 @@
+#include "dither.h"
+#include "pack.h"
+
+#include <algorithm>
+#include <array>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace /* anonymous */ {
+
+// Pixel x of row y is a dot if it is darker than bayer[y % 4][x % 4] * 16 + 8
+unsigned char const bayer[4][4] = {
+  {  0,  8,  2, 10 },
+  { 12,  4, 14,  6 },
+  {  3, 11,  1,  9 },
+  { 15,  7, 13,  5 }
+};
+
+// Shift a row by 128 minus the matrix threshold of each pixel, saturating,
+// so thresholding the result at 128 dithers the original
+void
+bayer_row( unsigned char const *in, std::size_t width, std::size_t y
+         , unsigned char *out
+         )
+{
+  unsigned char add[16], subtract[16];
+  for (std::size_t x = 0; x < 16; ++x) {
+    int const offset = 128 - (bayer[y % 4][x % 4] * 16 + 8);
+    add[x] = std::max(offset, 0);
+    subtract[x] = std::max(-offset, 0);
+  }
+  std::size_t x = 0;
+#if defined(__SSE2__)
+  __m128i const up = _mm_loadu_si128(reinterpret_cast<__m128i const *>(add));
+  __m128i const down = _mm_loadu_si128(reinterpret_cast<__m128i const *>(subtract));
+  for (; x + 16 <= width; x += 16) {
+    __m128i const pixels = _mm_loadu_si128(reinterpret_cast<__m128i const *>(in + x));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x),
+                     _mm_subs_epu8(_mm_adds_epu8(pixels, up), down));
+  }
+#endif
+  for (; x < width; ++x)
+    out[x] = std::max(std::min(in[x] + add[x % 16], 255) - subtract[x % 16], 0);
+}
+
+// Diffuse the error of thresholding at 128 onto the neighbours, left to
+// right on even rows and right to left on odd ones.  Errors are kept in
+// sixteenths, with a pixel of padding on either side.
+void
+floyd_steinberg_row( unsigned char const *in, std::size_t width, std::size_t y
+                   , std::vector<int> &current, std::vector<int> &next
+                   , unsigned char *out
+                   )
+{
+  std::fill(next.begin(), next.end(), 0);
+  bool const forward = y % 2 == 0;
+  for (std::size_t i = 0; i < width; ++i) {
+    std::size_t const x = forward? i: width - 1 - i;
+    std::size_t const ahead = forward? x + 2: x, behind = forward? x: x + 2;
+    int const value = in[x] + (current[x + 1] + 8) / 16;
+    out[x] = value < 128? 0: 255;
+    int const error = value - out[x];
+    current[ahead] += error * 7;
+    next[behind] += error * 3;
+    next[x + 1] += error * 5;
+    next[ahead] += error;
+  }
+  current.swap(next);
+}
+
+}
+
+char const *
+dither_name(dither_mode mode)
+{
+  switch (mode) {
+  case dither_mode::bilevel: return "bilevel";
+  case dither_mode::otsu: return "otsu";
+  case dither_mode::bayer: return "bayer";
+  case dither_mode::floyd_steinberg: return "floyd-steinberg";
+  }
+  return "";
+}
+
+bool
+parse_dither_mode(std::string const &name, dither_mode &mode)
+{
+  for (dither_mode candidate: { dither_mode::bilevel, dither_mode::otsu
+                              , dither_mode::bayer, dither_mode::floyd_steinberg
+                              }) {
+    if (name == dither_name(candidate)) {
+      mode = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+unsigned char
+otsu_threshold(unsigned char const *pixels, std::size_t count)
+{
+  // Four histograms, so consecutive equal pixels do not wait for each
+  // other's increment
+  std::array<std::array<std::size_t, 256>, 4> partial{};
+  std::size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    ++partial[0][pixels[i]];
+    ++partial[1][pixels[i + 1]];
+    ++partial[2][pixels[i + 2]];
+    ++partial[3][pixels[i + 3]];
+  }
+  for (; i < count; ++i) ++partial[0][pixels[i]];
+
+  double total_sum = 0;
+  std::array<double, 256> histogram;
+  for (std::size_t value = 0; value < 256; ++value) {
+    histogram[value] = double(partial[0][value]) + partial[1][value]
+                     + partial[2][value] + partial[3][value];
+    total_sum += value * histogram[value];
+  }
+
+  double dark = 0, dark_sum = 0, best = 0;
+  unsigned char threshold = 0;
+  for (std::size_t value = 0; value < 256; ++value) {
+    dark += histogram[value];
+    dark_sum += value * histogram[value];
+    double const light = count - dark;
+    if (dark == 0) continue;
+    if (light == 0) break;
+    double const difference = dark_sum / dark - (total_sum - dark_sum) / light;
+    double const between = dark * light * difference * difference;
+    if (between > best) {
+      best = between;
+      threshold = value;
+    }
+  }
+  return threshold;
+}
+
+void
+dither( unsigned char const *luminance, std::size_t width, std::size_t height
+      , dither_mode mode, braille_cells &cells
+      )
+{
+  cells = braille_cells(width, height);
+  pack_kernel const &kernel = best_pack_kernel();
+  std::vector<unsigned char> const blank(width, 0xFF);
+
+  unsigned char threshold = 0x80;
+  if (mode == dither_mode::otsu)
+    threshold = std::min(otsu_threshold(luminance, width * height) + 1, 255);
+
+  // Modes which alter pixels write four rows here before packing them
+  std::vector<unsigned char> strip;
+  std::vector<int> current, next;
+  if (mode == dither_mode::bayer or mode == dither_mode::floyd_steinberg)
+    strip.resize(4 * width);
+  if (mode == dither_mode::floyd_steinberg) {
+    current.assign(width + 2, 0);
+    next.assign(width + 2, 0);
+  }
+
+  for (std::size_t y = 0; y < height; y += 4) {
+    unsigned char const *row[4];
+    for (std::size_t dy = 0; dy < 4; ++dy) {
+      row[dy] = blank.data();
+      if (y + dy >= height) continue;
+      unsigned char const *const in = luminance + (y + dy) * width;
+      unsigned char *const out = strip.data() + dy * width;
+      switch (mode) {
+      case dither_mode::bilevel:
+      case dither_mode::otsu:
+        row[dy] = in;
+        break;
+      case dither_mode::bayer:
+        bayer_row(in, width, y + dy, out);
+        row[dy] = out;
+        break;
+      case dither_mode::floyd_steinberg:
+        floyd_steinberg_row(in, width, y + dy, current, next, out);
+        row[dy] = out;
+        break;
+      }
+    }
+    kernel.pack(row, width, threshold, cells.row(y / 4));
+  }
+}
@@ -0,0 +1,33 @@
+#ifndef IMG2BRL_DITHER_H
+#define IMG2BRL_DITHER_H
+
+#include <cstddef>
+#include <string>
+
+#include "cells.h"
+
+// How grey pixels become raised or lowered dots
+enum class dither_mode
+{
+  bilevel,        // ImageMagick's reduction to two colours, as the ubrl coder
+  otsu,           // a single threshold separating dark from light best
+  bayer,          // ordered dithering with a 4x4 threshold matrix
+  floyd_steinberg // error diffusion
+};
+
+// "bilevel", "otsu", "bayer" and "floyd-steinberg"
+char const *dither_name(dither_mode);
+bool parse_dither_mode(std::string const &name, dither_mode &mode);
+
+// The threshold t maximizing the variance between pixels up to t and those
+// above, from a histogram of count 8 bit pixels
+unsigned char otsu_threshold(unsigned char const *pixels, std::size_t count);
+
+// Pack width x height 8 bit luminance into cells, raising dots for dark
+// pixels as mode says.  bilevel is taken as a fixed threshold at half
+// intensity here, the ImageMagick reduction needs the image (see ubrl).
+void dither( unsigned char const *luminance, std::size_t width, std::size_t height
+           , dither_mode, braille_cells &cells
+           );
+
+#endif
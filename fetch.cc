@@ -0,0 +1,519 @@
+#include "fetch.h"
+#include "fields.h"
+#include "hash.h"
+#include "result_cache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <curl/curl.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace /* anonymous */ {
+
+char const magic[] = "img2brl-fetch 1";
+
+// What all fetches of this process share: DNS lookups, TLS sessions and open
+// connections live in a curl share handle, and easy handles are reused so
+// their own caches stay warm as well.
+class session
+{
+  CURLSH *share;
+  std::mutex locks[CURL_LOCK_DATA_LAST];
+  std::mutex idle_mutex;
+  std::vector<CURL *> idle;
+
+  static void lock(CURL *, curl_lock_data data, curl_lock_access, void *self)
+  {
+    static_cast<session *>(self)->locks[data].lock();
+  }
+
+  static void unlock(CURL *, curl_lock_data data, void *self)
+  {
+    static_cast<session *>(self)->locks[data].unlock();
+  }
+
+public:
+  session(): share{curl_share_init()}
+  {
+    if (not share) return;
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock);
+    curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+  }
+
+  ~session()
+  {
+    for (CURL *curl: idle) curl_easy_cleanup(curl);
+    if (share) curl_share_cleanup(share);
+  }
+
+  session(session const &) = delete;
+  session &operator=(session const &) = delete;
+
+  // A handle with default options attached to the share
+  CURL *acquire()
+  {
+    CURL *curl = nullptr;
+    {
+      std::lock_guard<std::mutex> guard(idle_mutex);
+      if (not idle.empty()) {
+        curl = idle.back();
+        idle.pop_back();
+      }
+    }
+    if (not curl) curl = curl_easy_init();
+    if (curl and share) curl_easy_setopt(curl, CURLOPT_SHARE, share);
+    return curl;
+  }
+
+  void release(CURL *curl)
+  {
+    // Resetting options keeps the connections and caches
+    curl_easy_reset(curl);
+    std::lock_guard<std::mutex> guard(idle_mutex);
+    idle.push_back(curl);
+  }
+};
+
+session *current_session = nullptr;
+
+// The headers of the final response, redirects reset them
+struct response_headers
+{
+  std::string etag, last_modified, cache_control;
+  long age;
+  curl_off_t content_length; // -1 if not sent
+
+  response_headers(): age{0}, content_length{-1} {}
+};
+
+std::string
+trim(std::string const &text)
+{
+  std::string::size_type const begin = text.find_first_not_of(" \t\r\n");
+  if (begin == std::string::npos) return std::string();
+  return text.substr(begin, text.find_last_not_of(" \t\r\n") - begin + 1);
+}
+
+std::string
+lower_case(std::string text)
+{
+  std::transform(text.begin(), text.end(), text.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return text;
+}
+
+size_t
+collect_header(char *data, size_t size, size_t nmemb, response_headers *headers)
+{
+  std::string const line(data, size * nmemb);
+  if (line.compare(0, 5, "HTTP/") == 0) {
+    *headers = response_headers();
+  } else {
+    std::string::size_type const colon = line.find(':');
+    if (colon != std::string::npos) {
+      std::string const name = lower_case(line.substr(0, colon));
+      std::string const value = trim(line.substr(colon + 1));
+      if (name == "etag") headers->etag = value;
+      else if (name == "last-modified") headers->last_modified = value;
+      else if (name == "cache-control") headers->cache_control = value;
+      else if (name == "age") headers->age = std::strtol(value.c_str(), nullptr, 10);
+      else if (name == "content-length")
+        headers->content_length = std::strtoll(value.c_str(), nullptr, 10);
+    }
+  }
+  return size * nmemb;
+}
+
+// State of a transfer in progress, shared by the curl callbacks
+struct transfer
+{
+  fetch_limits const &limits;
+  fetched result;
+  fetched cached;
+  bool stale; // cached holds a copy to revalidate
+  CURL *curl;
+  curl_slist *request_headers;
+  char error_buffer[CURL_ERROR_SIZE];
+  response_headers headers;
+  enum { running, too_large, not_an_image } aborted;
+  bool checked; // whether the start of the body was inspected yet
+
+  transfer(fetch_limits const &limits)
+  : limits(limits), stale{false}, curl{nullptr}, request_headers{nullptr}
+  , error_buffer(), aborted{running}, checked{false}
+  {}
+  ~transfer() { curl_slist_free_all(request_headers); }
+  transfer(transfer const &) = delete;
+  transfer &operator=(transfer const &) = delete;
+};
+
+std::size_t const sniff_length = 64;
+
+size_t
+receive(char *data, size_t size, size_t nmemb, transfer *state)
+{
+  std::size_t const length = size * nmemb;
+  std::string &body = state->result.body;
+  if (body.empty()) {
+    if (state->headers.content_length > curl_off_t(state->limits.max_size)) {
+      state->aborted = transfer::too_large;
+      return 0;
+    }
+    if (state->headers.content_length > 0)
+      body.reserve(state->headers.content_length);
+  }
+  if (body.size() + length > state->limits.max_size) {
+    state->aborted = transfer::too_large;
+    return 0;
+  }
+  body.append(data, length);
+
+  // Error pages are not images either, but they are reported as such
+  if (not state->checked and body.size() >= sniff_length) {
+    state->checked = true;
+    long status = 0;
+    char *content_type = nullptr;
+    curl_easy_getinfo(state->curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_easy_getinfo(state->curl, CURLINFO_CONTENT_TYPE, &content_type);
+    if (status == 200 and
+        clearly_not_an_image(content_type? content_type: "", body)) {
+      state->aborted = transfer::not_an_image;
+      return 0;
+    }
+  }
+  return length;
+}
+
+std::time_t
+expiry(response_headers const &headers)
+{
+  long const lifetime = freshness_lifetime(headers.cache_control) - headers.age;
+  return lifetime > 0? std::time(nullptr) + lifetime: 0;
+}
+
+}
+
+fetch_cache::fetch_cache(std::string const &directory, std::uintmax_t max_size)
+: directory{directory}, max_size{max_size}
+{
+  if (not directory.empty() and mkdir(directory.c_str(), 0700) == -1) {
+    struct stat info;
+    if (stat(directory.c_str(), &info) == -1 or not S_ISDIR(info.st_mode))
+      this->directory.clear();
+  }
+}
+
+std::string
+fetch_cache::path(std::string const &url) const
+{
+  return directory + '/' + hex(fnv1a(url)) + hex(fnv1a(url, url.size()));
+}
+
+bool
+fetch_cache::find(std::string const &url, fetched &result) const
+{
+  if (not enabled()) return false;
+
+  std::ifstream file(path(url), std::ios::binary);
+  std::string header;
+  if (not std::getline(file, header) or header != magic) return false;
+  fetched entry;
+  if (not (read_field(file, entry.url) and entry.url == url and
+           read_field(file, entry.content_type) and
+           read_field(file, entry.etag) and
+           read_field(file, entry.last_modified) and
+           read_field(file, entry.expires) and read_field(file, entry.body)))
+    return false;
+
+  // Mark as recently used
+  utimensat(AT_FDCWD, path(url).c_str(), nullptr, 0);
+  entry.status = 200;
+  entry.from_cache = true;
+  result = std::move(entry);
+  return true;
+}
+
+void
+fetch_cache::insert(fetched const &entry) const
+{
+  if (not enabled()) return;
+
+  static std::atomic<unsigned> serial{0};
+  std::string const target = path(entry.url);
+  std::string const temporary = target + '.' + std::to_string(getpid())
+                              + '.' + std::to_string(serial++);
+  std::uintmax_t size;
+  {
+    std::ofstream file(temporary, std::ios::binary);
+    file << magic << '\n';
+    write_field(file, entry.url);
+    write_field(file, entry.content_type);
+    write_field(file, entry.etag);
+    write_field(file, entry.last_modified);
+    write_field(file, entry.expires);
+    write_field(file, entry.body);
+    size = file.tellp();
+    if (not file.flush()) {
+      std::remove(temporary.c_str());
+      return;
+    }
+  }
+  if (std::rename(temporary.c_str(), target.c_str()) != 0) {
+    std::remove(temporary.c_str());
+    return;
+  }
+
+  record_cache_growth(directory, max_size, size);
+}
+
+bool
+clearly_not_an_image( std::string const &content_type
+                    , std::string const &prefix
+                    )
+{
+  std::string const type = lower_case(content_type.substr(0, content_type.find(';')));
+  if (type == "text/html" or type == "application/xhtml+xml" or
+      type == "application/json" or type == "text/css" or
+      type == "application/javascript" or type == "text/javascript")
+    return true;
+
+  // Mislabelled HTML pages
+  std::string const start = lower_case(trim(prefix.substr(0, sniff_length)));
+  return start.compare(0, 14, "<!doctype html") == 0 or
+         start.compare(0, 5, "<html") == 0;
+}
+
+void
+fetch_initialize()
+{
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+  current_session = new session;
+}
+
+void
+fetch_finalize()
+{
+  delete current_session;
+  current_session = nullptr;
+  curl_global_cleanup();
+}
+
+long
+freshness_lifetime(std::string const &cache_control)
+{
+  // We are a shared cache, so s-maxage wins over max-age
+  long max_age = 0, shared_max_age = -1;
+  std::string::size_type begin = 0;
+  while (begin < cache_control.size()) {
+    std::string::size_type end = cache_control.find(',', begin);
+    if (end == std::string::npos) end = cache_control.size();
+    std::string const directive = lower_case(trim(cache_control.substr(begin, end - begin)));
+    begin = end + 1;
+
+    if (directive == "no-store" or directive == "private") return -1;
+    if (directive == "no-cache") return 0;
+    if (directive.compare(0, 8, "max-age=") == 0)
+      max_age = std::strtol(directive.c_str() + 8, nullptr, 10);
+    else if (directive.compare(0, 9, "s-maxage=") == 0)
+      shared_max_age = std::strtol(directive.c_str() + 9, nullptr, 10);
+  }
+  return std::max(0L, shared_max_age >= 0? shared_max_age: max_age);
+}
+
+namespace /* anonymous */ {
+
+// Look url up in the cache and set up a handle unless the cached copy is
+// still fresh.  Returns false if state.result is final already.
+bool
+begin( transfer &state, std::string const &url, std::string const &user_agent
+     , fetch_cache const &cache
+     )
+{
+  state.result.url = url;
+  state.stale = cache.find(url, state.cached);
+  if (state.stale and std::time(nullptr) < state.cached.expires) {
+    state.result = std::move(state.cached);
+    return false;
+  }
+
+  state.curl = current_session? current_session->acquire(): nullptr;
+  if (not state.curl) {
+    state.result.error = "No curl handle available";
+    return false;
+  }
+
+  if (state.stale and not state.cached.etag.empty())
+    state.request_headers = curl_slist_append(state.request_headers,
+                                              ("If-None-Match: " + state.cached.etag).c_str());
+  if (state.stale and not state.cached.last_modified.empty())
+    state.request_headers = curl_slist_append(state.request_headers,
+                                              ("If-Modified-Since: " + state.cached.last_modified).c_str());
+
+  CURL *curl = state.curl;
+  // Multiplex over HTTP/2 where the server supports it, harmless otherwise
+#ifdef CURL_HTTP_VERSION_2TLS
+  curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, long(CURL_HTTP_VERSION_2TLS));
+#endif
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  if (curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, state.error_buffer) == CURLE_OK and
+      curl_easy_setopt(curl, CURLOPT_PRIVATE, &state) == CURLE_OK and
+      curl_easy_setopt(curl, CURLOPT_URL, url.c_str()) == CURLE_OK and
+      curl_easy_setopt(curl, CURLOPT_USERAGENT, user_agent.c_str()) == CURLE_OK and
+      curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L) == CURLE_OK and
+      curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 3L) == CURLE_OK and
+      curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, long(state.limits.timeout.count())) == CURLE_OK and
+      curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L) == CURLE_OK and
+      curl_easy_setopt(curl, CURLOPT_HTTPHEADER, state.request_headers) == CURLE_OK and
+      curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, receive) == CURLE_OK and
+      curl_easy_setopt(curl, CURLOPT_WRITEDATA, &state) == CURLE_OK and
+      curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, collect_header) == CURLE_OK and
+      curl_easy_setopt(curl, CURLOPT_HEADERDATA, &state.headers) == CURLE_OK)
+    return true;
+
+  state.result.error = state.error_buffer;
+  current_session->release(curl);
+  state.curl = nullptr;
+  return false;
+}
+
+// Interpret the outcome of a transfer and update the cache
+void
+finish(transfer &state, CURLcode code, fetch_cache const &cache)
+{
+  fetched &result = state.result;
+  response_headers const &headers = state.headers;
+  if (code == CURLE_OK and
+      curl_easy_getinfo(state.curl, CURLINFO_RESPONSE_CODE, &result.status) == CURLE_OK) {
+    char *content_type = nullptr;
+    if (curl_easy_getinfo(state.curl, CURLINFO_CONTENT_TYPE, &content_type) == CURLE_OK and
+        content_type)
+      result.content_type = content_type;
+    // Too short to be inspected while receiving
+    if (result.status == 200 and not state.checked and
+        clearly_not_an_image(result.content_type, result.body))
+      state.aborted = transfer::not_an_image;
+  } else if (code == CURLE_OPERATION_TIMEDOUT) {
+    result.status = 504;
+    result.error = "Transfer took longer than "
+                 + std::to_string(state.limits.timeout.count()) + " ms";
+  } else if (state.aborted == transfer::running) {
+    result.status = 0;
+    result.error = state.error_buffer;
+  }
+  if (state.aborted == transfer::too_large) {
+    result.status = 413;
+    result.error = "Body exceeds " + std::to_string(state.limits.max_size) + " bytes";
+  } else if (state.aborted == transfer::not_an_image) {
+    result.status = 415;
+    result.error = "Not an image";
+  }
+  current_session->release(state.curl);
+  state.curl = nullptr;
+  if (result.status != 200 and result.status != 304) result.body.clear();
+
+  if (state.stale and result.status == 304) {
+    // Still valid, refresh the validators and expiry we got along
+    fetched &cached = state.cached;
+    if (not headers.etag.empty()) cached.etag = headers.etag;
+    if (not headers.last_modified.empty()) cached.last_modified = headers.last_modified;
+    cached.expires = expiry(headers);
+    cached.cache_control = headers.cache_control;
+    if (freshness_lifetime(headers.cache_control) >= 0) cache.insert(cached);
+    result = std::move(cached);
+    return;
+  }
+
+  if (result.status == 200) {
+    result.etag = headers.etag;
+    result.last_modified = headers.last_modified;
+    result.expires = expiry(headers);
+    result.cache_control = headers.cache_control;
+    if (freshness_lifetime(headers.cache_control) >= 0 and
+        (result.expires or not result.etag.empty() or
+         not result.last_modified.empty()))
+      cache.insert(result);
+  }
+}
+
+}
+
+fetched
+fetch( std::string const &url, std::string const &user_agent
+     , fetch_cache const &cache, fetch_limits const &limits
+     )
+{
+  transfer state(limits);
+  if (begin(state, url, user_agent, cache))
+    finish(state, curl_easy_perform(state.curl), cache);
+  return std::move(state.result);
+}
+
+std::vector<fetched>
+fetch_all( std::vector<std::string> const &urls, std::string const &user_agent
+         , fetch_cache const &cache, fetch_limits const &limits
+         )
+{
+  std::vector<std::unique_ptr<transfer>> transfers;
+  CURLM *multi = curl_multi_init();
+  if (multi) {
+    curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, long(max_parallel_fetches));
+#ifdef CURLPIPE_MULTIPLEX
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, long(CURLPIPE_MULTIPLEX));
+#endif
+  }
+  for (std::string const &url: urls) {
+    transfers.emplace_back(new transfer(limits));
+    transfer &state = *transfers.back();
+    if (begin(state, url, user_agent, cache)) {
+      if (not multi or curl_multi_add_handle(multi, state.curl) != CURLM_OK)
+        finish(state, curl_easy_perform(state.curl), cache);
+    }
+  }
+
+  if (multi) {
+    int running = 0;
+    do {
+      if (curl_multi_perform(multi, &running) != CURLM_OK) break;
+      int queued;
+      while (CURLMsg *message = curl_multi_info_read(multi, &queued)) {
+        if (message->msg != CURLMSG_DONE) continue;
+        CURL *curl = message->easy_handle;
+        CURLcode const code = message->data.result;
+        transfer *state = nullptr;
+        curl_easy_getinfo(curl, CURLINFO_PRIVATE, &state);
+        curl_multi_remove_handle(multi, curl);
+        finish(*state, code, cache);
+      }
+      if (running) curl_multi_wait(multi, nullptr, 0, 1000, nullptr);
+    } while (running);
+
+    // Only if the multi handle failed
+    for (auto &state: transfers) if (state->curl) {
+      curl_multi_remove_handle(multi, state->curl);
+      finish(*state, CURLE_FAILED_INIT, cache);
+    }
+    curl_multi_cleanup(multi);
+  }
+
+  std::vector<fetched> results;
+  results.reserve(transfers.size());
+  for (auto &state: transfers) results.push_back(std::move(state->result));
+  return results;
+}
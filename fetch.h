@@ -0,0 +1,94 @@
+#ifndef IMG2BRL_FETCH_H
+#define IMG2BRL_FETCH_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+
+// A downloaded resource along with what we need to revalidate it later
+struct fetched
+{
+  std::string url, content_type, body;
+  std::string etag, last_modified; // validators as sent by the server
+  std::string cache_control;       // as sent, empty if not transferred
+  std::time_t expires;             // fresh until then, 0 if it never was
+  long status;                     // 0 if the transfer failed, see fetch()
+  std::string error;               // why it failed or was aborted
+  bool from_cache;                 // body was not transferred this time
+
+  fetched(): expires{0}, status{0}, from_cache{false} {}
+};
+
+// Bounds for a single download, so one huge or slow URL can not tie up
+// memory and a worker
+struct fetch_limits
+{
+  std::size_t max_size;              // of the body in bytes
+  std::chrono::milliseconds timeout; // for the whole transfer
+
+  fetch_limits(): max_size{32 << 20}, timeout{std::chrono::seconds(20)} {}
+};
+
+// Downloaded bodies stored on local disk, one file per URL, with their
+// validators and expiry.  Like the result_cache it is safe to share between
+// processes and evicts the least recently used entries beyond max_size.
+class fetch_cache
+{
+  std::string directory;
+  std::uintmax_t max_size;
+
+  std::string path(std::string const &url) const;
+
+public:
+  // An empty directory or a directory we can not create disables the cache.
+  fetch_cache(std::string const &directory, std::uintmax_t max_size);
+
+  bool enabled() const { return not directory.empty(); }
+
+  bool find(std::string const &url, fetched &) const;
+  void insert(fetched const &) const;
+};
+
+// Set up and tear down libcurl and the state all fetches of this process
+// share: the DNS cache, TLS sessions and open connections, so repeated
+// fetches from the same host skip the handshakes.  Call fetch_initialize()
+// before any other thread starts and fetch_finalize() after they are done.
+void fetch_initialize();
+void fetch_finalize();
+
+// Seconds a response may be used without revalidation according to its
+// Cache-Control header, or -1 if it must not be stored at all.
+long freshness_lifetime(std::string const &cache_control);
+
+// True if a successful response is certainly not something ImageMagick
+// could decode, judging by its content type and first bytes.
+bool clearly_not_an_image( std::string const &content_type
+                         , std::string const &prefix
+                         );
+
+// GET url.  A fresh cached copy is returned without touching the network, a
+// stale one is revalidated with If-None-Match and If-Modified-Since and
+// reused when the server answers 304 Not Modified.
+//
+// The body is received into a buffer reserved from Content-Length.
+// Transfers are aborted early with status 413 Payload Too Large if the body
+// exceeds limits.max_size, 415 Unsupported Media Type if it is clearly not an
+// image, and 504 Gateway Timeout if they take longer than limits.timeout.
+fetched fetch( std::string const &url, std::string const &user_agent
+             , fetch_cache const &, fetch_limits const & = fetch_limits()
+             );
+
+// At most this many transfers of fetch_all() are in flight at once
+std::size_t const max_parallel_fetches = 8;
+
+// fetch() all urls concurrently, the results are in the same order.
+std::vector<fetched> fetch_all( std::vector<std::string> const &urls
+                              , std::string const &user_agent
+                              , fetch_cache const &
+                              , fetch_limits const & = fetch_limits()
+                              );
+
+#endif
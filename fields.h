@@ -0,0 +1,45 @@
+#ifndef IMG2BRL_FIELDS_H
+#define IMG2BRL_FIELDS_H
+
+#include <cstddef>
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <string>
+
+// The on disk caches store fields as their length in decimal, a colon, the
+// bytes and a newline.  This is binary safe and still readable with less.
+inline void
+write_field(std::ostream &out, std::string const &field)
+{
+  out << field.size() << ':' << field << '\n';
+}
+
+template<typename Number>
+inline void
+write_field(std::ostream &out, Number field)
+{
+  write_field(out, std::to_string(field));
+}
+
+inline bool
+read_field(std::istream &in, std::string &field)
+{
+  std::size_t length;
+  if (not (in >> length) or in.get() != ':') return false;
+  field.resize(length);
+  if (length and not in.read(&field[0], length)) return false;
+  return in.get() == '\n';
+}
+
+template<typename Number>
+inline bool
+read_field(std::istream &in, Number &field)
+{
+  std::string text;
+  if (not read_field(in, text)) return false;
+  std::istringstream number(text);
+  return bool(number >> field);
+}
+
+#endif
@@ -0,0 +1,192 @@
+#include "gray.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace /* anonymous */ {
+
+// The input pixels an output pixel covers along one axis, and how much of
+// each of them
+struct span
+{
+  std::size_t first;
+  std::vector<float> weights;
+};
+
+std::vector<span>
+spans(std::size_t in, std::size_t out)
+{
+  std::vector<span> result(out);
+  double const step = double(in) / out;
+  for (std::size_t i = 0; i < out; ++i) {
+    double const begin = i * step, end = (i + 1) * step;
+    std::size_t const last = std::min(in, std::size_t(std::ceil(end)));
+    result[i].first = std::size_t(begin);
+    for (std::size_t x = result[i].first; x < last; ++x) {
+      double const covered = std::min(end, x + 1.0) - std::max(begin, double(x));
+      result[i].weights.push_back(float(covered / step));
+    }
+  }
+  return result;
+}
+
+std::size_t
+rounded(double value)
+{
+  return std::max<std::size_t>(1, std::size_t(std::floor(value + 0.5)));
+}
+
+}
+
+gray_box
+trim_box(gray_image const &image)
+{
+  gray_box box{ 0, 0, std::min<std::size_t>(image.width, 1)
+              , std::min<std::size_t>(image.height, 1) };
+  if (image.pixels.empty()) return box;
+  unsigned char const background = image.pixels.front();
+  std::size_t left = image.width, right = 0, top = image.height, bottom = 0;
+  for (std::size_t y = 0; y < image.height; ++y) {
+    unsigned char const *const row = image.row(y);
+    std::size_t x = 0;
+    while (x < image.width and row[x] == background) ++x;
+    if (x == image.width) continue;
+    std::size_t end = image.width;
+    while (row[end - 1] == background) --end;
+    left = std::min(left, x);
+    right = std::max(right, end);
+    top = std::min(top, y);
+    bottom = y + 1;
+  }
+  if (left < right) box = gray_box{ left, top, right - left, bottom - top };
+  return box;
+}
+
+gray_image
+downscale( gray_image const &in, gray_box const &box
+         , std::size_t width, std::size_t height
+         , gray_histogram &histogram
+         )
+{
+  histogram.fill(0);
+  gray_image out(width, height);
+  if (width == box.width and height == box.height) {
+    for (std::size_t y = 0; y < height; ++y) {
+      unsigned char const *const row = in.row(box.y + y) + box.x;
+      std::copy(row, row + width, out.row(y));
+      for (std::size_t x = 0; x < width; ++x) ++histogram[row[x]];
+    }
+    return out;
+  }
+
+  std::vector<span> const columns = spans(box.width, width);
+  std::vector<span> const rows = spans(box.height, height);
+  std::vector<float> sum(box.width);
+  for (std::size_t y = 0; y < height; ++y) {
+    // Weighted sum of the input rows, then of the columns in it
+    std::fill(sum.begin(), sum.end(), 0.0f);
+    for (std::size_t i = 0; i < rows[y].weights.size(); ++i) {
+      unsigned char const *const row = in.row(box.y + rows[y].first + i) + box.x;
+      float const weight = rows[y].weights[i];
+      for (std::size_t x = 0; x < box.width; ++x) sum[x] += weight * row[x];
+    }
+    unsigned char *const row = out.row(y);
+    for (std::size_t x = 0; x < width; ++x) {
+      float value = 0.5f;
+      for (std::size_t i = 0; i < columns[x].weights.size(); ++i)
+        value += columns[x].weights[i] * sum[columns[x].first + i];
+      row[x] = static_cast<unsigned char>(std::min(value, 255.0f));
+      ++histogram[row[x]];
+    }
+  }
+  return out;
+}
+
+std::array<unsigned char, 256>
+tone_curve(gray_histogram const &histogram, bool normalize, bool negate)
+{
+  std::size_t black = 0, white = 255;
+  if (normalize) {
+    double total = 0;
+    for (std::size_t count: histogram) total += count;
+    double darker = 0, lighter = 0;
+    for (black = 0; black < 255; ++black)
+      if ((darker += histogram[black]) >= total * 0.0015) break;
+    for (white = 255; white > 0; --white)
+      if ((lighter += histogram[white]) >= total - total * 0.9995) break;
+    if (black >= white) black = 0, white = 255;
+  }
+
+  std::array<unsigned char, 256> curve;
+  for (std::size_t value = 0; value < 256; ++value) {
+    std::size_t mapped = value;
+    if (value <= black) mapped = 0;
+    else if (value >= white) mapped = 255;
+    else mapped = (255 * (value - black) + (white - black) / 2) / (white - black);
+    curve[value] = negate? 255 - mapped: mapped;
+  }
+  return curve;
+}
+
+void
+fit_columns(std::size_t columns, std::size_t &width, std::size_t &height)
+{
+  std::size_t const limit = columns * 2;
+  if (not limit) return;
+  // Mirror the cheap scale and then the resize of prepare()
+  if (width > 2 * limit) {
+    height = rounded(double(height) * 2 * limit / width);
+    width = 2 * limit;
+  }
+  if (width > limit) {
+    height = rounded(double(height) * limit / width);
+    width = limit;
+  }
+}
+
+gray_image
+gray_pipeline( Magick::Image const &image, conversion_options const &options
+             , stage_timings *timings
+             )
+{
+  gray_image source(image.columns(), image.rows());
+  if (source.pixels.empty()) return source;
+  {
+    // The only time the full colour pixels are read
+    stage_timer timer(timings, stage::decode);
+    Magick::Image pixels(image);
+    pixels.write(0, 0, source.width, source.height, "I", Magick::CharPixel,
+                 source.pixels.data());
+  }
+  return gray_pipeline(source, options, timings);
+}
+
+gray_image
+gray_pipeline( gray_image const &source, conversion_options const &options
+             , stage_timings *timings
+             )
+{
+  if (source.pixels.empty()) return source;
+  gray_box box{ 0, 0, source.width, source.height };
+  if (options.trim) {
+    stage_timer timer(timings, stage::trim);
+    box = trim_box(source);
+  }
+
+  std::size_t width = box.width, height = box.height;
+  fit_columns(options.columns, width, height);
+  gray_histogram histogram;
+  gray_image result;
+  {
+    stage_timer timer(timings, stage::resize);
+    result = downscale(source, box, width, height, histogram);
+  }
+
+  if (options.normalize or options.negate) {
+    stage_timer timer(timings, options.normalize? stage::normalize: stage::negate);
+    std::array<unsigned char, 256> const curve =
+      tone_curve(histogram, options.normalize, options.negate);
+    for (unsigned char &pixel: result.pixels) pixel = curve[pixel];
+  }
+  return result;
+}
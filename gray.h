@@ -0,0 +1,76 @@
+#ifndef IMG2BRL_GRAY_H
+#define IMG2BRL_GRAY_H
+
+#include <array>
+#include <cstddef>
+#include <vector>
+
+#include <Magick++/Image.h>
+
+#include "conversion.h"
+#include "timings.h"
+
+// 8 bit grey pixels, rows stored next to each other
+struct gray_image
+{
+  std::size_t width, height;
+  std::vector<unsigned char> pixels;
+
+  gray_image(): width{0}, height{0} {}
+  gray_image(std::size_t width, std::size_t height)
+  : width{width}, height{height}, pixels(width * height)
+  {}
+
+  unsigned char const *row(std::size_t y) const { return &pixels[y * width]; }
+  unsigned char *row(std::size_t y) { return &pixels[y * width]; }
+};
+
+// A rectangle of pixels
+struct gray_box
+{
+  std::size_t x, y, width, height;
+};
+
+typedef std::array<std::size_t, 256> gray_histogram;
+
+// The smallest box holding every pixel which differs from the top left one,
+// like Magick::Image::trim().  An image of a single colour trims down to its
+// top left pixel.
+gray_box trim_box(gray_image const &);
+
+// Average box of in down to width x height, each output pixel covering its
+// exact share of the input, and count the output values in histogram.
+// This is the only pass over the input after extracting it.
+gray_image downscale( gray_image const &in, gray_box const &box
+                    , std::size_t width, std::size_t height
+                    , gray_histogram &histogram
+                    );
+
+// A table mapping grey values like Magick::Image::normalize() (clipping the
+// darkest 0.15% and the lightest 0.05%) and negate() would, for an image
+// with the given histogram
+std::array<unsigned char, 256> tone_curve( gray_histogram const &
+                                         , bool normalize, bool negate
+                                         );
+
+// The size prepare() resizes a width x height image to for columns cells
+void fit_columns( std::size_t columns, std::size_t &width, std::size_t &height);
+
+// trim, resize, normalize and negate as in options, fused into a single
+// read of the pixels of image and one pass over their grey values instead
+// of a pass per ImageMagick operation.  The result has exactly the size
+// prepare() would give.  Grey values differ from it by resampling (area
+// averaging instead of ImageMagick's filters, and normalize looking at the
+// resized instead of the scaled image), and trim compares grey instead of
+// colour.  With a threshold, test.cc checks that at most 10% of the dots
+// differ; error diffusion and ordered dithering agree in average darkness.
+gray_image gray_pipeline( Magick::Image const &, conversion_options const &
+                        , stage_timings *timings = nullptr
+                        );
+
+// The same for pixels already in grey, as read_gray() decodes them
+gray_image gray_pipeline( gray_image const &, conversion_options const &
+                        , stage_timings *timings = nullptr
+                        );
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef IMG2BRL_HASH_H
+#define IMG2BRL_HASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// 64 bit FNV-1a.  Not cryptographic, but cheap enough to run over every
+// upload and spreads keys well for the caches.
+inline std::uint64_t
+fnv1a(void const *data, std::size_t length,
+      std::uint64_t hash = 0xcbf29ce484222325ULL)
+{
+  unsigned char const *byte = static_cast<unsigned char const *>(data);
+  for (unsigned char const *end = byte + length; byte != end; ++byte) {
+    hash ^= *byte;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+inline std::uint64_t
+fnv1a(std::string const &data, std::uint64_t hash = 0xcbf29ce484222325ULL)
+{
+  return fnv1a(data.data(), data.size(), hash);
+}
+
+inline std::string
+hex(std::uint64_t value)
+{
+  static char const digits[] = "0123456789abcdef";
+  std::string text(16, '0');
+  for (std::size_t i = text.size(); i--; value >>= 4) text[i] = digits[value & 0xF];
+  return text;
+}
+
+#endif
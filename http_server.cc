@@ -0,0 +1,496 @@
+#include "http_server.h"
+#include "timings.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include <cgicc/CgiInput.h>
+#include <boost/algorithm/string/case_conv.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/trim.hpp>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace /* anonymous */ {
+
+std::size_t const max_header_size = 64 * 1024;
+std::size_t const max_body_size = 64 * 1024 * 1024;
+std::chrono::seconds const keep_alive_timeout(30);
+// Total time a client gets to deliver one request, headers and body
+std::chrono::seconds const request_timeout(60);
+std::chrono::milliseconds const accept_backoff(100);
+
+std::runtime_error
+system_error(std::string const &what)
+{
+  return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+bool
+write_all(int fd, char const *data, std::size_t length)
+{
+  while (length) {
+    ssize_t written = ::write(fd, data, length);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data += written;
+    length -= written;
+  }
+  return true;
+}
+
+// Feeds cgicc from a parsed HTTP request instead of the process environment.
+class cgi_input : public cgicc::CgiInput
+{
+  std::map<std::string, std::string> environment;
+  std::string const &body;
+  std::size_t position;
+public:
+  cgi_input( http_server::request const &request
+           , std::string const &server_port
+           )
+  : body(request.body), position{0}
+  {
+    std::string::size_type const query = request.target.find('?');
+    std::string server_name = request.headers.count("host")
+                            ? request.headers.at("host") : "localhost";
+    server_name = server_name.substr(0, server_name.rfind(':'));
+
+    environment["GATEWAY_INTERFACE"] = "CGI/1.1";
+    environment["SERVER_SOFTWARE"] = "img2brl";
+    environment["SERVER_NAME"] = server_name;
+    environment["SERVER_PORT"] = server_port;
+    environment["SERVER_PROTOCOL"] = request.version;
+    environment["REQUEST_METHOD"] = request.method;
+    environment["SCRIPT_NAME"] = request.target.substr(0, query);
+    if (query != std::string::npos)
+      environment["QUERY_STRING"] = request.target.substr(query + 1);
+    environment["REMOTE_ADDR"] = request.remote_address;
+    environment["CONTENT_LENGTH"] = std::to_string(request.body.size());
+    for (auto const &header: request.headers) {
+      if (header.first == "content-type") {
+        environment["CONTENT_TYPE"] = header.second;
+      } else if (header.first != "content-length") {
+        std::string name = "HTTP_" + boost::to_upper_copy(header.first);
+        for (char &c: name) if (c == '-') c = '_';
+        environment[name] = header.second;
+      }
+    }
+  }
+
+  size_t read(char *data, size_t length) override
+  {
+    length = std::min(length, body.size() - position);
+    body.copy(data, length, position);
+    position += length;
+    return length;
+  }
+
+  std::string getenv(char const *name) override
+  {
+    auto const value = environment.find(name);
+    return value != environment.end() ? value->second : std::string();
+  }
+};
+
+// Split the header block of CGI output from its body and turn it into the
+// head of an HTTP response.
+std::string
+cgi_to_http(std::string const &output, bool head_only, bool keep_alive)
+{
+  std::string::size_type end = output.find("\n\n"), body = end + 2;
+  std::string::size_type const crlf = output.find("\r\n\r\n");
+  if (crlf != std::string::npos and crlf < end) end = crlf, body = crlf + 4;
+  if (end == std::string::npos)
+    throw std::runtime_error("CGI output without header");
+
+  std::string status = "200 OK", headers;
+  std::istringstream lines(output.substr(0, end));
+  for (std::string line; std::getline(lines, line);) {
+    boost::trim_right(line);
+    if (boost::istarts_with(line, "Status:"))
+      status = boost::trim_copy(line.substr(7));
+    else if (not line.empty())
+      headers += line + "\r\n";
+  }
+
+  std::string response = "HTTP/1.1 " + status + "\r\n" + headers
+                       + "Content-Length: "
+                       + std::to_string(output.size() - body) + "\r\n"
+                       + "Connection: " + (keep_alive? "keep-alive": "close")
+                       + "\r\n\r\n";
+  if (not head_only) response.append(output, body, std::string::npos);
+  return response;
+}
+
+std::string
+simple_response( std::string const &status, bool keep_alive
+               , std::string const &headers = std::string()
+               )
+{
+  return "HTTP/1.1 " + status + "\r\n" + headers
+       + "Content-Type: text/plain; charset=UTF-8\r\n"
+         "Content-Length: " + std::to_string(status.size() + 1) + "\r\n"
+         "Connection: " + (keep_alive? "keep-alive": "close") + "\r\n\r\n"
+       + status + "\n";
+}
+
+}
+
+http_server::connection::~connection()
+{
+  close(fd);
+}
+
+http_server::http_server( std::string const &listen
+                        , std::string const &document_root
+                        , handler_type handler
+                        , std::size_t threads, std::size_t queue_size
+                        )
+: listener{-1}, address{"127.0.0.1"}, port{listen}
+, document_root{document_root}, handler{handler}
+, pool{new thread_pool(threads, queue_size)}
+{
+  std::string::size_type const colon = listen.rfind(':');
+  if (colon != std::string::npos) {
+    address = listen.substr(0, colon);
+    port = listen.substr(colon + 1);
+  }
+
+  addrinfo hints;
+  std::memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  addrinfo *addresses;
+  if (int error = getaddrinfo(address.empty()? nullptr: address.c_str(),
+                              port.c_str(), &hints, &addresses))
+    throw std::runtime_error("Can not resolve " + listen + ": " + gai_strerror(error));
+  for (addrinfo *ai = addresses; ai and listener == -1; ai = ai->ai_next) {
+    listener = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (listener == -1) continue;
+    int const on = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+    if (bind(listener, ai->ai_addr, ai->ai_addrlen) == -1 or
+        ::listen(listener, SOMAXCONN) == -1) {
+      close(listener);
+      listener = -1;
+    }
+  }
+  freeaddrinfo(addresses);
+  if (listener == -1) throw system_error("Can not listen on " + listen);
+
+  if (pipe(wake) == -1) {
+    close(listener);
+    throw system_error("pipe");
+  }
+  fcntl(wake[0], F_SETFL, O_NONBLOCK);
+  fcntl(wake[1], F_SETFL, O_NONBLOCK);
+}
+
+http_server::~http_server()
+{
+  pool.reset();
+  close(wake[0]);
+  close(wake[1]);
+  close(listener);
+}
+
+bool
+http_server::read_request(int connection, std::string &buffer, request &req) const
+{
+  // SO_RCVTIMEO only bounds a single recv(), a client trickling in a byte
+  // at a time would otherwise hold a worker indefinitely.
+  clock_type::time_point const deadline = clock_type::now() + request_timeout;
+  auto receive = [connection, &buffer, deadline]() -> bool {
+    char data[16384];
+    ssize_t received;
+    do {
+      auto const left = std::chrono::duration_cast<std::chrono::milliseconds>
+                        (deadline - clock_type::now()).count();
+      if (left <= 0) return false;
+      pollfd readable{ connection, POLLIN, 0 };
+      int const ready = poll(&readable, 1, static_cast<int>(left));
+      if (ready == 0) return false;
+      received = ready == -1? -1: recv(connection, data, sizeof data, 0);
+    } while (received == -1 and errno == EINTR);
+    if (received <= 0) return false;
+    buffer.append(data, received);
+    return true;
+  };
+
+  std::string::size_type end;
+  while ((end = buffer.find("\r\n\r\n")) == std::string::npos) {
+    if (buffer.size() > max_header_size or not receive()) return false;
+  }
+
+  std::istringstream head(buffer.substr(0, end));
+  buffer.erase(0, end + 4);
+  std::string line;
+  if (not std::getline(head, line)) return false;
+  std::istringstream request_line(line);
+  if (not (request_line >> req.method >> req.target >> req.version)) return false;
+  req.headers.clear();
+  while (std::getline(head, line)) {
+    std::string::size_type const colon = line.find(':');
+    if (colon == std::string::npos) return false;
+    req.headers[boost::to_lower_copy(line.substr(0, colon))] =
+      boost::trim_copy(line.substr(colon + 1));
+  }
+
+  auto header = [&req](std::string const &name) -> std::string {
+    auto const value = req.headers.find(name);
+    return value != req.headers.end() ? boost::to_lower_copy(value->second)
+                                      : std::string();
+  };
+  req.keep_alive = req.version == "HTTP/1.1" ? header("connection") != "close"
+                                             : header("connection") == "keep-alive";
+  if (not header("transfer-encoding").empty()) return false;
+
+  std::size_t length = 0;
+  if (not header("content-length").empty()) {
+    try {
+      length = std::stoul(header("content-length"));
+    } catch (std::exception const &) {
+      return false;
+    }
+  }
+  if (length > max_body_size) {
+    std::string const response =
+      simple_response("413 Payload Too Large", false);
+    write_all(connection, response.data(), response.size());
+    shutdown(connection, SHUT_WR);
+    return false;
+  }
+  if (length and header("expect") == "100-continue" and buffer.size() < length) {
+    static char const continue_[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    if (not write_all(connection, continue_, sizeof continue_ - 1)) return false;
+  }
+  while (buffer.size() < length) if (not receive()) return false;
+  req.body = buffer.substr(0, length);
+  buffer.erase(0, length);
+
+  return true;
+}
+
+bool
+http_server::serve_file(request const &req, std::string &response) const
+{
+  static std::map<std::string, std::string> const content_types = {
+    { ".css", "text/css; charset=UTF-8" },
+    { ".png", "image/png" },
+    { ".xpi", "application/x-xpinstall" }
+  };
+  if (req.method != "GET" and req.method != "HEAD") return false;
+  std::string const path = req.target.substr(0, req.target.find('?'));
+  std::string::size_type const dot = path.rfind('.');
+  if (dot == std::string::npos or path.find("..") != std::string::npos)
+    return false;
+  auto const type = content_types.find(path.substr(dot));
+  if (type == content_types.end()) return false;
+  std::ifstream file(document_root + path, std::ios::binary);
+  if (not file) return false;
+
+  std::ostringstream output;
+  output << "Content-Type: " << type->second << "\r\n\r\n" << file.rdbuf();
+  response = cgi_to_http(output.str(), req.method == "HEAD", req.keep_alive);
+  return true;
+}
+
+std::string
+http_server::statistics() const
+{
+  thread_pool::statistics const stats = pool->stats();
+  auto seconds = [](thread_pool::clock_type::duration duration) -> double {
+    return std::chrono::duration_cast<std::chrono::duration<double>>
+           (duration).count();
+  };
+  unsigned long long const started = stats.completed + stats.active;
+  std::ostringstream json;
+  json << '{'
+       << '"' << "threads" << '"' << ':' << stats.threads << ','
+       << '"' << "capacity" << '"' << ':' << stats.capacity << ','
+       << '"' << "queued" << '"' << ':' << stats.queued << ','
+       << '"' << "active" << '"' << ':' << stats.active << ','
+       << '"' << "completed" << '"' << ':' << stats.completed << ','
+       << '"' << "rejected" << '"' << ':' << stats.rejected << ','
+       << '"' << "wait" << '"' << ':'
+       << '{'
+       << '"' << "mean_seconds" << '"' << ':'
+       << (started? seconds(stats.total_wait) / started: 0.0) << ','
+       << '"' << "max_seconds" << '"' << ':' << seconds(stats.max_wait)
+       << '}'
+       << '}' << '\n';
+  return json.str();
+}
+
+std::string
+http_server::metrics() const
+{
+  thread_pool::statistics const stats = pool->stats();
+  std::ostringstream text;
+  text << "# HELP img2brl_queued_requests Requests waiting for a worker.\n"
+       << "# TYPE img2brl_queued_requests gauge\n"
+       << "img2brl_queued_requests " << stats.queued << '\n'
+       << "# HELP img2brl_active_requests Requests being handled.\n"
+       << "# TYPE img2brl_active_requests gauge\n"
+       << "img2brl_active_requests " << stats.active << '\n'
+       << "# HELP img2brl_completed_requests_total Requests handled.\n"
+       << "# TYPE img2brl_completed_requests_total counter\n"
+       << "img2brl_completed_requests_total " << stats.completed << '\n'
+       << "# HELP img2brl_rejected_requests_total Requests refused with 503.\n"
+       << "# TYPE img2brl_rejected_requests_total counter\n"
+       << "img2brl_rejected_requests_total " << stats.rejected << '\n'
+       << stage_metrics();
+  return text.str();
+}
+
+std::string
+http_server::respond(request const &req) const
+{
+  std::string response;
+  if (serve_file(req, response)) return response;
+
+  if (req.target == "/stats")
+    return cgi_to_http("Content-Type: application/json; charset=UTF-8\n\n"
+                       + statistics(), req.method == "HEAD", req.keep_alive);
+  if (req.target == "/metrics")
+    return cgi_to_http("Content-Type: text/plain; version=0.0.4; charset=UTF-8\n\n"
+                       + metrics(), req.method == "HEAD", req.keep_alive);
+
+  try {
+    cgi_input input(req, port);
+    std::ostringstream output;
+    int const status = handler(&input, output);
+    if (status != EXIT_SUCCESS and output.str().empty())
+      return simple_response("500 Internal Server Error", req.keep_alive);
+    return cgi_to_http(output.str(), req.method == "HEAD", req.keep_alive);
+  } catch (std::exception const &e) {
+    std::cerr << e.what() << std::endl;
+    return simple_response("500 Internal Server Error", req.keep_alive);
+  }
+}
+
+// Runs on a worker thread: answer one request, then hand the connection
+// back to the polling thread if the client wants to keep it open.
+void
+http_server::serve(std::shared_ptr<connection> client)
+{
+  request req;
+  req.remote_address = client->remote_address;
+  if (not read_request(client->fd, client->buffer, req)) return;
+  std::string const response = respond(req);
+  if (not write_all(client->fd, response.data(), response.size()) or
+      not req.keep_alive)
+    return;
+
+  client->idle_since = clock_type::now();
+  {
+    std::lock_guard<std::mutex> lock(returned_mutex);
+    returned.push_back(client);
+  }
+  char const byte = 0;
+  if (::write(wake[1], &byte, 1) == -1) {} // poll() times out anyway
+}
+
+void
+http_server::dispatch(std::shared_ptr<connection> client)
+{
+  if (pool->try_submit([this, client] { serve(client); })) return;
+
+  // Overloaded: refuse quickly and let the client come back later
+  std::string const response =
+    simple_response("503 Service Unavailable", false, "Retry-After: 1\r\n");
+  write_all(client->fd, response.data(), response.size());
+  shutdown(client->fd, SHUT_WR);
+  char drain[16384];
+  while (recv(client->fd, drain, sizeof drain, MSG_DONTWAIT) > 0);
+}
+
+void
+http_server::run()
+{
+  signal(SIGPIPE, SIG_IGN);
+  std::vector<std::shared_ptr<connection>> idle;
+  for (;;) {
+    std::vector<pollfd> fds{ { listener, POLLIN, 0 }, { wake[0], POLLIN, 0 } };
+    for (auto const &client: idle) fds.push_back(pollfd{ client->fd, POLLIN, 0 });
+    if (poll(fds.data(), fds.size(), 1000) == -1) {
+      if (errno == EINTR) continue;
+      throw system_error("poll");
+    }
+
+    clock_type::time_point const now = clock_type::now();
+    std::vector<std::shared_ptr<connection>> waiting;
+    for (std::size_t i = 0; i < idle.size(); ++i) {
+      if (fds[i + 2].revents) {
+        // Clients closing their keep-alive connection are not requests
+        char peek;
+        if (recv(idle[i]->fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT) > 0)
+          dispatch(idle[i]);
+      } else if (now - idle[i]->idle_since < keep_alive_timeout)
+        waiting.push_back(idle[i]);
+    }
+    idle.swap(waiting);
+
+    if (fds[1].revents & POLLIN) {
+      char drain[256];
+      while (::read(wake[0], drain, sizeof drain) > 0);
+      std::lock_guard<std::mutex> lock(returned_mutex);
+      for (auto &client: returned) {
+        // Pipelined requests are already buffered, poll() would not see them
+        if (client->buffer.find("\r\n\r\n") != std::string::npos)
+          dispatch(client);
+        else
+          idle.push_back(client);
+      }
+      returned.clear();
+    }
+
+    if (fds[0].revents & POLLIN) {
+      sockaddr_storage peer;
+      socklen_t peer_length = sizeof peer;
+      int const fd = accept(listener, reinterpret_cast<sockaddr *>(&peer),
+                            &peer_length);
+      if (fd == -1) {
+        if (errno == EINTR or errno == ECONNABORTED) continue;
+        if (errno == EMFILE or errno == ENFILE or
+            errno == ENOBUFS or errno == ENOMEM) {
+          // Out of descriptors or memory: existing connections will free
+          // some, so wait a little instead of spinning or giving up.
+          std::cerr << "accept: " << std::strerror(errno) << std::endl;
+          std::this_thread::sleep_for(accept_backoff);
+          continue;
+        }
+        throw system_error("accept");
+      }
+      auto client = std::make_shared<connection>();
+      client->fd = fd;
+      client->idle_since = now;
+      char host[NI_MAXHOST] = "";
+      getnameinfo(reinterpret_cast<sockaddr *>(&peer), peer_length,
+                  host, sizeof host, nullptr, 0, NI_NUMERICHOST);
+      client->remote_address = host;
+      // Bound the time a worker blocks on a slow client
+      timeval timeout{ keep_alive_timeout.count(), 0 };
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+      idle.push_back(client);
+    }
+  }
+}
@@ -0,0 +1,85 @@
+#ifndef IMG2BRL_HTTP_SERVER_H
+#define IMG2BRL_HTTP_SERVER_H
+
+#include <chrono>
+#include <functional>
+#include <iosfwd>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "thread_pool.h"
+
+namespace cgicc { class CgiInput; }
+
+// A minimal HTTP/1.1 listener which turns each request into a CGI
+// environment, runs a CGI style handler in process and translates its
+// output (Status: and other headers, blank line, body) back into HTTP.
+// Everything below the document root with a known extension is served as a
+// static file, so the stylesheet, icon and add-on keep working.
+//
+// Requests are handled on a thread_pool.  A single thread polls the listening
+// socket and idle keep-alive connections and queues every connection with a
+// pending request.  When the queue is full the request is answered with
+// 503 Service Unavailable right away.  /stats reports the queue statistics,
+// /metrics the same along with per stage timings in Prometheus text format.
+class http_server
+{
+public:
+  typedef std::function<int(cgicc::CgiInput *, std::ostream &)> handler_type;
+
+  struct request
+  {
+    std::string method, target, version;
+    std::map<std::string, std::string> headers; // names in lower case
+    std::string body;
+    std::string remote_address;
+    bool keep_alive;
+  };
+
+private:
+  typedef std::chrono::steady_clock clock_type;
+
+  struct connection
+  {
+    int fd;
+    std::string buffer; // received but not yet consumed
+    std::string remote_address;
+    clock_type::time_point idle_since;
+    ~connection();
+  };
+
+  int listener;
+  int wake[2]; // lets workers interrupt poll() when returning a connection
+  std::string address, port, document_root;
+  handler_type handler;
+  std::mutex returned_mutex;
+  std::vector<std::shared_ptr<connection>> returned;
+  std::unique_ptr<thread_pool> pool;
+
+  bool read_request(int connection, std::string &buffer, request &) const;
+  std::string respond(request const &) const;
+  bool serve_file(request const &, std::string &response) const;
+  std::string statistics() const;
+  std::string metrics() const;
+  void dispatch(std::shared_ptr<connection>);
+  void serve(std::shared_ptr<connection>);
+
+public:
+  // address:port to listen on, e.g. "127.0.0.1:8080" or just "8080".
+  // threads == 0 uses one worker per core, at most queue_size requests wait.
+  http_server( std::string const &listen, std::string const &document_root
+             , handler_type handler
+             , std::size_t threads, std::size_t queue_size
+             );
+  ~http_server();
+  http_server(http_server const &) = delete;
+  http_server &operator=(http_server const &) = delete;
+
+  // Accept and serve connections until the process is terminated.
+  void run();
+};
+
+#endif
@@ -16,18 +16,30 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110, USA. 
  */
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <ctime>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <set>
+#include <sstream>
 #include <string>
 #include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include <cgicc/Cgicc.h>
 #include <cgicc/HTMLClasses.h>
 #include <cgicc/HTTPContentHeader.h>
 #include <cgicc/XHTMLDoctype.h>
 #include <curl/curl.h>
+#include <Magick++/Exception.h>
+#include <Magick++/Functions.h>
 #include <Magick++/Include.h>
 #include <boost/config.hpp>
 #include <boost/locale.hpp>
@@ -38,7 +50,16 @@
 
 #include "config.h"
 #include "accept_language.h"
-#include "ubrl.h"
+#include "conversion.h"
+#include "convert.h"
+#include "fetch.h"
+#include "img2brl.h"
+#include "pyramid.h"
+#include "response.h"
+#include "result_cache.h"
+#include "shared_cache.h"
+#include "stream_convert.h"
+#include "timings.h"
 
 using namespace boost::locale;
 using namespace cgicc;
@@ -46,70 +67,107 @@ using namespace cgicc;
 static code git_clone{"git <span lang=\"en\">clone</span> http://img2brl.delysid.org"};
 static a api_link{a{"API"}.set("href", "https://github.com/mlang/img2brl/#api")};
 
-static int
-curl_append_to_string(char *data, size_t size, size_t nmemb, std::string *buffer)
-{
-  if (not buffer) return 0;
-
-  buffer->append(data, size*nmemb);
-
-  return size * nmemb;
-}
-
 using namespace std;
 
-enum class output_mode { html, json, text };
+enum class output_mode { html, json, text, binary };
 
 static void
-print_header(output_mode mode, std::string const &title, std::string const &lang)
+print_header( std::ostream &out, output_mode mode
+            , std::string const &title, std::string const &lang
+            )
 {
   static char const *text_html_utf8 = "text/html; charset=UTF-8";
   switch (mode) {
     case output_mode::html:
-      cout << HTTPContentHeader(text_html_utf8)
-           << XHTMLDoctype(XHTMLDoctype::eStrict) << endl
-           << html().set("xmlns", "http://www.w3.org/1999/xhtml")
-                    .set("lang", lang).set("dir", "ltr") << endl
-           << head() << endl
-           << cgicc::title() << title << cgicc::title() << endl
-           << meta().set("http-equiv", "Content-Type")
-                    .set("content", text_html_utf8) << endl
-           << cgicc::link().set("rel", "shortcut icon")
-                           .set("href", "favicon.png") << endl
-           << cgicc::link().set("rel", "stylesheet").set("type", "text/css")
-                           .set("href", "img2brl.css") << endl
-           << head() << endl
-           << body() << endl;
+      out << HTTPContentHeader(text_html_utf8)
+          << XHTMLDoctype(XHTMLDoctype::eStrict) << endl
+          << html().set("xmlns", "http://www.w3.org/1999/xhtml")
+                   .set("lang", lang).set("dir", "ltr") << endl
+          << head() << endl
+          << cgicc::title() << title << cgicc::title() << endl
+          << meta().set("http-equiv", "Content-Type")
+                   .set("content", text_html_utf8) << endl
+          << cgicc::link().set("rel", "shortcut icon")
+                          .set("href", "favicon.png") << endl
+          << cgicc::link().set("rel", "stylesheet").set("type", "text/css")
+                          .set("href", "img2brl.css") << endl
+          << head() << endl
+          << body() << endl;
       break;
 
     case output_mode::json:
-      cout << HTTPContentHeader("application/json; charset=UTF-8") << '{';
+      out << HTTPContentHeader("application/json; charset=UTF-8") << '{';
       break;
 
     case output_mode::text:
-      cout << HTTPContentHeader("text/plain; charset=UTF-8");
+      out << HTTPContentHeader("text/plain; charset=UTF-8");
+      break;
+
+    case output_mode::binary:
+      out << HTTPContentHeader("application/octet-stream");
       break;
   }
 }
 
+// Cells as they are, for programs driving braille displays.  The body has
+// no line breaks, so the dimensions go into headers.
 static void
-print_supported_image_formats()
-{
-  std::size_t formats;
-  MagickCore::ExceptionInfo *exception = MagickCore::AcquireExceptionInfo();
-  if (MagickCore::MagickInfo const **info = MagickCore::GetMagickInfoList("*", &formats, exception)) {
-    std::cout << cgicc::dl().set("id", "supported-image-formats").set("lang", "en") << std::endl;
-    for (std::size_t i = 0; i < formats; ++i) {
-      if (info[i]->stealth == MagickCore::MagickFalse and
-          info[i]->decoder and info[i]->magick) {
-        std::cout << cgicc::dt(cgicc::abbr(info[i]->name))
-                  << cgicc::dd(info[i]->description) << std::endl;
-      }
-    }
-    std::cout << cgicc::dl() << std::endl;
-    MagickCore::RelinquishMagickMemory(info);
+print_binary(std::ostream &out, braille_cells const &cells)
+{
+  out << "X-Braille-Columns: " << cells.columns() << endl
+      << "X-Braille-Rows: " << cells.rows() << endl
+      << HTTPContentHeader("application/octet-stream");
+  write_binary(out, cells);
+}
+
+// The formats ImageMagick could read at build time, see supported_formats.cc
+static struct { char const *name, *description; } const supported_formats[] = {
+#include "supported_formats.inc"
+  { nullptr, nullptr }
+};
+
+static void
+print_supported_image_formats(std::ostream &out)
+{
+  static std::string const list = [] {
+    std::ostringstream html;
+    html << cgicc::dl().set("id", "supported-image-formats").set("lang", "en") << std::endl;
+    for (auto const *format = supported_formats; format->name; ++format)
+      html << cgicc::dt(cgicc::abbr(format->name))
+           << cgicc::dd(format->description) << std::endl;
+    html << cgicc::dl() << std::endl;
+    return html.str();
+  }();
+  out << list;
+}
+
+// Parts of a page which only depend on the language, rendered once per
+// process.  key has to tell every variant of render apart.
+static std::string
+rendered_once( std::string const &key, std::locale const &locale
+             , std::function<void(std::ostream &)> const &render
+             )
+{
+  static std::mutex mutex;
+  static std::map<std::string, std::string> rendered;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto found = rendered.find(key);
+  if (found == rendered.end()) {
+    std::ostringstream html;
+    html.imbue(locale);
+    render(html);
+    found = rendered.emplace(key, html.str()).first;
   }
-  MagickCore::DestroyExceptionInfo(exception);
+  return found->second;
+}
+
+// cgicc writes element content and attribute values as they are
+static std::string
+escape_html(std::string const &text)
+{
+  std::string escaped;
+  append_html_escaped(escaped, text.data(), text.size());
+  return escaped;
 }
 
 static cgicc::input
@@ -124,7 +182,29 @@ checkbox( cgicc::Cgicc const &cgi
 }
 
 static void
-print_form(cgicc::Cgicc const &cgi)
+print_dither_select(std::ostream &out, cgicc::Cgicc const &cgi)
+{
+  dither_mode selected = dither_mode::bilevel;
+  parse_dither_mode(cgi("dither"), selected);
+  std::pair<dither_mode, message> const modes[] = {
+    { dither_mode::bilevel, translate("two colours") },
+    { dither_mode::otsu, translate("automatic threshold") },
+    { dither_mode::bayer, translate("ordered dithering") },
+    { dither_mode::floyd_steinberg, translate("error diffusion") }
+  };
+  out << label(translate("shading").str(out.getloc())).set("for", "dither_img") << endl
+      << cgicc::select().set("name", "dither").set("id", "dither_img") << endl;
+  for (auto const &mode: modes) {
+    option choice(mode.second.str(out.getloc()));
+    choice.set("value", dither_name(mode.first));
+    if (mode.first == selected) choice.set("selected", "selected");
+    out << choice << endl;
+  }
+  out << cgicc::select() << endl;
+}
+
+static void
+print_form(std::ostream &out, cgicc::Cgicc const &cgi)
 {
   cgicc::const_file_iterator file(cgi.getFile("img"));
   cgicc::const_form_iterator url(cgi.getElement("url"));
@@ -137,17 +217,19 @@ print_form(cgicc::Cgicc const &cgi)
   file_input.set("type", "file");
   file_input.set("name", "img");
   file_input.set("accept", "image/*");
-  if (file != cgi.getFiles().end()) file_input.set("value", file->getFilename());
+  if (file != cgi.getFiles().end())
+    file_input.set("value", escape_html(file->getFilename()));
 
   input url_input;
   url_input.set("id", img_url);
   url_input.set("type", "url");
   url_input.set("name", "url");
-  if (url != cgi.getElements().end()) url_input.set("value", url->getValue());
+  if (url != cgi.getElements().end())
+    url_input.set("value", escape_html(url->getValue()));
 
   std::string columns("88");
   if (cgi.getElement("cols") != cgi.getElements().end())
-    columns = cgi.getElement("cols")->getValue();
+    columns = escape_html(cgi.getElement("cols")->getValue());
 
   input columns_input;
   columns_input.set("type", "text")
@@ -155,81 +237,104 @@ print_form(cgicc::Cgicc const &cgi)
                .set("id", "cols_img")
                .set("size", "4").set("value", columns);
 
-  cout << form().set("method", "post")
-                .set("action", cgi.getEnvironment().getScriptName())
-                .set("enctype", "multipart/form-data") << endl
-       << cgicc::div()
-       << label(translate("Send an image file: ")).set("for", img_file) << endl
-       << file_input << endl
-       << cgicc::div() << endl
-       << cgicc::div() << translate("or") << cgicc::div() << endl
-       << cgicc::div()
-       << label(translate("Enter URL to image: ")).set("for", img_url) << endl
-       << url_input << endl
-       << cgicc::div() << endl
-
-       << cgicc::div() << endl
-       << checkbox(cgi, "trim", "trim_img") << endl
-       << label(translate("trim edges")).set("for", "trim_img") << endl
-       << checkbox(cgi, "normalize", "normalize_img") << endl
-       << label(translate("increase contrast")).set("for", "normalize_img") << endl
-       << checkbox(cgi, "negate", "negate_img") << endl
-       << label(translate("invert")).set("for", "negate_img") << endl
-       << checkbox(cgi, "resize", "resize_img") << endl
-       << format(translate("{1} max {2} {3}"))
-          % label(translate("resize to")).set("for", "resize_img")
-          % columns_input
-          % label(translate("columns")).set("for", "cols_img")
-       << cgicc::div() << endl
-
-       << script().set("type", "application/javascript")
-       << "document.getElementById('cols_img').disabled = !document.getElementById('resize_img').checked;" << endl
-       << "document.getElementById('resize_img').onchange = function() {" << endl
-       << "  document.getElementById('cols_img').disabled = !this.checked;" << endl
-       << "};" << endl
-       << script() << endl
-
-       << cgicc::div().set("class", "center") << endl
-       << input().set("type", "submit")
-                 .set("name", "submit")
-                 .set("value", translate("Translate to Braille")) << endl
-       << cgicc::div() << endl
-       << form() << endl;
+  out << form().set("method", "post")
+               .set("action", cgi.getEnvironment().getScriptName())
+               .set("enctype", "multipart/form-data") << endl
+      << cgicc::div()
+      << label(translate("Send an image file: ").str(out.getloc())).set("for", img_file) << endl
+      << file_input << endl
+      << cgicc::div() << endl
+      << cgicc::div() << translate("or") << cgicc::div() << endl
+      << cgicc::div()
+      << label(translate("Enter URL to image: ").str(out.getloc())).set("for", img_url) << endl
+      << url_input << endl
+      << cgicc::div() << endl
+
+      << cgicc::div() << endl
+      << checkbox(cgi, "trim", "trim_img") << endl
+      << label(translate("trim edges").str(out.getloc())).set("for", "trim_img") << endl
+      << checkbox(cgi, "normalize", "normalize_img") << endl
+      << label(translate("increase contrast").str(out.getloc())).set("for", "normalize_img") << endl
+      << checkbox(cgi, "negate", "negate_img") << endl
+      << label(translate("invert").str(out.getloc())).set("for", "negate_img") << endl;
+  print_dither_select(out, cgi);
+  out << checkbox(cgi, "resize", "resize_img") << endl
+      << format(translate("{1} max {2} {3}"))
+         % label(translate("resize to").str(out.getloc())).set("for", "resize_img")
+         % columns_input
+         % label(translate("columns").str(out.getloc())).set("for", "cols_img")
+      << cgicc::div() << endl
+
+      << script().set("type", "application/javascript")
+      << "document.getElementById('cols_img').disabled = !document.getElementById('resize_img').checked;" << endl
+      << "document.getElementById('resize_img').onchange = function() {" << endl
+      << "  document.getElementById('cols_img').disabled = !this.checked;" << endl
+      << "};" << endl
+      << script() << endl
+
+      << cgicc::div().set("class", "center") << endl
+      << input().set("type", "submit")
+                .set("name", "submit")
+                .set("value", translate("Translate to Braille").str(out.getloc())) << endl
+      << cgicc::div() << endl
+      << form() << endl;
 }
 
 typedef std::chrono::steady_clock clock_type;
 
 static void
-print_footer(output_mode mode, clock_type::time_point const &start)
+print_footer( std::ostream &out, output_mode mode
+            , clock_type::time_point const &start
+            , stage_timings const &timings
+            )
 {
   clock_type::duration duration = clock_type::now() - start;
   if (mode == output_mode::html) {
-    cout << cgicc::div().set("class", "center").set("id", "footer") << endl
-         << format(translate("Processing time was {3} {4} ({1} {2})"))
-            % span((format("{1}")
-                    % std::chrono::duration_cast<std::chrono::microseconds>
-                      (duration).count()
-                   ).str()).set("class", "timing").set("id", "microseconds")
-            % translate("microseconds")
-            % span((format("{1,p=2}")
-                    % std::chrono::duration_cast<std::chrono::duration<double>>
-                      (duration).count()
-                   ).str()).set("class", "timing").set("id", "seconds")
-            % translate("seconds")
-         << cgicc::div() << endl;
-    cout << body() << endl
-         << html() << endl;
+    out << cgicc::div().set("class", "center").set("id", "footer") << endl
+        << format(translate("Processing time was {3} {4} ({1} {2})"))
+           % span((format("{1}")
+                   % std::chrono::duration_cast<std::chrono::microseconds>
+                     (duration).count()
+                  ).str(out.getloc())).set("class", "timing").set("id", "microseconds")
+           % translate("microseconds")
+           % span((format("{1,p=2}")
+                   % std::chrono::duration_cast<std::chrono::duration<double>>
+                     (duration).count()
+                  ).str(out.getloc())).set("class", "timing").set("id", "seconds")
+           % translate("seconds")
+        << cgicc::div() << endl;
+    out << body() << endl
+        << html() << endl;
   } else if (mode == output_mode::json) {
-    cout << ','
-	 << '"' << "runtime" << '"'
-	 << ':'
-	 << '{'
-	 << '"' << "seconds" << '"'
-	 << ':'
-         << std::chrono::duration_cast<std::chrono::duration<double>>(duration).count()
-         << '}';
-
-    cout << '}';
+    response_writer json(out);
+    json.raw(',')
+        .key("runtime")
+        .raw('{')
+        .key("seconds")
+        .number(std::chrono::duration_cast<std::chrono::duration<double>>
+                (duration).count())
+        .raw('}');
+
+    // Seconds spent in every stage which ran
+    json.raw(',')
+        .key("timings")
+        .raw('{');
+    bool first = true;
+    for (std::size_t i = 0; i < stage_count; ++i) {
+      stage const which = stage(i);
+      if (which == stage::total or
+          timings[which] == stage_timings::clock_type::duration::zero())
+        continue;
+      if (not first) json.raw(',');
+      first = false;
+      json.key(stage_name(which))
+          .number(std::chrono::duration_cast<std::chrono::duration<double>>
+                  (timings[which]).count());
+    }
+    json.raw('}');
+
+    json.raw('}');
+    json.flush();
   }
 }
 
@@ -247,9 +352,10 @@ public:
   source( enum type type
         , std::string const &identifier
         , std::string const &content_type
-        , std::string const &data
+        , std::string data // moved in, downloads can be large
         )
-  : type{type}, identifier{identifier}, content_type{content_type}, data{data}
+  : type{type}, identifier{identifier}, content_type{content_type}
+  , data{std::move(data)}
   {}
 public:
   enum type get_type() const { return type; };
@@ -265,24 +371,766 @@ public:
   http_error(long code): std::runtime_error("HTTP error"), code{code} {}
 };
 
-int main()
+static conversion_options
+parse_options(cgicc::Cgicc const &cgi)
+{
+  conversion_options options;
+  options.trim = cgi.queryCheckbox("trim");
+  options.normalize = cgi.queryCheckbox("normalize");
+  options.negate = cgi.queryCheckbox("negate");
+  if (cgi.queryCheckbox("resize")) {
+    const_form_iterator cols = cgi.getElement("cols");
+    if (cols != cgi.getElements().end()) {
+      try {
+        options.columns = boost::lexical_cast<std::size_t>(cols->getValue());
+      } catch (boost::bad_lexical_cast const &e) {
+      }
+    }
+  }
+  parse_dither_mode(cgi("dither"), options.dither);
+  return options;
+}
+
+// Shared by all requests of this process.  IMG2BRL_CACHE_DIR and
+// IMG2BRL_CACHE_SIZE in the environment override the configured defaults.
+static result_cache const &
+conversion_cache()
+{
+  static result_cache const cache = [] {
+    std::string directory = IMG2BRL_CACHE_DIRECTORY;
+    std::uintmax_t size = IMG2BRL_CACHE_SIZE;
+    if (char const *value = std::getenv("IMG2BRL_CACHE_DIR")) directory = value;
+    if (char const *value = std::getenv("IMG2BRL_CACHE_SIZE"))
+      size = std::strtoull(value, nullptr, 10);
+    return result_cache(directory, size);
+  }();
+  return cache;
+}
+
+// Downloaded images for revalidation.  IMG2BRL_FETCH_CACHE_DIR and
+// IMG2BRL_FETCH_CACHE_SIZE in the environment override the defaults.
+static fetch_cache const &
+download_cache()
+{
+  static fetch_cache const cache = [] {
+    std::string directory = IMG2BRL_FETCH_CACHE_DIRECTORY;
+    std::uintmax_t size = IMG2BRL_FETCH_CACHE_SIZE;
+    if (char const *value = std::getenv("IMG2BRL_FETCH_CACHE_DIR"))
+      directory = value;
+    if (char const *value = std::getenv("IMG2BRL_FETCH_CACHE_SIZE"))
+      size = std::strtoull(value, nullptr, 10);
+    return fetch_cache(directory, size);
+  }();
+  return cache;
+}
+
+// IMG2BRL_FETCH_MAX_SIZE and IMG2BRL_FETCH_TIMEOUT (in seconds) in the
+// environment override the configured defaults.
+static fetch_limits
+download_limits()
+{
+  fetch_limits limits;
+  limits.max_size = IMG2BRL_FETCH_MAX_SIZE;
+  limits.timeout = std::chrono::seconds(IMG2BRL_FETCH_TIMEOUT);
+  if (char const *value = std::getenv("IMG2BRL_FETCH_MAX_SIZE"))
+    limits.max_size = std::strtoull(value, nullptr, 10);
+  if (char const *value = std::getenv("IMG2BRL_FETCH_TIMEOUT"))
+    limits.timeout = std::chrono::seconds(std::strtoull(value, nullptr, 10));
+  return limits;
+}
+
+// IMG2BRL_MAX_SIDE, IMG2BRL_MAX_AREA, IMG2BRL_MAX_FRAMES and
+// IMG2BRL_MAGICK_MEMORY, _MAP, _DISK (in bytes) and _TIME (in seconds) in
+// the environment override the configured defaults.
+static decode_limits
+image_limits()
+{
+  decode_limits limits;
+  limits.max_side = IMG2BRL_MAX_SIDE;
+  limits.max_area = IMG2BRL_MAX_AREA;
+  limits.max_frames = IMG2BRL_MAX_FRAMES;
+  limits.memory = IMG2BRL_MAGICK_MEMORY;
+  limits.map = IMG2BRL_MAGICK_MAP;
+  limits.disk = IMG2BRL_MAGICK_DISK;
+  limits.time = std::chrono::seconds(IMG2BRL_MAGICK_TIME);
+  if (char const *value = std::getenv("IMG2BRL_MAX_SIDE"))
+    limits.max_side = std::strtoull(value, nullptr, 10);
+  if (char const *value = std::getenv("IMG2BRL_MAX_AREA"))
+    limits.max_area = std::strtoull(value, nullptr, 10);
+  if (char const *value = std::getenv("IMG2BRL_MAX_FRAMES"))
+    limits.max_frames = std::strtoull(value, nullptr, 10);
+  if (char const *value = std::getenv("IMG2BRL_MAGICK_MEMORY"))
+    limits.memory = std::strtoull(value, nullptr, 10);
+  if (char const *value = std::getenv("IMG2BRL_MAGICK_MAP"))
+    limits.map = std::strtoull(value, nullptr, 10);
+  if (char const *value = std::getenv("IMG2BRL_MAGICK_DISK"))
+    limits.disk = std::strtoull(value, nullptr, 10);
+  if (char const *value = std::getenv("IMG2BRL_MAGICK_TIME"))
+    limits.time = std::chrono::seconds(std::strtoull(value, nullptr, 10));
+  return limits;
+}
+
+// Mapped once per process and shared by every img2brl process on the host.
+// IMG2BRL_SHARED_CACHE, IMG2BRL_SHARED_CACHE_SIZE and
+// IMG2BRL_SHARED_CACHE_TTL in the environment override the defaults.
+static shared_cache const &
+shared_segment()
+{
+  static shared_cache const segment = [] {
+    std::string path = IMG2BRL_SHARED_CACHE;
+    std::size_t size = IMG2BRL_SHARED_CACHE_SIZE;
+    if (char const *value = std::getenv("IMG2BRL_SHARED_CACHE")) path = value;
+    if (char const *value = std::getenv("IMG2BRL_SHARED_CACHE_SIZE"))
+      size = std::strtoull(value, nullptr, 10);
+    // Plenty of buckets for results of a few kilobytes each
+    return shared_cache(path, size, size / 1024);
+  }();
+  return segment;
+}
+
+// How long the result for a URL is reused without fetching it again
+static std::chrono::seconds
+url_time_to_live()
+{
+  if (char const *value = std::getenv("IMG2BRL_SHARED_CACHE_TTL"))
+    return std::chrono::seconds(std::strtoull(value, nullptr, 10));
+  return std::chrono::seconds(IMG2BRL_SHARED_CACHE_TTL);
+}
+
+// url_time_to_live(), but no longer than the server allows the response to
+// be reused.  Zero if it must not be reused at all, like with no-store.
+static std::chrono::seconds
+url_time_to_live(fetched const &response)
+{
+  std::chrono::seconds const configured = url_time_to_live();
+  if (response.cache_control.empty() and not response.expires) return configured;
+  long const fresh = response.expires?
+                     long(response.expires - std::time(nullptr)): 0;
+  if (fresh <= 0) return std::chrono::seconds::zero();
+  return configured.count() and configured.count() < fresh
+       ? configured: std::chrono::seconds(fresh);
+}
+
+static bool
+find_shared( std::string const &key, conversion &result
+           , std::chrono::seconds max_age = std::chrono::seconds::zero()
+           )
+{
+  std::string value;
+  if (not shared_segment().find(key, value, max_age)) return false;
+  std::istringstream in(value);
+  return deserialize(in, result);
+}
+
+static void
+insert_shared( std::string const &key, conversion const &result
+             , std::chrono::seconds time_to_live = std::chrono::seconds::zero()
+             )
+{
+  if (not shared_segment().enabled()) return;
+  std::ostringstream out;
+  serialize(out, result);
+  shared_segment().insert(key, out.str(), time_to_live);
+}
+
+// Decode and convert data unless the shared segment or the disk cache
+// already know the result.  Returns whether result came from a cache.
+static bool
+cached_convert( source const &data, conversion_options const &options
+              , conversion &result, stage_timings *timings = nullptr
+              )
+{
+  result_cache const &cache = conversion_cache();
+  std::string const key = cache.key(data.get_data(), options);
+  if (find_shared(key, result)) return true;
+  if (cache.find(key, result)) {
+    insert_shared(key, result);
+    return true;
+  }
+
+  {
+    // Only the headers, to turn away images too large to decode
+    stage_timer timer(timings, stage::decode);
+    admit_image(data.get_data(), image_limits());
+  }
+  result = convert(data.get_data(), options, timings);
+  result.content_type = data.get_content_type();
+  cache.insert(key, result);
+  insert_shared(key, result);
+  return false;
+}
+
+// Recently viewed pyramids of this process
+static pyramid_cache &
+recent_pyramids()
+{
+  static pyramid_cache cache(64 << 20);
+  return cache;
+}
+
+static std::string
+pyramid_key(std::string const &data, conversion_options const &options)
+{
+  return result_cache::key(data, options) + "-pyramid";
+}
+
+static std::shared_ptr<dot_pyramid const>
+find_pyramid(std::string const &key)
+{
+  if (std::shared_ptr<dot_pyramid const> pyramid = recent_pyramids().find(key))
+    return pyramid;
+  std::string value;
+  if (not conversion_cache().find(key, value)) return nullptr;
+  std::istringstream in(value);
+  std::shared_ptr<dot_pyramid> pyramid = std::make_shared<dot_pyramid>();
+  // A damaged entry is a miss, the pyramid is built again and replaces it
+  decode_limits const limits = image_limits();
+  if (not pyramid->deserialize(in, limits.max_side, limits.max_area))
+    return nullptr;
+  recent_pyramids().insert(key, pyramid);
+  return pyramid;
+}
+
+static std::shared_ptr<dot_pyramid const>
+build_pyramid( std::string const &key, source const &data
+             , conversion_options const &options, stage_timings *timings
+             )
+{
+  {
+    stage_timer timer(timings, stage::decode);
+    admit_image(data.get_data(), image_limits());
+  }
+  std::shared_ptr<dot_pyramid const> pyramid =
+    std::make_shared<dot_pyramid>(convert(data.get_data(), options, timings).braille);
+  if (conversion_cache().enabled()) {
+    std::ostringstream out;
+    pyramid->serialize(out);
+    conversion_cache().insert(key, out.str());
+  }
+  recent_pyramids().insert(key, pyramid);
+  return pyramid;
+}
+
+// The pyramid of the image in the request.  It is built from the whole
+// image once and found by content hash afterwards; a recently viewed URL
+// is not even fetched again.  Returns nullptr if there is no image.
+static std::shared_ptr<dot_pyramid const>
+cached_pyramid( cgicc::Cgicc const &cgi, conversion_options const &options
+              , source &data, bool &cached, stage_timings &timings
+              )
+{
+  const_file_iterator file = cgi.getFile("img");
+  const_form_iterator url = cgi.getElement("url");
+  std::string url_key;
+  std::chrono::seconds url_ttl{0};
+  if (file != cgi.getFiles().end() and not file->getData().empty()) {
+    data = source(source::file, file->getFilename(), file->getDataType(), file->getData());
+  } else if (url != cgi.getElements().end() and not url->getValue().empty()) {
+    // Remembers the pyramid key and content type of the URL
+    url_key = "view " + options.key() + ' ' + url->getValue();
+    std::string value;
+    if (shared_segment().find(url_key, value, url_time_to_live())) {
+      std::string::size_type const space = value.find(' ');
+      if (std::shared_ptr<dot_pyramid const> pyramid =
+          find_pyramid(value.substr(0, space))) {
+        data = source(source::url, url->getValue(),
+                      space == std::string::npos? "": value.substr(space + 1), "");
+        cached = true;
+        return pyramid;
+      }
+    }
+    fetched response;
+    {
+      stage_timer timer(&timings, stage::fetch);
+      response = fetch(url->getValue(), cgi.getEnvironment().getUserAgent(),
+                       download_cache(), download_limits());
+    }
+    if (response.status == 200 and not response.body.empty()) {
+      data = source(source::url, url->getValue(), response.content_type,
+                    std::move(response.body));
+      url_ttl = url_time_to_live(response);
+      if (not url_ttl.count()) url_key.clear();
+    } else if (response.status) {
+      throw http_error(response.status);
+    } else {
+      cerr << response.error << endl;
+      return nullptr;
+    }
+  } else {
+    return nullptr;
+  }
+
+  std::string const key = pyramid_key(data.get_data(), options);
+  std::shared_ptr<dot_pyramid const> pyramid = find_pyramid(key);
+  cached = pyramid != nullptr;
+  if (not pyramid) {
+    try {
+      pyramid = build_pyramid(key, data, options, &timings);
+    } catch (Magick::ErrorMissingDelegate const &e) {
+      throw http_error(415);
+    } catch (image_too_large const &e) {
+      throw http_error(413);
+    } catch (Magick::ErrorResourceLimit const &e) {
+      throw http_error(413);
+    }
+  }
+  if (not url_key.empty())
+    shared_segment().insert(url_key, key + ' ' + data.get_content_type(),
+                            url_ttl);
+  return pyramid;
+}
+
+// The part of a pyramid level a viewport request asks for, in cells
+struct viewport
+{
+  std::size_t x, y, cols, rows;
+  int zoom; // negative for the most detailed level fitting into cols
+};
+
+static std::size_t
+parse_number( cgicc::Cgicc const &cgi, std::string const &name
+            , std::size_t fallback
+            )
+{
+  const_form_iterator element = cgi.getElement(name);
+  if (element != cgi.getElements().end()) {
+    try {
+      return boost::lexical_cast<std::size_t>(element->getValue());
+    } catch (boost::bad_lexical_cast const &e) {
+    }
+  }
+  return fallback;
+}
+
+static viewport
+parse_viewport(cgicc::Cgicc const &cgi)
+{
+  viewport view;
+  view.x = parse_number(cgi, "x", 0);
+  view.y = parse_number(cgi, "y", 0);
+  view.cols = parse_number(cgi, "cols", 40);
+  view.rows = parse_number(cgi, "rows", 25);
+  view.zoom = cgi.getElement("zoom") != cgi.getElements().end()
+            ? int(std::min<std::size_t>(parse_number(cgi, "zoom", 0), 64)): -1;
+  return view;
+}
+
+static void
+print_json_source(response_writer &json, source const &data)
+{
+  switch (data.get_type()) {
+  case source::file: json.key("filename"); break;
+  case source::url: json.key("url"); break;
+  case source::unknown: json.key("source"); break;
+  }
+  json.json(data.get_identifier());
+}
+
+// Everything about a result except the braille itself
+static void
+print_json_result( response_writer &json
+                 , source const &data, conversion const &result, bool cached
+                 )
+{
+  json.key("src")
+      .raw('{');
+  print_json_source(json, data);
+  json.raw(',')
+      .key("content-type").json(data.get_content_type())
+      .raw(',')
+      .key("format").json(result.format)
+      .raw(',');
+  if (not result.label.empty())
+    json.key("label").json(result.label)
+        .raw(',');
+  if (not result.comment.empty())
+    json.key("comment").json(result.comment)
+        .raw(',');
+  json.key("width").number(result.source_width)
+      .raw(',')
+      .key("height").number(result.source_height)
+      .raw('}')
+
+      .raw(',');
+  if (conversion_cache().enabled() or shared_segment().enabled())
+    json.key("cache").json(cached? "hit": "miss")
+        .raw(',');
+  json.key("width").number(result.braille.width())
+      .raw(',')
+      .key("height").number(result.braille.height());
+}
+
+// One image of a batch request
+struct batch_item
+{
+  source data;
+  conversion result;
+  bool cached;
+  std::string url_key, error;
+  std::chrono::seconds url_ttl;
+  stage_timings timings;
+
+  batch_item(): cached{false}, url_ttl{0} {}
+};
+
+static std::size_t const max_batch_size = 64;
+
+// Several images in one request.  All URLs are fetched concurrently, then
+// the images are converted in parallel and reported in request order, each
+// with either its result or what went wrong.  threads == 0 converts on
+// one thread per core.
+static void
+print_batch( std::ostream &out, cgicc::Cgicc const &cgi
+           , conversion_options const &options, stage_timings &timings
+           , std::size_t threads
+           )
+{
+  std::vector<batch_item> items;
+  for (FormFile const &file: cgi.getFiles()) {
+    if (file.getName() != "img" or file.getData().empty()) continue;
+    items.emplace_back();
+    items.back().data = source(source::file, file.getFilename(),
+                               file.getDataType(), file.getData());
+  }
+
+  std::vector<FormEntry> urls;
+  cgi.getElement("url", urls);
+  std::vector<std::string> pending;
+  std::vector<std::size_t> pending_items;
+  for (FormEntry const &url: urls) {
+    if (url.getValue().empty()) continue;
+    items.emplace_back();
+    batch_item &item = items.back();
+    item.data = source(source::url, url.getValue(), "", "");
+    item.url_key = "url " + options.key() + ' ' + url.getValue();
+    if (find_shared(item.url_key, item.result, url_time_to_live())) {
+      item.cached = true;
+      item.data = source(source::url, url.getValue(), item.result.content_type, "");
+    } else {
+      pending.push_back(url.getValue());
+      pending_items.push_back(items.size() - 1);
+    }
+  }
+
+  std::vector<fetched> responses;
+  {
+    stage_timer timer(&timings, stage::fetch);
+    responses = fetch_all(pending, cgi.getEnvironment().getUserAgent(),
+                          download_cache(), download_limits());
+  }
+  for (std::size_t i = 0; i < responses.size(); ++i) {
+    fetched &response = responses[i];
+    batch_item &item = items[pending_items[i]];
+    if (response.status == 200 and not response.body.empty()) {
+      item.data = source(source::url, response.url, response.content_type,
+                         std::move(response.body));
+      item.url_ttl = url_time_to_live(response);
+      if (not item.url_ttl.count()) item.url_key.clear();
+    } else if (response.status)
+      item.error = "HTTP status " + std::to_string(response.status);
+    else
+      item.error = response.error;
+  }
+
+  std::atomic<std::size_t> next{0};
+  auto const work = [&] {
+    for (std::size_t i; (i = next++) < items.size();) {
+      batch_item &item = items[i];
+      if (item.cached or not item.error.empty()) continue;
+      try {
+        item.cached = cached_convert(item.data, options, item.result,
+                                     &item.timings);
+        if (not item.url_key.empty())
+          insert_shared(item.url_key, item.result, item.url_ttl);
+      } catch (std::exception const &e) {
+        item.error = e.what();
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  if (not threads) threads = std::max(1U, std::thread::hardware_concurrency());
+  threads = std::min(threads, items.size());
+  for (std::size_t i = 1; i < threads; ++i) workers.emplace_back(work);
+  work();
+  for (std::thread &worker: workers) worker.join();
+  // Summed over all images, so conversion stages can exceed the wall clock
+  for (batch_item const &item: items) timings.add(item.timings);
+
+  stage_timer timer(&timings, stage::render);
+  response_writer json(out);
+  json.key("batch").raw('[');
+  for (std::size_t i = 0; i < items.size(); ++i) {
+    batch_item const &item = items[i];
+    if (i) json.raw(',');
+    json.raw('{');
+    if (item.error.empty()) {
+      print_json_result(json, item.data, item.result, item.cached);
+      json.raw(',')
+          .key("braille").json_braille(item.result.braille);
+    } else {
+      json.key("src").raw('{');
+      print_json_source(json, item.data);
+      json.raw('}')
+          .raw(',')
+          .key("error").json(item.error);
+    }
+    json.raw('}');
+  }
+  json.raw(']');
+  json.flush();
+}
+
+static void
+print_unsupported( std::ostream &out, output_mode mode
+                 , Magick::ErrorMissingDelegate const &missing_delegate_exception
+                 )
+{
+  switch (mode) {
+  case output_mode::html:
+    out << h1("Error: Image format not supported") << endl
+        << p(escape_html(missing_delegate_exception.what())) << endl;
+    break;
+  case output_mode::json: {
+    response_writer response(out);
+    response.key("exception").json("Magick::ErrorMissingDelegate")
+            .raw(',')
+            .key("message").json(missing_delegate_exception.what());
+    response.flush();
+    break;
+  }
+  case output_mode::text:
+    out << "Unsupported image format: "
+        << missing_delegate_exception.what() << endl;
+    break;
+  case output_mode::binary: break; // answered 415 before
+  }
+}
+
+// An image admit_image() turned away, or one ImageMagick ran out of
+// resources for
+static void
+print_too_large( std::ostream &out, output_mode mode
+               , std::exception const &too_large_exception
+               )
+{
+  switch (mode) {
+  case output_mode::html:
+    out << h1("Error: Image too large") << endl
+        << p(escape_html(too_large_exception.what())) << endl;
+    break;
+  case output_mode::json: {
+    response_writer response(out);
+    response.key("exception").json("image_too_large")
+            .raw(',')
+            .key("message").json(too_large_exception.what());
+    response.flush();
+    break;
+  }
+  case output_mode::text:
+    out << "Image too large: " << too_large_exception.what() << endl;
+    break;
+  case output_mode::binary: break; // answered 413 before
+  }
+}
+
+// Several frames of an animation or pages of a document.  Text separates
+// them with form feeds, like pages for an embosser.
+static void
+print_frames( std::ostream &out, output_mode mode
+            , source const &data, conversion_options const &options
+            , frame_range range, bool diff, stage_timings &timings
+            , std::size_t threads
+            )
+{
+  {
+    stage_timer timer(&timings, stage::decode);
+    admit_image(data.get_data(), image_limits(), range);
+  }
+  std::vector<conversion> const frames = convert_frames(data.get_data(), options,
+                                                        range, &timings, threads);
+  stage_timer timer(&timings, stage::render);
+  response_writer response(out);
+  switch (mode) {
+  case output_mode::html:
+    response.raw("<pre id=\"result\">\n");
+    switch (data.get_type()) {
+    case source::file: response.raw("Filename: "); break;
+    case source::url: response.raw("Url: "); break;
+    default: break;
+    }
+    response.html(data.get_identifier()).raw('\n')
+            .raw("Content type: ").html(data.get_content_type()).raw('\n');
+    if (not frames.empty())
+      response.raw("Format: ").html(frames.front().format).raw('\n');
+    for (std::size_t i = 0; i < frames.size(); ++i)
+      response.raw("\nFrame ").number(range.first + i).raw('\n')
+              .raw("Width: ").number(frames[i].braille.width()).raw('\n')
+              .raw("Height: ").number(frames[i].braille.height()).raw('\n')
+              .raw('\n')
+              .braille(frames[i].braille);
+    response.raw("</pre>\n");
+    break;
+  case output_mode::json:
+    response.key("src").raw('{');
+    print_json_source(response, data);
+    response.raw(',')
+            .key("content-type").json(data.get_content_type());
+    if (not frames.empty())
+      response.raw(',')
+              .key("format").json(frames.front().format)
+              .raw(',')
+              .key("width").number(frames.front().source_width)
+              .raw(',')
+              .key("height").number(frames.front().source_height);
+    response.raw('}')
+            .raw(',')
+            .key("frames");
+    write_json_frames(response, frames, range.first, diff);
+    break;
+  case output_mode::text:
+    for (std::size_t i = 0; i < frames.size(); ++i) {
+      if (i) response.raw("\f\n");
+      response.braille(frames[i].braille);
+    }
+    break;
+  case output_mode::binary: break; // only single images
+  }
+  response.flush();
+}
+
+// Slice a viewport out of a pyramid, which has at least one level
+static void
+print_view( std::ostream &out, output_mode mode
+          , source const &data, dot_pyramid const &pyramid
+          , viewport const &view, bool cached
+          )
+{
+  std::size_t zoom = std::min<std::size_t>(view.zoom, pyramid.size() - 1);
+  if (view.zoom < 0)
+    for (zoom = 0; zoom + 1 < pyramid.size(); ++zoom)
+      if ((pyramid[zoom].width + 1) / 2 <= view.cols) break;
+  std::size_t const width = (pyramid[zoom].width + 1) / 2;
+  std::size_t const height = (pyramid[zoom].height + 3) / 4;
+  std::size_t const cols = view.x < width? std::min(view.cols, width - view.x): 0;
+  std::size_t const rows = view.y < height? std::min(view.rows, height - view.y): 0;
+  braille_cells const braille = pyramid.view(zoom, view.x, view.y, cols, rows);
+
+  if (mode == output_mode::binary) {
+    print_binary(out, braille);
+    return;
+  }
+
+  response_writer response(out);
+  switch (mode) {
+  case output_mode::html:
+    out << pre().set("id", "result") << endl;
+    switch (data.get_type()) {
+    case source::file: response.raw("Filename: "); break;
+    case source::url: response.raw("Url: "); break;
+    default: break;
+    }
+    response.html(data.get_identifier()).raw('\n')
+            .raw("Content type: ").html(data.get_content_type()).raw('\n')
+            .raw("Zoom: ").number(zoom)
+            .raw(" of ").number(pyramid.size() - 1).raw('\n')
+            .raw("Width: ").number(width).raw('\n')
+            .raw("Height: ").number(height).raw('\n')
+            .raw("Columns: ").number(view.x)
+            .raw(" to ").number(view.x + cols).raw('\n')
+            .raw("Rows: ").number(view.y)
+            .raw(" to ").number(view.y + rows).raw('\n').raw('\n')
+            .braille(braille);
+    response.flush();
+    out << pre() << endl;
+    break;
+
+  case output_mode::json:
+    response.key("src").raw('{');
+    print_json_source(response, data);
+    response.raw(',')
+            .key("content-type").json(data.get_content_type())
+            .raw('}')
+            .raw(',')
+            .key("view").raw('{')
+            .key("zoom").number(zoom).raw(',')
+            .key("zooms").number(pyramid.size()).raw(',')
+            .key("width").number(width).raw(',')
+            .key("height").number(height).raw(',')
+            .key("x").number(view.x).raw(',')
+            .key("y").number(view.y).raw(',')
+            .key("cols").number(cols).raw(',')
+            .key("rows").number(rows)
+            .raw('}')
+            .raw(',');
+    if (conversion_cache().enabled() or shared_segment().enabled())
+      response.key("cache").json(cached? "hit": "miss")
+              .raw(',');
+    response.key("braille").json_braille(braille);
+    response.flush();
+    break;
+
+  default:
+    response.braille(braille);
+    response.flush();
+    break;
+  }
+}
+
+// Message catalogs are loaded when a language is first asked for, once per
+// process, and cached per language.  English needs none.
+static std::locale
+message_locale(std::string const &language)
+{
+  static boost::locale::generator &locale_gen = [] () -> boost::locale::generator & {
+    static boost::locale::generator generator;
+    generator.add_messages_path(".");
+    generator.add_messages_domain("img2brl");
+    generator.locale_cache_enabled(true);
+    return generator;
+  }();
+  return locale_gen(language + ".UTF-8");
+}
+
+// ImageMagick is only initialized by the first request with an image
+static char const *program_path = nullptr;
+
+void
+initialize(char const *path)
+{
+  program_path = path;
+  fetch_initialize();
+  shared_segment();
+}
+
+void
+finalize()
+{
+  fetch_finalize();
+}
+
+int
+handle_request(cgicc::CgiInput *input, std::ostream &out, serving how)
 {
   clock_type::time_point start_time = clock_type::now();
-  boost::locale::generator locale_gen;
-  locale_gen.add_messages_path(".");
-  locale_gen.add_messages_domain("img2brl");
+  request_timings timings;
 
   output_mode mode{output_mode::html};
   std::string html_lang = "en";
-  Cgicc cgi;
+  Cgicc cgi(input);
+
+  // Requests are served concurrently in different languages, so never
+  // touch the global locale.  Messages are translated with out's locale.
+  std::locale language = std::locale::classic();
 
-  if (char *value = std::getenv("HTTP_ACCEPT_LANGUAGE")) {
+  std::string const accept_language_header =
+    cgi.getEnvironment().getAcceptLanguageString();
+  if (not accept_language_header.empty()) {
     std::stringstream msg;
-    msg << "Accept-Language: " << value << endl;
+    msg << "Accept-Language: " << accept_language_header << endl;
     try {
-      accept_language client(value);
+      accept_language client(accept_language_header);
       if (client.accepts_language("de")) {
-        locale::global(locale_gen("de.UTF-8"));
+        language = message_locale("de");
         html_lang = "de";
       }
     } catch (std::runtime_error const &e) {
@@ -293,19 +1141,20 @@ int main()
   if (cgi.getElement("lang") != cgi.getElements().end()) {
     std::set<std::string> const available_languages{"en", "de"};
     if (available_languages.find(cgi("lang")) != available_languages.end()) {
-      locale::global(locale_gen(cgi("lang")+".UTF-8"));
+      language = message_locale(cgi("lang"));
       html_lang = cgi("lang");
     }
   }
 
-  cout.imbue(locale());
+  out.imbue(language);
 
   try {
     if (cgi.getElement("mode") != cgi.getElements().end()) {
       std::map<std::string, output_mode> const modes = {
         { "html", output_mode::html },
         { "json", output_mode::json },
-        { "text", output_mode::text }
+        { "text", output_mode::text },
+        { "binary", output_mode::binary }
       };
       try {
         mode = modes.at(cgi("mode"));
@@ -315,262 +1164,302 @@ int main()
       }
     }
 
+    conversion_options const options = parse_options(cgi);
+    // Fanning out to every core within a server request would oversubscribe
+    // the cores its pool already uses
+    std::size_t const threads = how == serving::server? 1: 0;
+
+    std::vector<FormEntry> urls;
+    cgi.getElement("url", urls);
+    std::size_t const images =
+      std::count_if(cgi.getFiles().begin(), cgi.getFiles().end(),
+                    [](FormFile const &file) {
+                      return file.getName() == "img" and not file.getData().empty();
+                    })
+    + std::count_if(urls.begin(), urls.end(), [](FormEntry const &url) {
+                      return not url.getValue().empty();
+                    });
+    if (images) {
+      // The landing page and show=formats never need ImageMagick.  A CGI
+      // process answers this one request, so its time can be limited too.
+      convert_initialize(program_path);
+      set_resource_limits(image_limits(), how == serving::cgi);
+    }
+    if (images > 1 or cgi.queryCheckbox("batch")) {
+      // Only JSON can represent several results
+      mode = output_mode::json;
+      if (images > max_batch_size) throw http_error(413);
+      print_header(out, mode, "", html_lang);
+      print_batch(out, cgi, options, timings, threads);
+      print_footer(out, mode, start_time, timings);
+      return EXIT_SUCCESS;
+    }
+
+    if (cgi.queryCheckbox("view")) {
+      // Zoom levels replace resizing
+      conversion_options whole = options;
+      whole.columns = 0;
+      source data;
+      bool cached = false;
+      std::shared_ptr<dot_pyramid const> const pyramid =
+        cached_pyramid(cgi, whole, data, cached, timings);
+      if (pyramid and pyramid->size()) {
+        if (mode != output_mode::binary)
+          print_header(out, mode, translate("Tactile Image Viewer").str(out.getloc()),
+                       html_lang);
+        {
+          stage_timer timer(&timings, stage::render);
+          print_view(out, mode, data, *pyramid, parse_viewport(cgi), cached);
+        }
+        print_footer(out, mode, start_time, timings);
+        return EXIT_SUCCESS;
+      }
+    }
+
     const_file_iterator file = cgi.getFile("img");
     const_form_iterator url = cgi.getElement("url");
     source data;
+    conversion result;
+    bool cached = false;
+    std::string url_key;
+    std::chrono::seconds url_ttl{0};
+
+    // A range of frames or pages instead of just the first one
+    frame_range frames;
+    bool const animated = mode != output_mode::binary and
+                          not cgi("frames").empty();
+    if (animated and not parse_frame_range(cgi("frames"), frames))
+      throw http_error(400);
 
     if (file != cgi.getFiles().end() and not file->getData().empty()) {
       data = source(source::file, file->getFilename(), file->getDataType(), file->getData());
     } else if (url != cgi.getElements().end() and not url->getValue().empty()) {
-      curl_global_init(CURL_GLOBAL_DEFAULT);
-      if (CURL *curl = curl_easy_init()) {
-        char error_buffer[CURL_ERROR_SIZE];
-        if (curl_easy_setopt(curl, CURLOPT_ERRORBUFFER,
-                             error_buffer) == CURLE_OK) {
-          if (curl_easy_setopt(curl, CURLOPT_URL,
-                               url->getValue().c_str()) == CURLE_OK) {
-            if (curl_easy_setopt(curl, CURLOPT_USERAGENT,
-                                 cgi.getEnvironment().getUserAgent().c_str()) == CURLE_OK) {
-              if (curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION,
-                                   1L) == CURLE_OK) {
-                if (curl_easy_setopt(curl, CURLOPT_MAXREDIRS,
-                                     3L) == CURLE_OK) {
-                  if (curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION,
-                                       curl_append_to_string) == CURLE_OK) {
-                    std::string buffer;
-                    if (curl_easy_setopt(curl, CURLOPT_WRITEDATA,
-                                         &buffer) == CURLE_OK) {
-//                    if (curl_easy_setopt(curl, CURLOPT_FAILONERROR, true) == CURLE_OK) {
-                      if (curl_easy_perform(curl) == CURLE_OK) {
-                        long http_response_code;
-                        if (curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE,
-                                              &http_response_code) == CURLE_OK) {
-                          if (http_response_code == 200 and not buffer.empty()) {
-                            char *content_type;
-                            if (curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE,
-                                                  &content_type) == CURLE_OK) {
-                              data = source(source::url, url->getValue(), content_type, buffer);
-                            } else {
-                              cerr << error_buffer << endl;
-                            }
-                          } else {
-                            throw http_error(http_response_code);
-                          }
-                        } else {
-                          cerr << error_buffer << endl;
-                        }
-                      } else {
-                        cerr << error_buffer << endl;
-                      }
-                    }
-                  }
-                }
-              }
-            }
-          }
+      // A recent conversion of the same URL saves the fetch altogether
+      url_key = "url " + options.key() + ' ' + url->getValue();
+      if (not animated and find_shared(url_key, result, url_time_to_live())) {
+        cached = true;
+        data = source(source::url, url->getValue(), result.content_type, "");
+      } else {
+        fetched response;
+        {
+          stage_timer timer(&timings, stage::fetch);
+          response = fetch(url->getValue(), cgi.getEnvironment().getUserAgent(),
+                           download_cache(), download_limits());
+        }
+        if (response.status == 200 and not response.body.empty()) {
+          data = source(source::url, url->getValue(), response.content_type,
+                        std::move(response.body));
+          url_ttl = url_time_to_live(response);
+          if (not url_ttl.count()) url_key.clear();
+        } else if (response.status) {
+          throw http_error(response.status);
+        } else {
+          cerr << response.error << endl;
         }
-        curl_easy_cleanup(curl);
       }
-      curl_global_cleanup();
     }
 
-    print_header(mode, translate("Tactile Image Viewer"), html_lang);
+    if (mode == output_mode::binary) {
+      // The headers need the size of the result, convert before writing any
+      if (not cached) {
+        if (data.get_data().empty()) throw http_error(400);
+        try {
+          cached = cached_convert(data, options, result, &timings);
+        } catch (Magick::ErrorMissingDelegate const &e) {
+          throw http_error(415);
+        } catch (image_too_large const &e) {
+          throw http_error(413);
+        } catch (Magick::ErrorResourceLimit const &e) {
+          throw http_error(413);
+        }
+        if (not url_key.empty()) insert_shared(url_key, result, url_ttl);
+      }
+      stage_timer timer(&timings, stage::render);
+      print_binary(out, result.braille);
+      return EXIT_SUCCESS;
+    }
+
+    print_header(out, mode, translate("Tactile Image Viewer").str(out.getloc()),
+                 html_lang);
 
     if (cgi.getElement("show") != cgi.getElements().end() and cgi.getElement("show")->getValue() == "formats") {
       if (mode == output_mode::html) {
-        cout << h1(boost::locale::translate("Supported image formats")) << endl;
-        print_supported_image_formats();
+        out << h1(translate("Supported image formats").str(out.getloc())) << endl;
+        print_supported_image_formats(out);
       }
     }
 
-    if (not data.get_data().empty()) {
+    if (animated and not data.get_data().empty()) {
+      try {
+	print_frames(out, mode, data, options, frames, cgi.queryCheckbox("diff"),
+		     timings, threads);
+      } catch (Magick::ErrorMissingDelegate const &missing_delegate_exception) {
+	print_unsupported(out, mode, missing_delegate_exception);
+      } catch (image_too_large const &too_large_exception) {
+	print_too_large(out, mode, too_large_exception);
+      } catch (Magick::ErrorResourceLimit const &resource_limit_exception) {
+	print_too_large(out, mode, resource_limit_exception);
+      }
+    } else if (cached or not data.get_data().empty()) {
       try {
-	Magick::Blob blob(data.get_data().data(), data.get_data().length());
-	Magick::Image image(blob);
-	if (cgi.queryCheckbox("trim")) image.trim();
-	if (cgi.queryCheckbox("normalize")) image.normalize();
-	if (cgi.queryCheckbox("negate")) {
-	  //  image.threshold(50.0);
-	  image.negate(true);
+	// Text and HTML can be written while the image is still decoded, as
+	// long as nothing needs the whole image first
+	bool const streaming = not cached and mode != output_mode::json and
+			       cgi.queryCheckbox("stream") and not options.trim and
+			       not options.normalize and not options.columns and
+			       options.dither == dither_mode::bilevel;
+	if (not cached and not streaming) {
+	  cached = cached_convert(data, options, result, &timings);
+	  if (not url_key.empty()) insert_shared(url_key, result, url_ttl);
+	} else if (streaming) {
+	  // Turned away before anything of the result is written
+	  stage_timer timer(&timings, stage::decode);
+	  admit_image(data.get_data(), image_limits());
 	}
-	if (cgi.queryCheckbox("resize")) {
-	  const_form_iterator cols = cgi.getElement("cols");
-	  if (cols != cgi.getElements().end()) {
-	    try {
-	      Magick::Geometry geometry( boost::lexical_cast<std::size_t>
-					 (cols->getValue()) * 2
-					 , 0
-					 );
-	      if (geometry.width()) {
-		geometry.less(false);
-		geometry.greater(true);
-		image.resize(geometry);
-	      }
-	    } catch (boost::bad_lexical_cast const &e) {
+
+	{
+	  stage_timer timer(&timings, stage::render);
+	  if (mode == output_mode::html) {
+	    out << pre().set("id", "result") << endl;
+	    response_writer response(out);
+	    switch (data.get_type()) {
+	    case source::file: response.raw("Filename: "); break;
+	    case source::url: response.raw("Url: "); break;
+	    default: break;
+	    }
+	    response.html(data.get_identifier()).raw('\n')
+		    .raw("Content type: ").html(data.get_content_type()).raw('\n');
+	    if (not streaming) {
+	      response.raw("Format: ").html(result.format).raw('\n');
+	      if (not result.label.empty())
+	        response.raw("Label: ").html(result.label).raw('\n');
+	      response.raw("Width: ").number(result.braille.width()).raw('\n')
+		      .raw("Height: ").number(result.braille.height()).raw('\n')
+		      .raw('\n')
+		      .braille(result.braille);
 	    }
+	    response.flush();
+	  } else if (mode == output_mode::json) {
+	    response_writer response(out);
+	    print_json_result(response, data, result, cached);
+	    response.raw(',').key("braille").json_braille(result.braille);
+	    response.flush();
+	  } else if (not streaming) {
+	    response_writer response(out);
+	    response.braille(result.braille);
+	    response.flush();
 	  }
 	}
 
-	ubrl tactile(image);
-
-	if (mode == output_mode::html) {
-	  cout << pre().set("id", "result") << endl;
-	  switch (data.get_type()) {
-	  case source::file: cout << "Filename: "; break;
-	  case source::url: cout << "Url: "; break;
-	  }
-	  cout << data.get_identifier() << endl;
-	  cout << "Content type: " << data.get_content_type() << endl;
-	  cout << "Format: " << image.format() << endl;
-	  if (not image.label().empty())
-	    cout << "Label: " << image.label() << endl;
-	  cout << "Width: " << tactile.width() << endl
-	       << "Height: " << tactile.height() << endl << endl;
-	} else if (mode == output_mode::json) {
-	  cout << '"' << "src" << '"' << ':'
-	       << '{';
-	  cout << '"';
-	  switch (data.get_type()) {
-	  case source::file: cout << "filename";
-	  case source::url: cout << "url";
-	  }
-	  cout << '"'
-	       << ':'
-	       << '"' << data.get_identifier() << '"'
-	       << ','
-	       << '"' << "content-type" << '"'
-	       << ':'
-	       << '"' << data.get_content_type() << '"'
-	       << ','
-	       << '"' << "format" << '"'
-	       << ':' << '"' << image.format() << '"'
-	       << ',';
-	  if (not image.label().empty())
-	    cout << '"' << "label" << '"' << ':' << '"' << image.label() << '"'
-		 << ',';
-	  if (not image.comment().empty())
-	    cout << '"' << "comment" << '"'
-		 << ':' << '"' << image.comment() << '"'
-		 << ',';
-	  cout << '"' << "width" << '"' << ':' << image.baseColumns()
-	       << ","
-	       << '"' << "height" << '"' << ':' << image.baseRows()
-	       << '}'
-
-	       << ',';
-	  cout << '"' << "width" << '"' << ':' << tactile.width()
-	       << ','
-	       << '"' << "height" << '"' << ':' << tactile.height()
-	       << ','
-	       << '"' << "braille" << '"' << ':' << '"';
+	if (streaming) {
+	  // Decoding, packing and writing interleave, all of it counts as decode
+	  stage_timer timer(&timings, stage::decode);
+	  stream_convert(data.get_data(), options.negate, out,
+			 [&](streamed_image const &image) {
+			   if (mode != output_mode::html) return;
+			   response_writer response(out);
+			   response.raw("Format: ").html(image.format).raw('\n')
+				   .raw("Width: ").number(image.width).raw('\n')
+				   .raw("Height: ").number(image.height).raw('\n')
+				   .raw('\n');
+			   response.flush();
+			 });
 	}
 
-	cout << tactile.string();
-
-	switch (mode) {
-	case output_mode::html: cout << pre() << endl; break;
-	case output_mode::json: cout << '"'; break;
-	default: break;
-	}
+	if (mode == output_mode::html) out << pre() << endl;
       } catch (Magick::ErrorMissingDelegate const &missing_delegate_exception) {
-	switch (mode) {
-	case output_mode::html:
-	  cout << h1("Error: Image format not supported") << endl
-	       << p(missing_delegate_exception.what()) << endl;
-	  break;
-	case output_mode::json:
-	  cout << '"' << "exception" << '"'
-	       << ':'
-	       << '"' << "Magick::ErrorMissingDelegate" << '"'
-	       << ','
-	       << '"' << "message" << '"'
-	       << ':'
-	       << '"' << missing_delegate_exception.what() << '"';
-	  break;
-	case output_mode::text:
-	  cout << "Unsupported image format: "
-	       << missing_delegate_exception.what() << endl;
-	}
+	print_unsupported(out, mode, missing_delegate_exception);
+      } catch (image_too_large const &too_large_exception) {
+	print_too_large(out, mode, too_large_exception);
+      } catch (Magick::ErrorResourceLimit const &resource_limit_exception) {
+	print_too_large(out, mode, resource_limit_exception);
       }
     } else {
       if (mode == output_mode::html) {
-        a formats{a{gettext("formats")}.set("class", "internal")
-			      .set("href", "?show=formats")};
-        a unicode_braille("Unicode braille");
-        unicode_braille.set("href",
-                            "http://en.wikipedia.org/wiki/Unicode_braille");
-        unicode_braille.set("lang", "en");
-        cout << h1(translate("img2brl &mdash; Convert images to Braille")) << endl
-             << p() << format(translate("Translate images from various {1} to {2}.")) 
-                       % a(translate("formats")).set("class", "internal").set("href", "?show=formats")
-                       % unicode_braille
-             << p() << endl;
+        out << rendered_once("intro " + html_lang, out.getloc(), [](std::ostream &out) {
+          a unicode_braille("Unicode braille");
+          unicode_braille.set("href",
+                              "http://en.wikipedia.org/wiki/Unicode_braille");
+          unicode_braille.set("lang", "en");
+          out << h1(translate("img2brl &mdash; Convert images to Braille").str(out.getloc())) << endl
+              << p() << format(translate("Translate images from various {1} to {2}."))
+                        % a(translate("formats").str(out.getloc())).set("class", "internal").set("href", "?show=formats")
+                        % unicode_braille
+              << p() << endl;
+        });
       }
     }
 
     if (mode == output_mode::html) {
-      cout << hr() << endl;
-      print_form(cgi);
-
-      cout << hr() << endl;
-
-      cout << script().set("type", "application/javascript")
-           << "function install (aEvent) {" << endl
-           << "  for (var a = aEvent.target; a.href === undefined;)" << endl
-           << "    a = a.parentNode;" << endl
-           << "  var params = {" << endl
-           << "    'img2brl': { URL: aEvent.target.href," << endl
-           << "                 IconURL: 'favicon.png'," << endl
-           << "                 toString: function () { return this.URL; }" << endl
-           << "               }" << endl
-           << "  };" << endl
-           << "  InstallTrigger.install(params);" << endl
-           << "  return false;" << endl
-           << "}" << endl
-           << script() << endl
-           << cgicc::div() << endl
-           << a().set("href", "img2brl.xpi")
-                 .set("onclick", "return install(event);")
-           << translate("Install Firefox Add-on")
-           << a() << endl
-           << cgicc::div() << endl;
-
-      a github_link("github.com/mlang/img2brl");
-      github_link.set("href", "https://github.com/mlang/img2brl");
-      cout << cgicc::div().set("class", "center") << endl
-           << format(translate("There is an {1}.")) % api_link
-           << ' '
-           << format(translate("Source code? {1} or {2}."))
-              % git_clone % github_link
-           << cgicc::div() << endl;
-
-      struct utsname info;
-      if (uname(&info) != -1)
-	cout << cgicc::div().set("class", "center").set("id", "powered-by") << endl
-	     << (format(translate("Powered by {1}, {2}, {3}, {4}, {5} and {6} running on {7} ({8})."))
-		 % BOOST_COMPILER
-		 % (format("GNU&nbsp;cgicc&nbsp;{1}&nbsp;{2}") % translate("version") % cgi.getVersion())
-		 % (format("libcurl&nbsp;{1}&nbsp;{2}.{3}.{4}")
-		    % translate("version")
-		    % LIBCURL_VERSION_MAJOR
-		    % LIBCURL_VERSION_MINOR
-		    % LIBCURL_VERSION_PATCH)
-		 % (format("Magick++&nbsp;{1}&nbsp;{2}")
-		    % translate("version")
-		    % MAGICKPP_VERSION)
-		 % (format("Boost&nbsp;{1}&nbsp;{2}.{3}.{4}")
-		    % translate("version")
-		    % (BOOST_VERSION / 100000)
-		    % (BOOST_VERSION / 100 % 1000)
-		    % (BOOST_VERSION % 100))
-		 % (format("{1}&nbsp;{2}&nbsp;{3}")
-		    % info.sysname % translate("version") % info.release)
-		 % info.nodename
-		 % cgi.getHost())
-	     << cgicc::div() << endl;
+      out << hr() << endl;
+      print_form(out, cgi);
+
+      out << hr() << endl;
+
+      // Everything but the remote host, which is not worth a cache entry
+      std::string const tail =
+        rendered_once("tail " + html_lang, out.getloc(), [&cgi](std::ostream &out) {
+          out << script().set("type", "application/javascript")
+              << "function install (aEvent) {" << endl
+              << "  for (var a = aEvent.target; a.href === undefined;)" << endl
+              << "    a = a.parentNode;" << endl
+              << "  var params = {" << endl
+              << "    'img2brl': { URL: aEvent.target.href," << endl
+              << "                 IconURL: 'favicon.png'," << endl
+              << "                 toString: function () { return this.URL; }" << endl
+              << "               }" << endl
+              << "  };" << endl
+              << "  InstallTrigger.install(params);" << endl
+              << "  return false;" << endl
+              << "}" << endl
+              << script() << endl
+              << cgicc::div() << endl
+              << a().set("href", "img2brl.xpi")
+                    .set("onclick", "return install(event);")
+              << translate("Install Firefox Add-on")
+              << a() << endl
+              << cgicc::div() << endl;
+
+          a github_link("github.com/mlang/img2brl");
+          github_link.set("href", "https://github.com/mlang/img2brl");
+          out << cgicc::div().set("class", "center") << endl
+              << format(translate("There is an {1}.")) % api_link
+              << ' '
+              << format(translate("Source code? {1} or {2}."))
+                 % git_clone % github_link
+              << cgicc::div() << endl;
+
+          struct utsname info;
+          if (uname(&info) != -1)
+            out << cgicc::div().set("class", "center").set("id", "powered-by") << endl
+                << (format(translate("Powered by {1}, {2}, {3}, {4}, {5} and {6} running on {7} ({8})."))
+                    % BOOST_COMPILER
+                    % (format("GNU&nbsp;cgicc&nbsp;{1}&nbsp;{2}") % translate("version") % cgi.getVersion())
+                    % (format("libcurl&nbsp;{1}&nbsp;{2}.{3}.{4}")
+                       % translate("version")
+                       % LIBCURL_VERSION_MAJOR
+                       % LIBCURL_VERSION_MINOR
+                       % LIBCURL_VERSION_PATCH)
+                    % (format("Magick++&nbsp;{1}&nbsp;{2}")
+                       % translate("version")
+                       % MAGICKPP_VERSION)
+                    % (format("Boost&nbsp;{1}&nbsp;{2}.{3}.{4}")
+                       % translate("version")
+                       % (BOOST_VERSION / 100000)
+                       % (BOOST_VERSION / 100 % 1000)
+                       % (BOOST_VERSION % 100))
+                    % (format("{1}&nbsp;{2}&nbsp;{3}")
+                       % info.sysname % translate("version") % info.release)
+                    % info.nodename
+                    % '\x01')
+                << cgicc::div() << endl;
+        });
+      std::string::size_type const host = tail.find('\x01');
+      if (host == std::string::npos) out << tail;
+      else out << tail.substr(0, host) << cgi.getHost() << tail.substr(host + 1);
     }
 
-    print_footer(mode, start_time);
+    print_footer(out, mode, start_time, timings);
 
     return EXIT_SUCCESS;
   } catch (http_error const &e) {
@@ -581,19 +1470,33 @@ int main()
       { 402, "Payment Required" },
       { 403, "Forbidden" },
       { 404, "Not Found" },
-      { 405, "Method Not Allowed" }
+      { 405, "Method Not Allowed" },
+      { 410, "Gone" },
+      { 413, "Payload Too Large" },
+      { 415, "Unsupported Media Type" },
+      { 500, "Internal Server Error" },
+      { 502, "Bad Gateway" },
+      { 503, "Service Unavailable" },
+      { 504, "Gateway Timeout" }
     };
-    cout << "Status: " << e.code << ' ' << messages.at(e.code) << endl;
-    print_header(mode, "Error while fetching URL", html_lang);
+    auto const message = messages.find(e.code);
+    // Status codes we have no message for are passed on as a plain failure
+    if (message != messages.end())
+      out << "Status: " << e.code << ' ' << message->second << endl;
+    else
+      out << "Status: " << 502 << ' ' << messages.at(502) << endl;
+    print_header(out, mode, "Error while fetching URL", html_lang);
 
     if (mode == output_mode::html) {
-      cout << h1("An error occured while fetching URL") << endl
-           << p("Please try again with a different URL.") << endl;
+      out << h1("An error occured while fetching URL") << endl
+          << p("Please try again with a different URL.") << endl;
 
-      print_form(cgi);
+      print_form(out, cgi);
     }
 
-    print_footer(mode, start_time);
+    print_footer(out, mode, start_time, timings);
+
+    return EXIT_SUCCESS;
   } catch (exception const &e) {
     cerr << e.what() << endl;
     return EXIT_FAILURE;
@@ -0,0 +1,22 @@
+#ifndef IMG2BRL_H
+#define IMG2BRL_H
+
+#include <iosfwd>
+
+namespace cgicc { class CgiInput; }
+
+// Set up process wide state (ImageMagick, curl) once, before any request.
+void initialize(char const *path);
+void finalize();
+
+// Who answers the request.  A CGI process answers just this one, so it may
+// use every core and limit the time of the whole process.  The HTTP server
+// already runs one request per core on its pool, so each request converts
+// on its own worker only.
+enum class serving { cgi, server };
+
+// Read one CGI request from input (the process environment and standard
+// input if null) and write the complete CGI response to out.
+int handle_request(cgicc::CgiInput *input, std::ostream &out, serving);
+
+#endif
@@ -0,0 +1,69 @@
+/*
+ *  Copyright (C) 2013 Mario Lang <mlang@delysid.org>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Affero General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 3 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU LAffero General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110, USA. 
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include "http_server.h"
+#include "img2brl.h"
+
+// Without arguments, handle a single CGI request.  With --listen
+// [ADDRESS:]PORT, stay resident and answer HTTP requests directly,
+// serving static files from the directory given with --root.
+// --threads and --queue size the worker pool and its request queue.
+int main(int argc, char *argv[])
+{
+  char const *listen = nullptr;
+  char const *root = ".";
+  std::size_t threads = 0, queue = 64;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--listen") == 0 and i + 1 < argc) {
+      listen = argv[++i];
+    } else if (std::strcmp(argv[i], "--root") == 0 and i + 1 < argc) {
+      root = argv[++i];
+    } else if (std::strcmp(argv[i], "--threads") == 0 and i + 1 < argc) {
+      threads = std::strtoul(argv[++i], nullptr, 10);
+    } else if (std::strcmp(argv[i], "--queue") == 0 and i + 1 < argc) {
+      queue = std::strtoul(argv[++i], nullptr, 10);
+    }
+  }
+
+  initialize(argv[0]);
+  int status = EXIT_SUCCESS;
+  if (listen) {
+    try {
+      http_server server(listen, root,
+                         [](cgicc::CgiInput *input, std::ostream &out) {
+                           return handle_request(input, out, serving::server);
+                         },
+                         threads, queue);
+      std::cerr << "Listening on " << listen << std::endl;
+      server.run();
+    } catch (std::exception const &e) {
+      std::cerr << e.what() << std::endl;
+      status = EXIT_FAILURE;
+    }
+  } else {
+    status = handle_request(nullptr, std::cout, serving::cgi);
+  }
+  finalize();
+
+  return status;
+}
@@ -0,0 +1,213 @@
+#include "pack.h"
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMG2BRL_PACK_X86
+#include <immintrin.h>
+#endif
+
+namespace /* anonymous */ {
+
+// Bit of the dot at row dy, column dx of a 2x4 cell, in Unicode braille order
+unsigned char const dot[4][2] = {
+  { 0x01, 0x08 },
+  { 0x02, 0x10 },
+  { 0x04, 0x20 },
+  { 0x40, 0x80 }
+};
+
+void
+pack_scalar( unsigned char const *const row[4], std::size_t width
+           , unsigned char threshold
+           , unsigned char *cells
+           )
+{
+  for (std::size_t x = 0; x < width; x += 2, ++cells) {
+    unsigned char cell = 0;
+    for (std::size_t dy = 0; dy < 4; ++dy) {
+      if (row[dy][x] < threshold) cell |= dot[dy][0];
+      if (x + 1 < width and row[dy][x + 1] < threshold) cell |= dot[dy][1];
+    }
+    *cells = cell;
+  }
+}
+
+char *
+encode_scalar(unsigned char const *cells, std::size_t count, char *utf8)
+{
+  for (unsigned char const *end = cells + count; cells != end; ++cells) {
+    *utf8++ = static_cast<char>(0xE2);
+    *utf8++ = static_cast<char>(0xA0 | (*cells >> 6));
+    *utf8++ = static_cast<char>(0x80 | (*cells & 0x3F));
+  }
+  return utf8;
+}
+
+// Hand the pixels the vector loops did not consume to the scalar kernel
+void
+pack_tail( unsigned char const *const row[4], std::size_t x, std::size_t width
+         , unsigned char threshold
+         , unsigned char *cells
+         )
+{
+  unsigned char const *const tail[4] = {
+    row[0] + x, row[1] + x, row[2] + x, row[3] + x
+  };
+  pack_scalar(tail, width - x, threshold, cells + x / 2);
+}
+
+#ifdef IMG2BRL_PACK_X86
+
+// The vector kernels compare the whole row at once.  A pair of neighbouring
+// pixels shares a 16 bit lane with the left pixel in the low byte, so masking
+// with the dot bits of both columns and folding the high byte onto the low
+// one yields a cell per lane.
+
+__attribute__((target("sse2")))
+void
+pack_sse2( unsigned char const *const row[4], std::size_t width
+         , unsigned char threshold
+         , unsigned char *cells
+         )
+{
+  if (not threshold) {
+    std::fill(cells, cells + (width + 1) / 2, 0);
+    return;
+  }
+
+  __m128i const limit = _mm_set1_epi8(static_cast<char>(threshold - 1));
+  __m128i const low = _mm_set1_epi16(0x00FF);
+  __m128i pattern[4];
+  for (std::size_t dy = 0; dy < 4; ++dy)
+    pattern[dy] = _mm_set1_epi16(static_cast<short>(dot[dy][0] | dot[dy][1] << 8));
+
+  std::size_t x = 0;
+  for (; x + 32 <= width; x += 32) {
+    __m128i left = _mm_setzero_si128(), right = _mm_setzero_si128();
+    for (std::size_t dy = 0; dy < 4; ++dy) {
+      __m128i a = _mm_loadu_si128(reinterpret_cast<__m128i const *>(row[dy] + x));
+      __m128i b = _mm_loadu_si128(reinterpret_cast<__m128i const *>(row[dy] + x + 16));
+      // a < threshold  <=>  min(a, threshold - 1) == a
+      a = _mm_cmpeq_epi8(_mm_min_epu8(a, limit), a);
+      b = _mm_cmpeq_epi8(_mm_min_epu8(b, limit), b);
+      left = _mm_or_si128(left, _mm_and_si128(a, pattern[dy]));
+      right = _mm_or_si128(right, _mm_and_si128(b, pattern[dy]));
+    }
+    left = _mm_or_si128(_mm_and_si128(left, low), _mm_srli_epi16(left, 8));
+    right = _mm_or_si128(_mm_and_si128(right, low), _mm_srli_epi16(right, 8));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(cells + x / 2),
+                     _mm_packus_epi16(left, right));
+  }
+  pack_tail(row, x, width, threshold, cells);
+}
+
+__attribute__((target("avx2")))
+void
+pack_avx2( unsigned char const *const row[4], std::size_t width
+         , unsigned char threshold
+         , unsigned char *cells
+         )
+{
+  if (not threshold) {
+    std::fill(cells, cells + (width + 1) / 2, 0);
+    return;
+  }
+
+  __m256i const limit = _mm256_set1_epi8(static_cast<char>(threshold - 1));
+  __m256i const low = _mm256_set1_epi16(0x00FF);
+  __m256i pattern[4];
+  for (std::size_t dy = 0; dy < 4; ++dy)
+    pattern[dy] = _mm256_set1_epi16(static_cast<short>(dot[dy][0] | dot[dy][1] << 8));
+
+  std::size_t x = 0;
+  for (; x + 64 <= width; x += 64) {
+    __m256i left = _mm256_setzero_si256(), right = _mm256_setzero_si256();
+    for (std::size_t dy = 0; dy < 4; ++dy) {
+      __m256i a = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(row[dy] + x));
+      __m256i b = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(row[dy] + x + 32));
+      a = _mm256_cmpeq_epi8(_mm256_min_epu8(a, limit), a);
+      b = _mm256_cmpeq_epi8(_mm256_min_epu8(b, limit), b);
+      left = _mm256_or_si256(left, _mm256_and_si256(a, pattern[dy]));
+      right = _mm256_or_si256(right, _mm256_and_si256(b, pattern[dy]));
+    }
+    left = _mm256_or_si256(_mm256_and_si256(left, low), _mm256_srli_epi16(left, 8));
+    right = _mm256_or_si256(_mm256_and_si256(right, low), _mm256_srli_epi16(right, 8));
+    // packus works per 128 bit lane, restore the order of the cells
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(cells + x / 2),
+                        _mm256_permute4x64_epi64(_mm256_packus_epi16(left, right),
+                                                 0xD8));
+  }
+  pack_tail(row, x, width, threshold, cells);
+}
+
+// Spread 16 cells over 48 bytes of UTF-8 with byte shuffles.  Each output
+// vector takes its second and third bytes of every sequence from hi and lo
+// and ORs in the constant lead byte 0xE2.
+__attribute__((target("ssse3")))
+char *
+encode_ssse3(unsigned char const *cells, std::size_t count, char *utf8)
+{
+  char const e = static_cast<char>(0xE2);
+  __m128i const hi_shuffle[3] = {
+    _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1),
+    _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10),
+    _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1)
+  };
+  __m128i const lo_shuffle[3] = {
+    _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1),
+    _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1),
+    _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15)
+  };
+  __m128i const lead[3] = {
+    _mm_setr_epi8(e, 0, 0, e, 0, 0, e, 0, 0, e, 0, 0, e, 0, 0, e),
+    _mm_setr_epi8(0, 0, e, 0, 0, e, 0, 0, e, 0, 0, e, 0, 0, e, 0),
+    _mm_setr_epi8(0, e, 0, 0, e, 0, 0, e, 0, 0, e, 0, 0, e, 0, 0)
+  };
+  __m128i const three = _mm_set1_epi8(0x03), six_bits = _mm_set1_epi8(0x3F);
+
+  unsigned char const *const end = cells + count;
+  for (; end - cells >= 16; cells += 16, utf8 += 48) {
+    __m128i const c = _mm_loadu_si128(reinterpret_cast<__m128i const *>(cells));
+    __m128i const hi = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(c, 6), three),
+                                    _mm_set1_epi8(static_cast<char>(0xA0)));
+    __m128i const lo = _mm_or_si128(_mm_and_si128(c, six_bits),
+                                    _mm_set1_epi8(static_cast<char>(0x80)));
+    for (std::size_t i = 0; i < 3; ++i)
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(utf8 + 16 * i),
+                       _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(hi, hi_shuffle[i]),
+                                                 _mm_shuffle_epi8(lo, lo_shuffle[i])),
+                                    lead[i]));
+  }
+  return encode_scalar(cells, end - cells, utf8);
+}
+
+#endif
+
+std::vector<pack_kernel>
+supported_pack_kernels()
+{
+  std::vector<pack_kernel> kernels{ { "scalar", pack_scalar, encode_scalar } };
+#ifdef IMG2BRL_PACK_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+    kernels.push_back({ "sse2", pack_sse2, encode_scalar });
+  if (__builtin_cpu_supports("avx2"))
+    kernels.push_back({ "avx2", pack_avx2, encode_ssse3 });
+#endif
+  return kernels;
+}
+
+}
+
+std::vector<pack_kernel> const &
+pack_kernels()
+{
+  static std::vector<pack_kernel> const kernels = supported_pack_kernels();
+  return kernels;
+}
+
+pack_kernel const &
+best_pack_kernel()
+{
+  return pack_kernels().back();
+}
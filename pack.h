@@ -0,0 +1,32 @@
+#ifndef IMG2BRL_PACK_H
+#define IMG2BRL_PACK_H
+
+#include <cstddef>
+#include <vector>
+
+// Kernels turning 8 bit luminance into braille cells.  A dot is raised for
+// every pixel whose value is below threshold.  Cells are bytes with the same
+// bit layout as the low byte of the Unicode braille code point (U+2800).
+struct pack_kernel
+{
+  char const *name;
+
+  // Pack the four rows starting at row[0..3], width pixels each, into
+  // (width + 1) / 2 cells.
+  void (*pack)( unsigned char const *const row[4], std::size_t width
+              , unsigned char threshold
+              , unsigned char *cells
+              );
+
+  // Write count cells as 3 byte UTF-8 sequences and return the end of output.
+  char *(*encode)(unsigned char const *cells, std::size_t count, char *utf8);
+};
+
+// All kernels the running CPU supports, ordered from slowest to fastest.
+// The first one is always the portable scalar implementation.
+std::vector<pack_kernel> const &pack_kernels();
+
+// The fastest supported kernel, selected once at runtime.
+pack_kernel const &best_pack_kernel();
+
+#endif
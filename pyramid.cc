@@ -0,0 +1,196 @@
+#include "pyramid.h"
+#include "fields.h"
+#include "pack.h"
+
+#include <algorithm>
+
+namespace /* anonymous */ {
+
+// Bit layout of a braille cell, see pack.h
+unsigned char const cell_dot[4][2] = {
+  { 0x01, 0x08 }, { 0x02, 0x10 }, { 0x04, 0x20 }, { 0x40, 0x80 }
+};
+
+// OR adjacent pairs of bits together, 8 bits become 4
+struct pair_table
+{
+  unsigned char halve[256];
+
+  pair_table()
+  {
+    for (unsigned value = 0; value < 256; ++value) {
+      halve[value] = 0;
+      for (unsigned bit = 0; bit < 4; ++bit)
+        if (value >> (2 * bit) & 3) halve[value] |= 1 << bit;
+    }
+  }
+};
+
+dot_pyramid::level
+make_level(std::size_t width, std::size_t height)
+{
+  dot_pyramid::level result;
+  result.width = width;
+  result.height = height;
+  result.stride = (width + 7) / 8;
+  result.bits.assign(result.stride * height, 0);
+  return result;
+}
+
+dot_pyramid::level
+halve(dot_pyramid::level const &from)
+{
+  static pair_table const table;
+  dot_pyramid::level to = make_level((from.width + 1) / 2, (from.height + 1) / 2);
+  for (std::size_t y = 0; y < to.height; ++y) {
+    unsigned char const *upper = &from.bits[2 * y * from.stride];
+    unsigned char const *lower = 2 * y + 1 < from.height? upper + from.stride: nullptr;
+    unsigned char *row = &to.bits[y * to.stride];
+    for (std::size_t x = 0; x < from.stride; ++x) {
+      unsigned char const both = upper[x] | (lower? lower[x]: 0);
+      row[x / 2] |= table.halve[both] << (x % 2 * 4);
+    }
+  }
+  return to;
+}
+
+}
+
+dot_pyramid::dot_pyramid(braille_cells const &cells)
+{
+  level base = make_level(cells.width(), cells.height());
+  for (std::size_t row = 0; row < cells.rows(); ++row)
+    for (std::size_t column = 0; column < cells.columns(); ++column) {
+      unsigned char const cell = cells.row(row)[column];
+      for (std::size_t dy = 0; dy < 4; ++dy)
+        for (std::size_t dx = 0; dx < 2; ++dx) {
+          std::size_t const x = column * 2 + dx, y = row * 4 + dy;
+          if (cell & cell_dot[dy][dx] and x < base.width and y < base.height)
+            base.bits[y * base.stride + x / 8] |= 1 << (x % 8);
+        }
+    }
+  levels.push_back(std::move(base));
+  while (levels.back().width > 2 or levels.back().height > 4)
+    levels.push_back(halve(levels.back()));
+}
+
+std::size_t
+dot_pyramid::bytes() const
+{
+  std::size_t total = 0;
+  for (level const &each: levels) total += each.bits.size();
+  return total;
+}
+
+braille_cells
+dot_pyramid::view( std::size_t zoom, std::size_t x, std::size_t y
+                 , std::size_t cols, std::size_t rows
+                 ) const
+{
+  if (zoom >= levels.size()) return braille_cells();
+  level const &from = levels[zoom];
+  std::size_t const cell_columns = (from.width + 1) / 2;
+  std::size_t const cell_rows = (from.height + 3) / 4;
+  if (x >= cell_columns or y >= cell_rows) return braille_cells();
+  cols = std::min(cols, cell_columns - x);
+  rows = std::min(rows, cell_rows - y);
+
+  // Spread the dots into bytes the packing kernels understand, a raised
+  // dot is dark
+  pack_kernel const &kernel = best_pack_kernel();
+  std::size_t const width = cols * 2;
+  std::vector<unsigned char> band(4 * width);
+  braille_cells result(width, rows * 4);
+  for (std::size_t row = 0; row < rows; ++row) {
+    unsigned char const *lines[4];
+    for (std::size_t dy = 0; dy < 4; ++dy) {
+      unsigned char *line = &band[dy * width];
+      std::size_t const dot_y = (y + row) * 4 + dy;
+      for (std::size_t dx = 0; dx < width; ++dx) {
+        std::size_t const dot_x = x * 2 + dx;
+        line[dx] = dot_y < from.height and dot_x < from.width and
+                   from.dot(dot_x, dot_y)? 0x00: 0xFF;
+      }
+      lines[dy] = line;
+    }
+    kernel.pack(lines, width, 0x80, result.row(row));
+  }
+  return result;
+}
+
+void
+dot_pyramid::serialize(std::ostream &out) const
+{
+  write_field(out, levels.size());
+  for (level const &each: levels) {
+    write_field(out, each.width);
+    write_field(out, each.height);
+    write_field(out, std::string(each.bits.begin(), each.bits.end()));
+  }
+}
+
+bool
+dot_pyramid::deserialize( std::istream &in
+                        , std::size_t max_side, std::uintmax_t max_area
+                        )
+{
+  std::size_t count;
+  if (not read_field(in, count) or not count) return false;
+  std::vector<level> result;
+  for (std::size_t i = 0; i < count; ++i) {
+    std::size_t width, height;
+    std::string bits;
+    if (not (read_field(in, width) and read_field(in, height) and
+             read_field(in, bits)))
+      return false;
+    // Only what the constructor makes: a base within the limits, then
+    // halved levels down to a single cell.  The sizes are checked before
+    // anything is allocated for them.
+    if (i == 0 ? not width or not height or width > max_side or
+                 height > max_side or width > max_area / height
+               : width != (result.back().width + 1) / 2 or
+                 height != (result.back().height + 1) / 2)
+      return false;
+    if ((i + 1 == count) != (width <= 2 and height <= 4)) return false;
+    if (bits.size() != (width + 7) / 8 * height) return false;
+    result.push_back(make_level(width, height));
+    std::copy(bits.begin(), bits.end(), result.back().bits.begin());
+  }
+  levels.swap(result);
+  return true;
+}
+
+std::shared_ptr<dot_pyramid const>
+pyramid_cache::find(std::string const &key)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto i = entries.begin(); i != entries.end(); ++i)
+    if (i->first == key) {
+      entries.splice(entries.begin(), entries, i);
+      return i->second;
+    }
+  return nullptr;
+}
+
+void
+pyramid_cache::insert( std::string const &key
+                     , std::shared_ptr<dot_pyramid const> pyramid
+                     )
+{
+  std::size_t const size = pyramid->bytes();
+  if (size > max_bytes) return;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto i = entries.begin(); i != entries.end(); ++i)
+    if (i->first == key) {
+      bytes -= i->second->bytes();
+      entries.erase(i);
+      break;
+    }
+  entries.emplace_front(key, std::move(pyramid));
+  bytes += size;
+  while (bytes > max_bytes) {
+    bytes -= entries.back().second->bytes();
+    entries.pop_back();
+  }
+}
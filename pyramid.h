@@ -0,0 +1,81 @@
+#ifndef IMG2BRL_PYRAMID_H
+#define IMG2BRL_PYRAMID_H
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "cells.h"
+
+// The dots of a converted image at successively halved resolutions, for
+// panning and zooming on a braille display without converting again.
+// Level 0 holds every dot, each further level raises a dot wherever any of
+// the four dots it covers in the level below is raised, down to a single
+// cell.
+class dot_pyramid
+{
+public:
+  struct level
+  {
+    std::size_t width, height; // in dots
+    std::size_t stride;        // bytes per row
+    std::vector<unsigned char> bits; // a set bit is a raised dot, LSB first
+
+    bool dot(std::size_t x, std::size_t y) const
+    { return bits[y * stride + x / 8] >> (x % 8) & 1; }
+  };
+
+private:
+  std::vector<level> levels;
+
+public:
+  dot_pyramid() {}
+
+  explicit dot_pyramid(braille_cells const &);
+
+  std::size_t size() const { return levels.size(); }
+  level const &operator[](std::size_t zoom) const { return levels[zoom]; }
+
+  // Memory held by all levels
+  std::size_t bytes() const;
+
+  // Up to cols x rows cells starting at cell x, y of the given level,
+  // clipped to the image.
+  braille_cells view( std::size_t zoom, std::size_t x, std::size_t y
+                    , std::size_t cols, std::size_t rows
+                    ) const;
+
+  void serialize(std::ostream &) const;
+  // False for anything the constructor could not have made, like no levels
+  // at all, or a full level wider or taller than max_side or with more than
+  // max_area dots.
+  bool deserialize( std::istream &
+                  , std::size_t max_side, std::uintmax_t max_area
+                  );
+};
+
+// Recently used pyramids kept in memory, so a server answers viewport
+// requests without reading them from disk.  Safe to use from several
+// threads, the least recently used pyramids are dropped beyond max_bytes.
+class pyramid_cache
+{
+  typedef std::pair<std::string, std::shared_ptr<dot_pyramid const>> entry;
+
+  std::size_t max_bytes, bytes;
+  std::list<entry> entries; // most recently used first
+  mutable std::mutex mutex;
+
+public:
+  explicit pyramid_cache(std::size_t max_bytes): max_bytes{max_bytes}, bytes{0} {}
+
+  std::shared_ptr<dot_pyramid const> find(std::string const &key);
+  void insert(std::string const &key, std::shared_ptr<dot_pyramid const>);
+};
+
+#endif
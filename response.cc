@@ -0,0 +1,336 @@
+#include "response.h"
+#include "pack.h"
+
+#include <cstdio>
+#include <ostream>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace /* anonymous */ {
+
+// Beyond this the buffer is given back after a response
+std::size_t const retained_capacity = 16 << 20;
+
+// Bytes from 0x80 on are not escaped, but have to be checked for well
+// formed UTF-8, which JSON requires
+bool
+json_special(unsigned char c)
+{
+  return c < 0x20 or c == '"' or c == '\\' or c >= 0x80;
+}
+
+bool
+html_special(unsigned char c)
+{
+  return c == '&' or c == '<' or c == '>' or c == '"' or c == '\'';
+}
+
+// Length of the prefix of data without characters needing escapes
+std::size_t
+json_plain(char const *data, std::size_t size)
+{
+  std::size_t i = 0;
+#if defined(__SSE2__)
+  __m128i const quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\');
+  // Signed comparison, so bias bytes to find those below 0x20 unsigned.
+  // Bytes from 0x80 on already have the bit movemask looks at.
+  __m128i const bias = _mm_set1_epi8(char(0x80));
+  __m128i const control = _mm_set1_epi8(char(0x80 + 0x20));
+  for (; i + 16 <= size; i += 16) {
+    __m128i const bytes = _mm_loadu_si128(reinterpret_cast<__m128i const *>(data + i));
+    __m128i const special =
+      _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, quote),
+                                _mm_cmpeq_epi8(bytes, backslash)),
+                   _mm_or_si128(_mm_cmplt_epi8(_mm_xor_si128(bytes, bias), control),
+                                bytes));
+    if (int const mask = _mm_movemask_epi8(special))
+      return i + __builtin_ctz(mask);
+  }
+#endif
+  while (i < size and not json_special(data[i])) ++i;
+  return i;
+}
+
+// Length of the well formed UTF-8 sequence at data, which starts with a
+// byte from 0x80 on.  Negative for an ill formed one: minus the length of
+// its maximal subpart, which is replaced by a single U+FFFD as Unicode
+// recommends.
+int
+utf8_sequence(unsigned char const *data, std::size_t size)
+{
+  unsigned char const lead = data[0];
+  unsigned char low = 0x80, high = 0xBF; // of the second byte
+  int length;
+  if (lead >= 0xC2 and lead <= 0xDF) {
+    length = 2;
+  } else if (lead >= 0xE0 and lead <= 0xEF) {
+    length = 3;
+    if (lead == 0xE0) low = 0xA0;       // overlong
+    else if (lead == 0xED) high = 0x9F; // surrogates
+  } else if (lead >= 0xF0 and lead <= 0xF4) {
+    length = 4;
+    if (lead == 0xF0) low = 0x90;       // overlong
+    else if (lead == 0xF4) high = 0x8F; // beyond U+10FFFF
+  } else {
+    return -1;
+  }
+  for (int i = 1; i < length; ++i, low = 0x80, high = 0xBF)
+    if (std::size_t(i) >= size or data[i] < low or data[i] > high) return -i;
+  return length;
+}
+
+std::size_t
+html_plain(char const *data, std::size_t size)
+{
+  std::size_t i = 0;
+#if defined(__SSE2__)
+  __m128i const amp = _mm_set1_epi8('&'), less = _mm_set1_epi8('<');
+  __m128i const greater = _mm_set1_epi8('>'), quote = _mm_set1_epi8('"');
+  __m128i const apostrophe = _mm_set1_epi8('\'');
+  for (; i + 16 <= size; i += 16) {
+    __m128i const bytes = _mm_loadu_si128(reinterpret_cast<__m128i const *>(data + i));
+    __m128i const special =
+      _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, amp),
+                                _mm_cmpeq_epi8(bytes, less)),
+                   _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, greater),
+                                             _mm_cmpeq_epi8(bytes, quote)),
+                                _mm_cmpeq_epi8(bytes, apostrophe)));
+    if (int const mask = _mm_movemask_epi8(special))
+      return i + __builtin_ctz(mask);
+  }
+#endif
+  while (i < size and not html_special(data[i])) ++i;
+  return i;
+}
+
+std::string &
+thread_buffer()
+{
+  static thread_local std::string buffer;
+  return buffer;
+}
+
+}
+
+void
+append_json_escaped(std::string &buffer, char const *data, std::size_t size)
+{
+  static char const hex[] = "0123456789abcdef";
+  while (size) {
+    std::size_t const plain = json_plain(data, size);
+    buffer.append(data, plain);
+    data += plain;
+    size -= plain;
+    if (not size) break;
+
+    if (static_cast<unsigned char>(*data) >= 0x80) {
+      int const length =
+        utf8_sequence(reinterpret_cast<unsigned char const *>(data), size);
+      if (length > 0) buffer.append(data, length);
+      else buffer += "\xEF\xBF\xBD"; // U+FFFD REPLACEMENT CHARACTER
+      std::size_t const used = length > 0? length: -length;
+      data += used;
+      size -= used;
+      continue;
+    }
+
+    unsigned char const c = *data++;
+    --size;
+    switch (c) {
+    case '"': buffer += "\\\""; break;
+    case '\\': buffer += "\\\\"; break;
+    case '\n': buffer += "\\n"; break;
+    case '\r': buffer += "\\r"; break;
+    case '\t': buffer += "\\t"; break;
+    case '\b': buffer += "\\b"; break;
+    case '\f': buffer += "\\f"; break;
+    default:
+      buffer += "\\u00";
+      buffer += hex[c >> 4];
+      buffer += hex[c & 0xF];
+    }
+  }
+}
+
+void
+append_html_escaped(std::string &buffer, char const *data, std::size_t size)
+{
+  while (size) {
+    std::size_t const plain = html_plain(data, size);
+    buffer.append(data, plain);
+    data += plain;
+    size -= plain;
+    if (not size) break;
+
+    switch (*data++) {
+    case '&': buffer += "&amp;"; break;
+    case '<': buffer += "&lt;"; break;
+    case '>': buffer += "&gt;"; break;
+    case '"': buffer += "&quot;"; break;
+    case '\'': buffer += "&#39;"; break;
+    }
+    --size;
+  }
+}
+
+response_writer::response_writer(std::ostream &out)
+: out(out), buffer(thread_buffer())
+{
+  buffer.clear();
+}
+
+response_writer::~response_writer()
+{
+  buffer.clear();
+  if (buffer.capacity() > retained_capacity) std::string().swap(buffer);
+}
+
+response_writer &
+response_writer::raw(char c)
+{
+  buffer += c;
+  return *this;
+}
+
+response_writer &
+response_writer::raw(char const *text)
+{
+  buffer += text;
+  return *this;
+}
+
+response_writer &
+response_writer::raw(std::string const &text)
+{
+  buffer += text;
+  return *this;
+}
+
+response_writer &
+response_writer::number(std::size_t value)
+{
+  char digits[24];
+  buffer.append(digits, std::snprintf(digits, sizeof digits, "%zu", value));
+  return *this;
+}
+
+response_writer &
+response_writer::number(double value)
+{
+  char digits[32];
+  buffer.append(digits, std::snprintf(digits, sizeof digits, "%g", value));
+  return *this;
+}
+
+response_writer &
+response_writer::json(std::string const &text)
+{
+  buffer += '"';
+  append_json_escaped(buffer, text.data(), text.size());
+  buffer += '"';
+  return *this;
+}
+
+response_writer &
+response_writer::key(char const *name)
+{
+  buffer += '"';
+  buffer += name;
+  buffer += "\":";
+  return *this;
+}
+
+response_writer &
+response_writer::html(std::string const &text)
+{
+  append_html_escaped(buffer, text.data(), text.size());
+  return *this;
+}
+
+response_writer &
+response_writer::braille(braille_cells const &cells)
+{
+  pack_kernel const &kernel = best_pack_kernel();
+  std::size_t const line = cells.columns() * 3 + 1;
+  std::size_t size = buffer.size();
+  buffer.resize(size + cells.rows() * line);
+  for (std::size_t y = 0; y < cells.rows(); ++y, size += line) {
+    kernel.encode(cells.row(y), cells.columns(), &buffer[size]);
+    buffer[size + line - 1] = '\n';
+  }
+  return *this;
+}
+
+response_writer &
+response_writer::json_braille(braille_cells const &cells)
+{
+  // Braille never needs escaping, only the line breaks do
+  pack_kernel const &kernel = best_pack_kernel();
+  std::size_t const line = cells.columns() * 3 + 2;
+  std::size_t size = buffer.size();
+  buffer.resize(size + cells.rows() * line + 2);
+  buffer[size++] = '"';
+  for (std::size_t y = 0; y < cells.rows(); ++y, size += line) {
+    kernel.encode(cells.row(y), cells.columns(), &buffer[size]);
+    buffer[size + line - 2] = '\\';
+    buffer[size + line - 1] = 'n';
+  }
+  buffer[size] = '"';
+  return *this;
+}
+
+response_writer &
+response_writer::json_braille(unsigned char const *cells, std::size_t count)
+{
+  std::size_t const size = buffer.size();
+  buffer.resize(size + count * 3 + 2);
+  buffer[size] = '"';
+  best_pack_kernel().encode(cells, count, &buffer[size + 1]);
+  buffer.back() = '"';
+  return *this;
+}
+
+void
+response_writer::flush()
+{
+  out.write(buffer.data(), buffer.size());
+  buffer.clear();
+}
+
+void
+write_json_frames( response_writer &json, std::vector<conversion> const &frames
+                 , std::size_t first, bool diff
+                 )
+{
+  std::vector<cell_run> runs;
+  json.raw('[');
+  for (std::size_t i = 0; i < frames.size(); ++i) {
+    braille_cells const &cells = frames[i].braille;
+    if (i) json.raw(',');
+    json.raw('{')
+        .key("frame").number(first + i)
+        .raw(',')
+        .key("width").number(cells.width())
+        .raw(',')
+        .key("height").number(cells.height())
+        .raw(',');
+    if (diff and i and diff_cells(frames[i - 1].braille, cells, runs)) {
+      json.key("changes").raw('[');
+      for (std::size_t j = 0; j < runs.size(); ++j) {
+        if (j) json.raw(',');
+        json.raw('[').number(runs[j].row)
+            .raw(',').number(runs[j].column)
+            .raw(',').json_braille(cells.row(runs[j].row) + runs[j].column,
+                                   runs[j].count)
+            .raw(']');
+      }
+      json.raw(']');
+    } else {
+      json.key("braille").json_braille(cells);
+    }
+    json.raw('}');
+  }
+  json.raw(']');
+}
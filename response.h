@@ -0,0 +1,68 @@
+#ifndef IMG2BRL_RESPONSE_H
+#define IMG2BRL_RESPONSE_H
+
+#include <cstddef>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+#include "cells.h"
+#include "conversion.h"
+
+// Builds a response body in a buffer and writes it with a single call.
+// The buffer belongs to the thread and keeps its capacity for the next
+// response, so writing does not allocate once it has grown.  Only one
+// writer per thread may exist at a time.
+//
+// Nothing goes through the locale of the stream: numbers are written the
+// way JSON wants them, and strings are escaped for JSON or HTML as asked.
+class response_writer
+{
+  std::ostream &out;
+  std::string &buffer;
+
+public:
+  explicit response_writer(std::ostream &);
+  ~response_writer();
+  response_writer(response_writer const &) = delete;
+  response_writer &operator=(response_writer const &) = delete;
+
+  response_writer &raw(char);
+  response_writer &raw(char const *);
+  response_writer &raw(std::string const &);
+  response_writer &number(std::size_t);
+  response_writer &number(double);
+
+  // A quoted JSON string
+  response_writer &json(std::string const &);
+  // A member name and the colon, name must not need escaping
+  response_writer &key(char const *name);
+  // Text for HTML element content or attribute values
+  response_writer &html(std::string const &);
+
+  // Unicode braille with a newline after every row
+  response_writer &braille(braille_cells const &);
+  // The same as a quoted JSON string
+  response_writer &json_braille(braille_cells const &);
+  // count cells of a single row as a quoted JSON string
+  response_writer &json_braille(unsigned char const *cells, std::size_t count);
+
+  // Write everything collected so far to the stream
+  void flush();
+};
+
+// Frames first, first + 1, ... as a JSON array of objects with their
+// "frame" number, "width", "height" and "braille".  With diff set, frames
+// of the same size as their predecessor carry "changes" instead, an array
+// of [row, column, "cells"] runs to write over the previous frame.
+void write_json_frames( response_writer &, std::vector<conversion> const &
+                      , std::size_t first, bool diff
+                      );
+
+// Append data to buffer with the characters JSON or HTML treat specially
+// escaped.  Runs without such characters are found 16 bytes at a time and
+// copied as a whole.  For JSON, ill formed UTF-8 is replaced by U+FFFD.
+void append_json_escaped(std::string &buffer, char const *data, std::size_t size);
+void append_html_escaped(std::string &buffer, char const *data, std::size_t size);
+
+#endif
@@ -0,0 +1,194 @@
+#include "result_cache.h"
+#include "sha256.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace /* anonymous */ {
+
+char const magic[] = "img2brl-result 3";
+// Including its terminating null, which ends the header of raw values
+char const value_magic[] = "img2brl-value 1";
+
+}
+
+result_cache::result_cache(std::string const &directory, std::uintmax_t max_size)
+: directory{directory}, max_size{max_size}
+{
+  if (not directory.empty() and mkdir(directory.c_str(), 0700) == -1) {
+    struct stat info;
+    if (stat(directory.c_str(), &info) == -1 or not S_ISDIR(info.st_mode))
+      this->directory.clear();
+  }
+}
+
+std::string
+result_cache::key(std::string const &data, conversion_options const &options)
+{
+  // Option keys never contain a null byte, so it separates them from data
+  return sha256().update(options.key()).update("", 1).update(data)
+                 .hex_digest();
+}
+
+std::string
+result_cache::path(std::string const &key) const
+{
+  return directory + '/' + key;
+}
+
+bool
+result_cache::load(std::string const &key, std::string &contents) const
+{
+  if (not enabled()) return false;
+
+  std::ifstream file(path(key), std::ios::binary);
+  if (not file) return false;
+  std::ostringstream buffer;
+  buffer << file.rdbuf();
+  if (file.bad()) return false;
+
+  // Mark as recently used
+  utimensat(AT_FDCWD, path(key).c_str(), nullptr, 0);
+  contents = buffer.str();
+  return true;
+}
+
+void
+result_cache::store(std::string const &key, std::string const &contents) const
+{
+  if (not enabled()) return;
+
+  static std::atomic<unsigned> serial{0};
+  std::string const temporary = path(key) + '.' + std::to_string(getpid())
+                              + '.' + std::to_string(serial++);
+  {
+    std::ofstream file(temporary, std::ios::binary);
+    file << contents;
+    if (not file.flush()) {
+      std::remove(temporary.c_str());
+      return;
+    }
+  }
+  if (std::rename(temporary.c_str(), path(key).c_str()) != 0) {
+    std::remove(temporary.c_str());
+    return;
+  }
+
+  record_cache_growth(directory, max_size, contents.size());
+}
+
+bool
+result_cache::find(std::string const &key, conversion &result) const
+{
+  std::string contents;
+  if (not load(key, contents)) return false;
+  std::istringstream file(contents);
+  std::string header;
+  if (not std::getline(file, header) or header != magic) return false;
+  conversion entry;
+  if (not deserialize(file, entry)) return false;
+  result = std::move(entry);
+  return true;
+}
+
+void
+result_cache::insert(std::string const &key, conversion const &result) const
+{
+  if (not enabled()) return;
+
+  std::ostringstream file;
+  file << magic << '\n';
+  serialize(file, result);
+  store(key, file.str());
+}
+
+bool
+result_cache::find(std::string const &key, std::string &value) const
+{
+  std::string contents;
+  if (not load(key, contents) or
+      contents.compare(0, sizeof value_magic, value_magic, sizeof value_magic))
+    return false;
+  value = contents.substr(sizeof value_magic);
+  return true;
+}
+
+void
+result_cache::insert(std::string const &key, std::string const &value) const
+{
+  if (not enabled()) return;
+
+  store(key, std::string(value_magic, sizeof value_magic) + value);
+}
+
+std::uintmax_t
+evict_least_recently_used( std::string const &directory
+                         , std::uintmax_t max_size
+                         )
+{
+  DIR *dir = opendir(directory.c_str());
+  if (not dir) return 0;
+  std::vector<std::pair<timespec, std::string>> entries;
+  std::uintmax_t total = 0;
+  while (dirent *entry = readdir(dir)) {
+    if (entry->d_name[0] == '.') continue;
+    std::string const file = directory + '/' + entry->d_name;
+    struct stat info;
+    if (stat(file.c_str(), &info) == -1 or not S_ISREG(info.st_mode)) continue;
+    total += info.st_size;
+    entries.emplace_back(info.st_mtim, file);
+  }
+  closedir(dir);
+  if (total <= max_size) return total;
+
+  std::sort(entries.begin(), entries.end(),
+            [](std::pair<timespec, std::string> const &a,
+               std::pair<timespec, std::string> const &b) {
+              return a.first.tv_sec < b.first.tv_sec or
+                     (a.first.tv_sec == b.first.tv_sec and
+                      a.first.tv_nsec < b.first.tv_nsec);
+            });
+  for (auto const &entry: entries) {
+    if (total <= max_size) break;
+    struct stat info;
+    if (stat(entry.second.c_str(), &info) == 0 and
+        std::remove(entry.second.c_str()) == 0)
+      total -= info.st_size;
+  }
+  return total;
+}
+
+void
+record_cache_growth( std::string const &directory, std::uintmax_t max_size
+                   , std::uintmax_t bytes
+                   )
+{
+  int const fd = open((directory + "/.usage").c_str(),
+                      O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    evict_least_recently_used(directory, max_size);
+    return;
+  }
+  flock(fd, LOCK_EX);
+  std::uintmax_t usage;
+  if (pread(fd, &usage, sizeof usage, 0) != sizeof usage) {
+    // A new estimate starts from what is really there
+    usage = evict_least_recently_used(directory, max_size);
+  } else if ((usage += bytes) > max_size) {
+    usage = evict_least_recently_used(directory, max_size / 8 * 7);
+  }
+  if (pwrite(fd, &usage, sizeof usage, 0) == -1) {} // scanned again next time
+  flock(fd, LOCK_UN);
+  close(fd);
+}
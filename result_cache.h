@@ -0,0 +1,57 @@
+#ifndef IMG2BRL_RESULT_CACHE_H
+#define IMG2BRL_RESULT_CACHE_H
+
+#include <cstdint>
+#include <string>
+
+#include "conversion.h"
+
+// Finished conversions stored on local disk, one file per entry, keyed by the
+// SHA-256 of the source bytes and the conversion options.  Several CGI
+// processes can share a directory: entries are written to a temporary file
+// and renamed into place.  Reading an entry refreshes its modification time,
+// and once the directory grows beyond max_size the least recently used
+// entries are removed, see record_cache_growth().
+class result_cache
+{
+  std::string directory;
+  std::uintmax_t max_size;
+
+  std::string path(std::string const &key) const;
+  bool load(std::string const &key, std::string &contents) const;
+  void store(std::string const &key, std::string const &contents) const;
+
+public:
+  // An empty directory or a directory we can not create disables the cache.
+  result_cache(std::string const &directory, std::uintmax_t max_size);
+
+  bool enabled() const { return not directory.empty(); }
+
+  static std::string key(std::string const &data, conversion_options const &);
+
+  bool find(std::string const &key, conversion &) const;
+  void insert(std::string const &key, conversion const &) const;
+
+  // Other data derived from an image, like viewport pyramids, stored as is
+  // next to the conversions.  Use keys which can not collide with key().
+  bool find(std::string const &key, std::string &value) const;
+  void insert(std::string const &key, std::string const &value) const;
+};
+
+// Remove the least recently used files in directory until the remaining ones
+// fit into max_size again.  Returns the size of what remains.
+std::uintmax_t evict_least_recently_used( std::string const &directory
+                                        , std::uintmax_t max_size
+                                        );
+
+// Account for bytes just stored in directory, and evict once it may have
+// outgrown max_size.  Listing the directory and stat()ing every entry is too
+// slow for every insert, so the size is estimated in a hidden file which
+// all processes update under a lock.  Only when the estimate exceeds
+// max_size does one of them scan, down to 7/8 of max_size, so the next scan
+// is not due right away.  Also used by the fetch cache.
+void record_cache_growth( std::string const &directory, std::uintmax_t max_size
+                        , std::uintmax_t bytes
+                        );
+
+#endif
@@ -0,0 +1,104 @@
+#include "sha256.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace /* anonymous */ {
+
+std::uint32_t const round_constants[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+inline std::uint32_t
+rotate_right(std::uint32_t value, unsigned bits)
+{
+  return (value >> bits) | (value << (32 - bits));
+}
+
+}
+
+sha256::sha256()
+: state{ 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a
+       , 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+       }
+, length{0}
+{}
+
+void
+sha256::compress(unsigned char const *data)
+{
+  std::uint32_t w[64];
+  for (int i = 0; i < 16; ++i)
+    w[i] = std::uint32_t(data[4 * i]) << 24 | std::uint32_t(data[4 * i + 1]) << 16
+         | std::uint32_t(data[4 * i + 2]) << 8 | data[4 * i + 3];
+  for (int i = 16; i < 64; ++i) {
+    std::uint32_t const s0 = rotate_right(w[i - 15], 7)
+                           ^ rotate_right(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    std::uint32_t const s1 = rotate_right(w[i - 2], 17)
+                           ^ rotate_right(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  std::uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+                e = state[4], f = state[5], g = state[6], h = state[7];
+  for (int i = 0; i < 64; ++i) {
+    std::uint32_t const s1 = rotate_right(e, 6) ^ rotate_right(e, 11)
+                           ^ rotate_right(e, 25);
+    std::uint32_t const t1 = h + s1 + ((e & f) ^ (~e & g))
+                           + round_constants[i] + w[i];
+    std::uint32_t const s0 = rotate_right(a, 2) ^ rotate_right(a, 13)
+                           ^ rotate_right(a, 22);
+    std::uint32_t const t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+  state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+  state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+sha256 &
+sha256::update(void const *data, std::size_t size)
+{
+  unsigned char const *byte = static_cast<unsigned char const *>(data);
+  std::size_t used = length % sizeof block;
+  length += size;
+  if (used) {
+    std::size_t const fill = std::min(size, sizeof block - used);
+    std::memcpy(block + used, byte, fill);
+    byte += fill, size -= fill, used += fill;
+    if (used < sizeof block) return *this;
+    compress(block);
+  }
+  for (; size >= sizeof block; byte += sizeof block, size -= sizeof block)
+    compress(byte);
+  std::memcpy(block, byte, size);
+  return *this;
+}
+
+std::string
+sha256::hex_digest()
+{
+  std::uint64_t const bits = length * 8;
+  unsigned char padding[sizeof block + 8] = { 0x80 };
+  std::size_t const used = length % sizeof block;
+  std::size_t const pad = (used < 56? 56: 120) - used;
+  for (int i = 0; i < 8; ++i) padding[pad + i] = bits >> (56 - 8 * i);
+  update(padding, pad + 8);
+
+  static char const digits[] = "0123456789abcdef";
+  std::string text;
+  for (std::uint32_t word: state)
+    for (int shift = 28; shift >= 0; shift -= 4)
+      text += digits[(word >> shift) & 0xF];
+  return text;
+}
@@ -0,0 +1,30 @@
+#ifndef IMG2BRL_SHA256_H
+#define IMG2BRL_SHA256_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// SHA-256 (FIPS 180-4) for cache keys, where an FNV-1a collision would
+// serve the result of one image for another.  Feed the input in any number
+// of pieces, then take the digest once.
+class sha256
+{
+  std::uint32_t state[8];
+  unsigned char block[64];
+  std::uint64_t length; // in bytes, so far
+
+  void compress(unsigned char const *);
+
+public:
+  sha256();
+
+  sha256 &update(void const *data, std::size_t length);
+  sha256 &update(std::string const &data)
+  { return update(data.data(), data.size()); }
+
+  // The 32 byte digest as 64 lower case hex digits
+  std::string hex_digest();
+};
+
+#endif
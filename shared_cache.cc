@@ -0,0 +1,233 @@
+#include "shared_cache.h"
+#include "hash.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace /* anonymous */ {
+
+char const magic[16] = "img2brl-shm 2";
+std::size_t const probe_window = 8;
+
+std::uint64_t
+now()
+{
+  return std::chrono::duration_cast<std::chrono::seconds>
+         (std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+std::size_t
+align(std::size_t size)
+{
+  return (size + 63) / 64 * 64;
+}
+
+}
+
+// The file starts with a header, followed by the buckets and the ring buffer.
+// All shared fields are atomics, which are address free for these sizes, so
+// they work across processes.
+struct shared_cache::header
+{
+  char magic[16];
+  std::uint64_t bucket_count;
+  std::uint64_t data_size;
+  std::atomic<std::uint64_t> end; // total bytes ever claimed in the ring
+};
+
+struct shared_cache::bucket
+{
+  std::atomic<std::uint64_t> sequence; // odd while a writer updates
+  std::atomic<std::uint64_t> key[2];
+  std::atomic<std::uint64_t> position; // of the record in the ring, plus one
+  std::atomic<std::uint64_t> stored;   // seconds since the epoch
+};
+
+// Followed by the key and then the value, so find() can compare the whole
+// key instead of trusting its hashes
+struct shared_cache::record
+{
+  std::uint64_t key[2];
+  std::uint64_t key_length, length;
+  std::uint64_t checksum;
+  std::uint64_t expires; // seconds since the epoch, 0 for never
+};
+
+shared_cache::shared_cache( std::string const &path
+                          , std::size_t data_size, std::size_t bucket_count
+                          )
+: memory{nullptr}, size{0}, head{nullptr}, buckets{nullptr}, data{nullptr}
+{
+  if (path.empty() or not data_size or not bucket_count) return;
+  int const fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd == -1) return;
+
+  // Whoever comes first sizes and initializes the file
+  flock(fd, LOCK_EX);
+  std::size_t const expected = align(sizeof(header))
+                             + align(bucket_count * sizeof(bucket))
+                             + data_size;
+  struct stat info;
+  bool const fresh = fstat(fd, &info) == 0 and info.st_size == 0;
+  if (fresh) ftruncate(fd, expected);
+  if (fstat(fd, &info) == 0 and std::size_t(info.st_size) == expected) {
+    void *mapping = mmap(nullptr, expected, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fd, 0);
+    if (mapping != MAP_FAILED) {
+      header *h = static_cast<header *>(mapping);
+      if (fresh) {
+        std::memcpy(h->magic, magic, sizeof magic);
+        h->bucket_count = bucket_count;
+        h->data_size = data_size;
+      }
+      if (std::memcmp(h->magic, magic, sizeof magic) == 0 and
+          h->bucket_count == bucket_count and h->data_size == data_size) {
+        memory = mapping;
+        size = expected;
+        head = h;
+        buckets = reinterpret_cast<bucket *>
+                  (static_cast<unsigned char *>(mapping) + align(sizeof(header)));
+        data = reinterpret_cast<unsigned char *>(buckets)
+             + align(bucket_count * sizeof(bucket));
+      } else {
+        munmap(mapping, expected);
+      }
+    }
+  }
+  flock(fd, LOCK_UN);
+  close(fd);
+}
+
+shared_cache::shared_cache(shared_cache &&other)
+: memory{other.memory}, size{other.size}
+, head{other.head}, buckets{other.buckets}, data{other.data}
+{
+  other.memory = nullptr;
+}
+
+shared_cache::~shared_cache()
+{
+  if (memory) munmap(memory, size);
+}
+
+bool
+shared_cache::find( std::string const &key, std::string &value
+                  , std::chrono::seconds max_age
+                  ) const
+{
+  if (not enabled()) return false;
+
+  std::uint64_t const k0 = fnv1a(key), k1 = fnv1a(key, k0);
+  for (std::size_t i = 0; i < probe_window; ++i) {
+    bucket const &b = buckets[(k0 + i) % head->bucket_count];
+    std::uint64_t const sequence = b.sequence.load(std::memory_order_acquire);
+    if (sequence & 1) continue;
+    if (b.key[0].load(std::memory_order_relaxed) != k0 or
+        b.key[1].load(std::memory_order_relaxed) != k1)
+      continue;
+    std::uint64_t const position = b.position.load(std::memory_order_relaxed);
+    std::uint64_t const stored = b.stored.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (b.sequence.load(std::memory_order_relaxed) != sequence or not position)
+      return false;
+    if (max_age.count() and now() - stored > std::uint64_t(max_age.count()))
+      return false;
+
+    // Copy the record out, then make sure nobody overwrote it meanwhile.
+    // Once the ring overtook the record, its place may hold any bytes, so
+    // check that before trusting the header to find the payload.
+    std::uint64_t const start = position - 1;
+    std::uint64_t const offset = start % head->data_size;
+    // Records never wrap around the end of the ring, see insert()
+    std::uint64_t const room = head->data_size - offset;
+    record entry;
+    if (room < sizeof entry) return false;
+    std::memcpy(&entry, data + offset, sizeof entry);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (head->end.load(std::memory_order_relaxed) > start + head->data_size)
+      return false;
+    if (entry.key[0] != k0 or entry.key[1] != k1 or
+        entry.key_length != key.size() or key.size() > room - sizeof entry or
+        entry.length > room - sizeof entry - key.size())
+      return false;
+    char const *stored_key = reinterpret_cast<char const *>
+                             (data + offset + sizeof entry);
+    bool const same_key = key.compare(0, key.size(), stored_key, key.size()) == 0;
+    std::string copy(stored_key + key.size(), entry.length);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (head->end.load(std::memory_order_relaxed) > start + head->data_size or
+        not same_key or fnv1a(copy) != entry.checksum)
+      return false;
+    if (entry.expires and now() >= entry.expires) return false;
+
+    value.swap(copy);
+    return true;
+  }
+  return false;
+}
+
+void
+shared_cache::insert( std::string const &key, std::string const &value
+                    , std::chrono::seconds time_to_live
+                    ) const
+{
+  if (not enabled()) return;
+
+  std::size_t const total = (sizeof(record) + key.size() + value.size() + 7)
+                          / 8 * 8;
+  if (total > head->data_size / 4) return;
+
+  // Claim space in the ring, skipping its tail if the record would not fit
+  std::uint64_t end = head->end.load(std::memory_order_relaxed), start;
+  do {
+    std::uint64_t const offset = end % head->data_size;
+    start = offset + total > head->data_size ? end + head->data_size - offset
+                                             : end;
+  } while (not head->end.compare_exchange_weak(end, start + total,
+                                               std::memory_order_acq_rel));
+
+  std::uint64_t const k0 = fnv1a(key), k1 = fnv1a(key, k0);
+  record const entry{ { k0, k1 }, key.size(), value.size(), fnv1a(value)
+                     , time_to_live.count()? now() + time_to_live.count(): 0
+                     };
+  unsigned char *destination = data + start % head->data_size;
+  std::memcpy(destination, &entry, sizeof entry);
+  std::memcpy(destination + sizeof entry, key.data(), key.size());
+  std::memcpy(destination + sizeof entry + key.size(), value.data(), value.size());
+
+  // Prefer the bucket already holding this key, then an empty one, then the
+  // oldest one in the probe window.
+  bucket *target = nullptr;
+  for (std::size_t i = 0; i < probe_window; ++i) {
+    bucket &b = buckets[(k0 + i) % head->bucket_count];
+    if (b.key[0].load(std::memory_order_relaxed) == k0 and
+        b.key[1].load(std::memory_order_relaxed) == k1) {
+      target = &b;
+      break;
+    }
+    if (not target or
+        (target->position.load(std::memory_order_relaxed) and
+         (not b.position.load(std::memory_order_relaxed) or
+          b.stored.load(std::memory_order_relaxed) <
+          target->stored.load(std::memory_order_relaxed))))
+      target = &b;
+  }
+
+  std::uint64_t sequence = target->sequence.load(std::memory_order_relaxed);
+  if (sequence & 1 or
+      not target->sequence.compare_exchange_strong(sequence, sequence + 1,
+                                                   std::memory_order_acquire))
+    return; // somebody else is writing this bucket right now
+  target->key[0].store(k0, std::memory_order_relaxed);
+  target->key[1].store(k1, std::memory_order_relaxed);
+  target->position.store(start + 1, std::memory_order_relaxed);
+  target->stored.store(now(), std::memory_order_relaxed);
+  target->sequence.store(sequence + 2, std::memory_order_release);
+}
@@ -0,0 +1,56 @@
+#ifndef IMG2BRL_SHARED_CACHE_H
+#define IMG2BRL_SHARED_CACHE_H
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+
+// A memory mapped, file backed cache segment which every img2brl process
+// maps at startup.  It consists of a fixed size hash table and a ring
+// buffer the values are appended to, and works without locks:
+//
+// - Space in the ring buffer is claimed with an atomic add.  When it wraps
+//   around, new values overwrite the oldest ones.
+// - Every bucket is a seqlock.  Writers make the sequence odd while they
+//   update the bucket, readers retry or give up when it changed under them.
+// - Values carry their key and a checksum.  A reader copies the value out
+//   and only trusts it if the ring buffer did not overtake it meanwhile, the
+//   key is the one it asked for and the checksum matches.
+//
+// Buckets are probed linearly over a short window; when all of them are
+// taken the oldest entry in the window is replaced.
+class shared_cache
+{
+  struct header;
+  struct bucket;
+  struct record;
+
+  void *memory;
+  std::size_t size;
+  header *head;
+  bucket *buckets;
+  unsigned char *data;
+
+public:
+  // An empty path, or a file which can not be mapped, disables the cache.
+  shared_cache( std::string const &path
+              , std::size_t data_size, std::size_t bucket_count
+              );
+  shared_cache(shared_cache &&);
+  ~shared_cache();
+  shared_cache(shared_cache const &) = delete;
+  shared_cache &operator=(shared_cache const &) = delete;
+
+  bool enabled() const { return memory != nullptr; }
+
+  // Values older than max_age are ignored, a max_age of zero accepts any.
+  bool find( std::string const &key, std::string &value
+           , std::chrono::seconds max_age = std::chrono::seconds::zero()
+           ) const;
+  // find() ignores the value after time_to_live, unless that is zero.
+  void insert( std::string const &key, std::string const &value
+             , std::chrono::seconds time_to_live = std::chrono::seconds::zero()
+             ) const;
+};
+
+#endif
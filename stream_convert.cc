@@ -0,0 +1,284 @@
+#include "stream_convert.h"
+#include "convert.h"
+#include "gray.h"
+#include "pack.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+#include <Magick++/Exception.h>
+
+namespace /* anonymous */ {
+
+unsigned char
+intensity(MagickCore::PixelPacket const &pixel, bool matte)
+{
+  double value = 0.298839 * pixel.red + 0.586811 * pixel.green
+               + 0.114350 * pixel.blue;
+  if (matte) {
+    // Composite onto white
+    double const transparency = double(pixel.opacity) / MagickCore::QuantumRange;
+    value += (MagickCore::QuantumRange - value) * transparency;
+  }
+  return MagickCore::ScaleQuantumToChar(MagickCore::Quantum(value + 0.5));
+}
+
+// Where ReadStream delivers rows to
+class row_sink
+{
+public:
+  virtual ~row_sink() {}
+  virtual bool started() const = 0;
+  virtual void start(MagickCore::Image const *) = 0;
+  virtual std::size_t width() const = 0;
+  virtual void add(MagickCore::PixelPacket const *) = 0;
+};
+
+std::string
+description_of(MagickCore::Image const *image)
+{
+  std::unique_ptr<MagickCore::ExceptionInfo,
+                  MagickCore::ExceptionInfo *(*)(MagickCore::ExceptionInfo *)>
+    exception(MagickCore::AcquireExceptionInfo(), MagickCore::DestroyExceptionInfo);
+  if (MagickCore::MagickInfo const *magick =
+      MagickCore::GetMagickInfo(image->magick, exception.get()))
+    return MagickCore::GetMagickDescription(magick);
+  return std::string();
+}
+
+// Collects pixel rows into bands of four and writes every complete band as
+// a line of braille.
+class band_writer: public row_sink
+{
+  bool negate;
+  std::ostream &out;
+  std::function<void(streamed_image const &)> const &begin;
+  pack_kernel const &kernel;
+  streamed_image info;
+  bool matte;
+  std::size_t rows; // in the current band
+  std::size_t received;
+  std::vector<unsigned char> band, cells;
+  std::string line;
+
+  void write_band()
+  {
+    unsigned char const *row[4];
+    for (std::size_t y = 0; y < 4; ++y) {
+      if (y >= rows) std::fill_n(&band[y * info.width], info.width, 0xFF);
+      row[y] = &band[y * info.width];
+    }
+    kernel.pack(row, info.width, 0x80, cells.data());
+    char *end = kernel.encode(cells.data(), cells.size(), &line[0]);
+    *end++ = '\n';
+    out.write(line.data(), end - line.data());
+    out.flush();
+    rows = 0;
+  }
+
+public:
+  band_writer( bool negate, std::ostream &out
+             , std::function<void(streamed_image const &)> const &begin
+             )
+  : negate{negate}, out(out), begin(begin), kernel(best_pack_kernel())
+  , info{std::string(), 0, 0}, matte{false}, rows{0}, received{0}
+  {}
+
+  bool started() const override { return not band.empty(); }
+  std::size_t width() const override { return info.width; }
+  streamed_image const &image() const { return info; }
+
+  void start(MagickCore::Image const *image) override
+  {
+    info.format = description_of(image);
+    info.width = image->columns;
+    info.height = image->rows;
+    matte = image->matte;
+    band.resize(4 * info.width);
+    cells.resize((info.width + 1) / 2);
+    line.resize(cells.size() * 3 + 1);
+    begin(info);
+  }
+
+  void add(MagickCore::PixelPacket const *pixels) override
+  {
+    if (received++ >= info.height) return; // further frames
+    unsigned char *row = &band[rows * info.width];
+    for (std::size_t x = 0; x < info.width; ++x) {
+      unsigned char const value = intensity(pixels[x], matte);
+      row[x] = negate? 0xFF - value: value;
+    }
+    if (++rows == 4) write_band();
+  }
+
+  void finish()
+  {
+    if (rows) write_band();
+  }
+};
+
+// Collects the rows of the first frame into an 8 bit grey image
+class gray_collector: public row_sink
+{
+  gray_image &pixels;
+  bool begun, matte;
+  std::size_t rows;
+
+public:
+  explicit gray_collector(gray_image &pixels)
+  : pixels(pixels), begun{false}, matte{false}, rows{0}
+  {}
+
+  bool started() const override { return begun; }
+  std::size_t width() const override { return pixels.width; }
+
+  void start(MagickCore::Image const *image) override
+  {
+    pixels = gray_image(image->columns, image->rows);
+    begun = true;
+    matte = image->matte;
+  }
+
+  void add(MagickCore::PixelPacket const *row) override
+  {
+    if (rows >= pixels.height) return; // further frames
+    unsigned char *out = pixels.row(rows++);
+    for (std::size_t x = 0; x < pixels.width; ++x)
+      out[x] = intensity(row[x], matte);
+  }
+};
+
+// ReadStream's handler gets no user data
+thread_local row_sink *current_sink = nullptr;
+
+std::size_t
+stream_row(MagickCore::Image const *image, void const *pixels, std::size_t columns)
+{
+  if (not current_sink->started()) current_sink->start(image);
+  if (columns == current_sink->width())
+    current_sink->add(static_cast<MagickCore::PixelPacket const *>(pixels));
+  return columns;
+}
+
+typedef std::unique_ptr<MagickCore::ExceptionInfo,
+                        MagickCore::ExceptionInfo *(*)(MagickCore::ExceptionInfo *)>
+        exception_pointer;
+typedef std::unique_ptr<MagickCore::ImageInfo,
+                        MagickCore::ImageInfo *(*)(MagickCore::ImageInfo *)>
+        image_info_pointer;
+
+// ReadStream does not tell which row it delivers, so only coders writing
+// rows from top to bottom can be streamed.  Bottom-up BMP or interlaced GIF
+// would come out upside down or scrambled.
+bool
+top_down(char const *magick)
+{
+  for (char const *format: { "PNG", "JPEG", "PAM", "PBM", "PGM", "PNM", "PPM" })
+    if (std::strcmp(magick, format) == 0) return true;
+  return false;
+}
+
+// Feed the rows of data to sink as they are decoded.  Returns the image
+// without pixels, for its properties, or null if the format can not be
+// streamed from memory in order.
+MagickCore::Image *
+stream( std::string const &data, image_info_pointer const &info
+      , row_sink &sink
+      )
+{
+  exception_pointer exception(MagickCore::AcquireExceptionInfo(),
+                              MagickCore::DestroyExceptionInfo);
+  MagickCore::SetImageInfoBlob(info.get(), data.data(), data.size());
+  MagickCore::SetImageInfo(info.get(), 0, exception.get());
+  MagickCore::MagickInfo const *magick =
+    MagickCore::GetMagickInfo(info->magick, exception.get());
+  if (not magick or not MagickCore::GetMagickBlobSupport(magick) or
+      not top_down(info->magick))
+    return nullptr;
+
+  current_sink = &sink;
+  MagickCore::Image *image = MagickCore::ReadStream(info.get(), stream_row,
+                                                    exception.get());
+  current_sink = nullptr;
+  if (exception->severity >= MagickCore::ErrorException) {
+    if (image) MagickCore::DestroyImageList(image);
+    Magick::throwException(exception.get());
+  }
+  if (not sink.started()) {
+    if (image) MagickCore::DestroyImageList(image);
+    throw Magick::ErrorMissingDelegate("No image was loaded");
+  }
+  return image;
+}
+
+}
+
+streamed_image
+stream_convert( std::string const &data, bool negate
+              , std::ostream &out
+              , std::function<void(streamed_image const &)> const &begin
+              )
+{
+  band_writer writer(negate, out, begin);
+  image_info_pointer info(MagickCore::AcquireImageInfo(),
+                          MagickCore::DestroyImageInfo);
+  info->scene = 0;
+  info->number_scenes = 1;
+  if (MagickCore::Image *streamed = stream(data, info, writer)) {
+    MagickCore::DestroyImageList(streamed);
+  } else {
+    Magick::Image const image = read_image(data);
+    writer.start(image.constImage());
+    for (std::size_t y = 0; y < image.rows(); ++y)
+      writer.add(image.getConstPixels(0, y, image.columns(), 1));
+  }
+  writer.finish();
+  return writer.image();
+}
+
+gray_image
+read_gray( std::string const &data, std::size_t width_hint
+         , conversion &description
+         )
+{
+  gray_image pixels;
+  gray_collector collector(pixels);
+  image_info_pointer info(MagickCore::AcquireImageInfo(),
+                          MagickCore::DestroyImageInfo);
+  info->scene = 0;
+  info->number_scenes = 1;
+  if (width_hint) {
+    std::string const size = std::to_string(width_hint) + 'x'
+                           + std::to_string(width_hint);
+    MagickCore::SetImageOption(info.get(), "jpeg:size", size.c_str());
+  }
+
+  if (MagickCore::Image *streamed = stream(data, info, collector)) {
+    std::unique_ptr<MagickCore::Image, MagickCore::Image *(*)(MagickCore::Image *)>
+      owner(streamed, MagickCore::DestroyImageList);
+    description.format = description_of(streamed);
+    if (char const *label = MagickCore::GetImageProperty(streamed, "label"))
+      description.label = label;
+    if (char const *comment = MagickCore::GetImageProperty(streamed, "comment"))
+      description.comment = comment;
+    // Before libjpeg scaled it down
+    description.source_width = streamed->magick_columns? streamed->magick_columns
+                                                       : streamed->columns;
+    description.source_height = streamed->magick_rows? streamed->magick_rows
+                                                      : streamed->rows;
+  } else {
+    Magick::Image const image = read_image(data, width_hint);
+    collector.start(image.constImage());
+    for (std::size_t y = 0; y < image.rows(); ++y)
+      collector.add(image.getConstPixels(0, y, image.columns(), 1));
+    description.format = image.format();
+    description.label = image.label();
+    description.comment = image.comment();
+    description.source_width = image.baseColumns();
+    description.source_height = image.baseRows();
+  }
+  return pixels;
+}
@@ -0,0 +1,43 @@
+#ifndef IMG2BRL_STREAM_CONVERT_H
+#define IMG2BRL_STREAM_CONVERT_H
+
+#include <cstddef>
+#include <functional>
+#include <iosfwd>
+#include <string>
+
+#include "conversion.h"
+#include "gray.h"
+
+// What is known about an image once its header was read
+struct streamed_image
+{
+  std::string format;
+  std::size_t width, height; // in dots
+};
+
+// Convert data to braille while it is being decoded.  Pixel rows are
+// collected into bands of four, each band is packed and written to out as
+// one line of braille right away, so only a few rows are ever held in memory.
+// begin is called before the first line is written.
+//
+// Unlike ubrl, which reduces the image to two colours with dithering first,
+// pixels are thresholded at half intensity, transparent areas count as
+// white.  Only PNG, JPEG and the PNM family are streamed, as their coders
+// deliver rows from top to bottom.  Other formats are decoded as a whole and
+// then written the same way.
+streamed_image stream_convert( std::string const &data, bool negate
+                             , std::ostream &out
+                             , std::function<void(streamed_image const &)> const &begin
+                             );
+
+// The first frame of data decoded row by row straight into 8 bit grey, with
+// transparent areas composed onto white, so ImageMagick never holds the
+// whole image at 16 bits per channel.  width_hint is passed on as for
+// read_image().  Fills the format, label, comment and source size of
+// description.
+gray_image read_gray( std::string const &data, std::size_t width_hint
+                    , conversion &description
+                    );
+
+#endif
@@ -0,0 +1,50 @@
+// Writes the image formats ImageMagick can read as C++ initializers, one
+// { "NAME", "Description" }, per line.  The build includes them in
+// img2brl.cc, so show=formats does not load every coder on each request.
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+#include <Magick++/Functions.h>
+#include <Magick++/Include.h>
+
+static std::string
+quoted(char const *text)
+{
+  std::string result(1, '"');
+  for (; *text; ++text) {
+    unsigned char const c = *text;
+    if (c == '"' or c == '\\') {
+      result += '\\';
+      result += c;
+    } else if (c < 0x20 or c >= 0x7F) {
+      char escape[8];
+      std::snprintf(escape, sizeof escape, "\\%03o", c);
+      result += escape;
+    } else {
+      result += c;
+    }
+  }
+  return result + '"';
+}
+
+int main(int, char *argv[])
+{
+  Magick::InitializeMagick(argv[0]);
+  std::size_t formats;
+  MagickCore::ExceptionInfo *exception = MagickCore::AcquireExceptionInfo();
+  if (MagickCore::MagickInfo const **info = MagickCore::GetMagickInfoList("*", &formats, exception)) {
+    for (std::size_t i = 0; i < formats; ++i) {
+      if (info[i]->stealth == MagickCore::MagickFalse and
+          info[i]->decoder and info[i]->magick) {
+        std::cout << "{ " << quoted(info[i]->name) << ", "
+                  << quoted(info[i]->description? info[i]->description: "")
+                  << " }," << std::endl;
+      }
+    }
+    MagickCore::RelinquishMagickMemory(info);
+  }
+  MagickCore::DestroyExceptionInfo(exception);
+  return 0;
+}
@@ -1,9 +1,42 @@
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 #define BOOST_TEST_MODULE img2brl_test
 #include <boost/test/included/unit_test.hpp>
 
+#include <Magick++/Blob.h>
+#include <Magick++/Image.h>
+#include <Magick++/STL.h>
+
 #include "accept_language.h"
+#include "cells.h"
+#include "convert.h"
+#include "dither.h"
+#include "fetch.h"
+#include "gray.h"
+#include "hash.h"
+#include "pack.h"
+#include "pyramid.h"
+#include "response.h"
+#include "result_cache.h"
+#include "sha256.h"
+#include "shared_cache.h"
+#include "stream_convert.h"
+#include "timings.h"
+#include "ubrl.h"
+#include "work_stealing.h"
 
 BOOST_AUTO_TEST_CASE(accept_language_1) {
   BOOST_REQUIRE(accept_language("").languages().empty());
@@ -80,3 +113,997 @@ BOOST_AUTO_TEST_CASE(accept_language_5) {
   BOOST_CHECK_CLOSE(*accept.languages()[0].q, 1.0, epsilon);
 }
 
+
+// What ImageMagick's "ubrl" coder writes after the Width:/Height: header
+static std::string
+ubrl_coder(Magick::Image const &image)
+{
+  Magick::Blob blob;
+  Magick::Image(image).write(&blob, "ubrl");
+  std::string const text(static_cast<char const *>(blob.data()), blob.length());
+  std::string::size_type const body = text.find("\n\n");
+  BOOST_REQUIRE(body != std::string::npos);
+  return text.substr(body + 2);
+}
+
+static void
+check_ubrl(Magick::Image const &image)
+{
+  ubrl tactile(image);
+  BOOST_CHECK_EQUAL(tactile.width(), image.columns());
+  BOOST_CHECK_EQUAL(tactile.height(), image.rows());
+  BOOST_CHECK(tactile.string() == ubrl_coder(image));
+}
+
+BOOST_AUTO_TEST_CASE(ubrl_1) {
+  for (char const *name: { "logo:", "rose:", "granite:", "netscape:", "wizard:" })
+    check_ubrl(Magick::Image(name));
+}
+
+BOOST_AUTO_TEST_CASE(ubrl_2) {
+  // Sizes which do not fill the last cell row and column
+  for (std::size_t width: { 1, 2, 3, 17 })
+    for (std::size_t height: { 1, 2, 3, 4, 5, 23 }) {
+      Magick::Image image;
+      image.size(Magick::Geometry(width, height));
+      image.read("gradient:black-white");
+      check_ubrl(image);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(ubrl_3) {
+  // Single coloured images exercise the one entry colormap case
+  check_ubrl(Magick::Image(Magick::Geometry(9, 9), "white"));
+  check_ubrl(Magick::Image(Magick::Geometry(9, 9), "black"));
+  check_ubrl(Magick::Image(Magick::Geometry(9, 9), "gray70"));
+}
+
+static std::string
+encode(Magick::Image image, std::string const &format)
+{
+  Magick::Blob blob;
+  image.write(&blob, format);
+  return std::string(static_cast<char const *>(blob.data()), blob.length());
+}
+
+BOOST_AUTO_TEST_CASE(convert_1) {
+  // Shrink-on-load must still end up at exactly the requested width
+  Magick::Image photo;
+  photo.size(Magick::Geometry(1600, 1200));
+  photo.read("plasma:");
+  conversion_options options;
+  options.columns = 40;
+  for (char const *format: { "JPEG", "PNG" }) {
+    Magick::Image const image = prepare_image(encode(photo, format), options);
+    BOOST_CHECK_EQUAL(image.columns(), 80);
+    BOOST_CHECK_EQUAL(image.rows(), 60);
+    BOOST_CHECK_EQUAL(image.baseColumns(), 1600);
+  }
+
+  // Small images are never enlarged
+  Magick::Image const logo = prepare_image(encode(Magick::Image("rose:"), "PNG"),
+                                           options);
+  BOOST_CHECK_EQUAL(logo.columns(), 70);
+  conversion const result = convert(encode(Magick::Image("rose:"), "PNG"), options);
+  BOOST_CHECK_EQUAL(result.format, "Portable Network Graphics");
+  BOOST_CHECK_EQUAL(result.braille.width(), 70);
+}
+
+BOOST_AUTO_TEST_CASE(convert_2) {
+  frame_range range;
+  BOOST_CHECK(parse_frame_range("3", range) and range.first == 3 and range.count == 1);
+  BOOST_CHECK(parse_frame_range("2-5", range) and range.first == 2 and range.count == 4);
+  BOOST_CHECK(parse_frame_range("1-", range) and range.first == 1 and range.count == 0);
+  for (char const *invalid: { "", "-2", "5-2", "1-x", "2 ", "18446744073709551616"
+                            , "0-18446744073709551615", "1-99999999999999999999" })
+    BOOST_CHECK(not parse_frame_range(invalid, range));
+
+  // Three frames of growing width, the later ones only drawing what changed
+  std::vector<Magick::Image> animation;
+  for (std::size_t i = 0; i < 3; ++i) {
+    Magick::Image frame(Magick::Geometry(8 * (i + 1), 8), Magick::Color("black"));
+    if (i) frame.page(Magick::Geometry(8, 8, 8 * i, 0));
+    animation.push_back(frame);
+  }
+  animation.front().page(Magick::Geometry(24, 8));
+  Magick::Blob blob;
+  Magick::writeImages(animation.begin(), animation.end(), &blob);
+  std::string const gif(static_cast<char const *>(blob.data()), blob.length());
+  range.first = 1;
+  range.count = 0;
+  std::vector<Magick::Image> const frames = read_frames(gif, range);
+  BOOST_REQUIRE_EQUAL(frames.size(), 2);
+  BOOST_CHECK_EQUAL(frames[0].columns(), 24);
+
+  std::vector<conversion> const results = convert_frames(gif, conversion_options(),
+                                                         range);
+  BOOST_REQUIRE_EQUAL(results.size(), 2);
+  BOOST_CHECK_EQUAL(results[1].braille.width(), 24);
+}
+
+BOOST_AUTO_TEST_CASE(convert_3) {
+  // The fused pipeline against ImageMagick doing one operation after the
+  // other, thresholded so resampling differences do not get amplified by
+  // dithering
+  Magick::Image photo;
+  photo.size(Magick::Geometry(640, 480));
+  photo.read("plasma:");
+  photo.border(Magick::Geometry(20, 20));
+  std::string const png = encode(photo, "PNG");
+  for (int variant = 0; variant < 4; ++variant) {
+    conversion_options options;
+    options.dither = dither_mode::otsu;
+    options.trim = variant & 1;
+    options.normalize = variant & 2;
+    options.negate = variant == 3;
+    options.columns = variant? 40: 0;
+    braille_cells const reference =
+      ubrl(prepare_image(png, options), options.dither).cells();
+    braille_cells const fused = convert(png, options).braille;
+    BOOST_REQUIRE_EQUAL(fused.width(), reference.width());
+    BOOST_REQUIRE_EQUAL(fused.height(), reference.height());
+    std::size_t differences = 0;
+    for (std::size_t i = 0; i < fused.bytes().size(); ++i) {
+      unsigned char cell = fused.bytes()[i] ^ reference.bytes()[i];
+      for (; cell; cell &= cell - 1) ++differences;
+    }
+    BOOST_CHECK_MESSAGE(differences <= fused.width() * fused.height() / 10,
+                        options.key() << ": " << differences << " dots differ");
+  }
+}
+
+BOOST_AUTO_TEST_CASE(convert_4) {
+  // Admission only pings, so the limits hold before anything is decoded
+  std::string const png = encode(Magick::Image("rose:"), "PNG");
+  image_header const header = ping_image(png);
+  BOOST_CHECK_EQUAL(header.format, "PNG");
+  BOOST_CHECK_EQUAL(header.width, 70);
+  BOOST_CHECK_EQUAL(header.height, 46);
+  BOOST_CHECK_EQUAL(header.frames, 1);
+  decode_limits limits;
+  BOOST_CHECK_NO_THROW(admit_image(png, limits));
+  limits.max_side = 69;
+  BOOST_CHECK_THROW(admit_image(png, limits), image_too_large);
+  limits = decode_limits();
+  limits.max_area = 70 * 46 - 1;
+  BOOST_CHECK_THROW(admit_image(png, limits), image_too_large);
+
+  std::vector<Magick::Image> animation(5, Magick::Image(Magick::Geometry(8, 8),
+                                                        Magick::Color("black")));
+  Magick::Blob blob;
+  Magick::writeImages(animation.begin(), animation.end(), &blob);
+  std::string const gif(static_cast<char const *>(blob.data()), blob.length());
+  limits = decode_limits();
+  limits.max_frames = 3;
+  frame_range range;
+  range.first = 1;
+  range.count = 2;
+  BOOST_CHECK_NO_THROW(admit_image(gif, limits, range));
+  // Frames of an animation are decoded from the first one on
+  range.first = 3;
+  range.count = 1;
+  BOOST_CHECK_THROW(admit_image(gif, limits, range), image_too_large);
+  range.first = 0;
+  range.count = 0;
+  BOOST_CHECK_THROW(admit_image(gif, limits, range), image_too_large);
+  // first + count must not wrap around to a small number
+  BOOST_REQUIRE(parse_frame_range("1-18446744073709551615", range));
+  BOOST_CHECK_THROW(admit_image(gif, limits, range), image_too_large);
+  range.first = 0;
+  range.count = 0;
+  limits.max_frames = 5;
+  BOOST_CHECK_EQUAL(admit_image(gif, limits, range).frames, 5);
+  BOOST_CHECK_EQUAL(range.count, 5);
+}
+
+BOOST_AUTO_TEST_CASE(stream_convert_1) {
+  // On pure black and white, thresholding and ubrl's dithering agree
+  Magick::Image image("rose:");
+  image.threshold(MagickCore::QuantumRange / 2);
+  std::string const png = encode(image, "PNG");
+  for (bool negate: { false, true }) {
+    Magick::Image expected(image);
+    if (negate) expected.negate();
+    std::ostringstream out;
+    std::size_t begun = 0;
+    streamed_image const info =
+      stream_convert(png, negate, out, [&](streamed_image const &begin) {
+        BOOST_CHECK(out.str().empty());
+        BOOST_CHECK_EQUAL(begin.width, 70);
+        ++begun;
+      });
+    BOOST_CHECK_EQUAL(begun, 1);
+    BOOST_CHECK_EQUAL(info.height, 46);
+    BOOST_CHECK_EQUAL(info.format, "Portable Network Graphics");
+    BOOST_CHECK(out.str() == ubrl(expected).string());
+  }
+
+  // Only the first frame, even if the rest have the same width
+  std::vector<Magick::Image> frames{ image, image };
+  frames.back().negate();
+  for (Magick::Image &frame: frames) frame.magick("PPM");
+  Magick::Blob blob;
+  Magick::writeImages(frames.begin(), frames.end(), &blob);
+  std::string const ppm(static_cast<char const *>(blob.data()), blob.length());
+  std::ostringstream first, both;
+  stream_convert(encode(image, "PPM"), false, first, [](streamed_image const &) {});
+  stream_convert(ppm, false, both, [](streamed_image const &) {});
+  BOOST_CHECK(not first.str().empty());
+  BOOST_CHECK(both.str() == first.str());
+}
+
+BOOST_AUTO_TEST_CASE(stream_convert_2) {
+  // Grey decoded row by row matches ImageMagick's intensity of the whole
+  // image, transparency counts as white
+  Magick::Image image("rose:");
+  image.label("rose");
+  std::string const png = encode(image, "PNG");
+  std::vector<unsigned char> expected(image.columns() * image.rows());
+  image.write(0, 0, image.columns(), image.rows(), "I", Magick::CharPixel,
+              expected.data());
+  conversion about;
+  gray_image const gray = read_gray(png, 0, about);
+  BOOST_REQUIRE_EQUAL(gray.width, 70);
+  BOOST_REQUIRE_EQUAL(gray.height, 46);
+  for (std::size_t i = 0; i < expected.size(); ++i)
+    BOOST_REQUIRE_LE(std::abs(gray.pixels[i] - expected[i]), 1);
+  BOOST_CHECK_EQUAL(about.format, "Portable Network Graphics");
+  BOOST_CHECK_EQUAL(about.label, "rose");
+  BOOST_CHECK_EQUAL(about.source_width, 70);
+  BOOST_CHECK_EQUAL(about.source_height, 46);
+
+  // Coders which do not deliver rows from top to bottom are not streamed
+  Magick::Image interlaced(image);
+  interlaced.interlaceType(Magick::LineInterlace);
+  for (std::string const &data: { encode(image, "BMP"), encode(interlaced, "GIF") }) {
+    Magick::Image decoded(Magick::Blob(data.data(), data.size()));
+    decoded.write(0, 0, decoded.columns(), decoded.rows(), "I", Magick::CharPixel,
+                  expected.data());
+    gray_image const rows = read_gray(data, 0, about);
+    BOOST_REQUIRE_EQUAL(rows.pixels.size(), expected.size());
+    for (std::size_t i = 0; i < expected.size(); ++i)
+      BOOST_REQUIRE_LE(std::abs(rows.pixels[i] - expected[i]), 1);
+  }
+
+  Magick::Image clear;
+  clear.size(Magick::Geometry(8, 4));
+  clear.read("xc:none");
+  gray_image const white = read_gray(encode(clear, "PNG"), 0, about);
+  BOOST_REQUIRE_EQUAL(white.pixels.size(), 32);
+  for (unsigned char pixel: white.pixels) BOOST_CHECK_EQUAL(pixel, 255);
+}
+
+BOOST_AUTO_TEST_CASE(pack_1) {
+  // Every kernel must produce bit-exactly the cells of the scalar one
+  std::mt19937 random;
+  std::uniform_int_distribution<int> byte(0, 255);
+  for (std::size_t width: { 0, 1, 2, 31, 32, 33, 63, 64, 65, 127, 1000, 10001 }) {
+    std::vector<unsigned char> pixels(4 * width);
+    for (unsigned char &pixel: pixels) pixel = byte(random);
+    unsigned char const *const row[4] = {
+      pixels.data(), pixels.data() + width,
+      pixels.data() + 2 * width, pixels.data() + 3 * width
+    };
+    for (unsigned threshold: { 0, 1, 128, 255 }) {
+      std::vector<unsigned char> expected((width + 1) / 2);
+      pack_kernels().front().pack(row, width, threshold, expected.data());
+      for (pack_kernel const &kernel: pack_kernels()) {
+        std::vector<unsigned char> cells(expected.size(), 0x55);
+        kernel.pack(row, width, threshold, cells.data());
+        BOOST_CHECK_MESSAGE(cells == expected, kernel.name << " width " << width
+                                               << " threshold " << threshold);
+      }
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(pack_2) {
+  std::vector<unsigned char> cells(256 + 17);
+  for (std::size_t i = 0; i < cells.size(); ++i) cells[i] = i;
+  std::string expected(3 * cells.size(), '\0');
+  pack_kernels().front().encode(cells.data(), cells.size(), &expected[0]);
+  BOOST_CHECK_EQUAL(expected.substr(0, 3), "\u2800");
+  BOOST_CHECK_EQUAL(expected.substr(3 * 255, 3), "\u28FF");
+  for (pack_kernel const &kernel: pack_kernels()) {
+    std::string utf8(expected.size(), '\0');
+    char *end = kernel.encode(cells.data(), cells.size(), &utf8[0]);
+    BOOST_CHECK(end == &utf8[0] + utf8.size());
+    BOOST_CHECK_MESSAGE(utf8 == expected, kernel.name);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(cells_1) {
+  braille_cells cells(5, 6);
+  BOOST_REQUIRE_EQUAL(cells.columns(), 3);
+  BOOST_REQUIRE_EQUAL(cells.rows(), 2);
+  unsigned char const bytes[] = { 0x00, 0x01, 0xFF, 0x47, 0x80, 0x3F };
+  std::copy(bytes, bytes + 6, cells.row(0));
+  BOOST_CHECK(cells.row(1) == cells.row(0) + 3);
+  std::string const utf8 = "\u2800\u2801\u28FF\n\u2847\u2880\u283F\n";
+  BOOST_CHECK_EQUAL(cells.utf8(), utf8);
+  std::ostringstream text, binary;
+  write_utf8(text, cells);
+  BOOST_CHECK_EQUAL(text.str(), utf8);
+  write_binary(binary, cells);
+  BOOST_CHECK_EQUAL(binary.str(), std::string(bytes, bytes + 6));
+
+  std::stringstream stream;
+  serialize(stream, cells);
+  braille_cells copy;
+  BOOST_REQUIRE(deserialize(stream, copy));
+  BOOST_CHECK_EQUAL(copy.width(), 5);
+  BOOST_CHECK_EQUAL(copy.height(), 6);
+  BOOST_CHECK(copy.bytes() == cells.bytes());
+}
+
+BOOST_AUTO_TEST_CASE(cells_2) {
+  braille_cells before(40, 8), after(40, 8);
+  after.row(0)[1] = 0xFF;
+  after.row(0)[4] = 0x01; // close enough to join the run before
+  after.row(0)[15] = 0x02;
+  after.row(1)[19] = 0x03;
+  std::vector<cell_run> runs;
+  BOOST_REQUIRE(diff_cells(before, after, runs));
+  BOOST_REQUIRE_EQUAL(runs.size(), 3);
+  BOOST_CHECK(runs[0].row == 0 and runs[0].column == 1 and runs[0].count == 4);
+  BOOST_CHECK(runs[1].row == 0 and runs[1].column == 15 and runs[1].count == 1);
+  BOOST_CHECK(runs[2].row == 1 and runs[2].column == 19 and runs[2].count == 1);
+  BOOST_CHECK(not diff_cells(before, braille_cells(38, 8), runs));
+  BOOST_CHECK_EQUAL(runs.size(), 3);
+
+  std::vector<conversion> frames(3);
+  frames[0].braille = before;
+  frames[1].braille = after;
+  frames[2].braille = braille_cells(2, 4);
+  std::ostringstream json;
+  {
+    response_writer writer(json);
+    write_json_frames(writer, frames, 7, true);
+    writer.flush();
+  }
+  BOOST_CHECK_EQUAL(json.str().find("[{\"frame\":7,\"width\":40,\"height\":8,\"braille\":"),
+                    0);
+  BOOST_CHECK(json.str().find("{\"frame\":8,\"width\":40,\"height\":8,\"changes\":"
+                              "[[0,1,\"\u28FF\u2800\u2800\u2801\"],[0,15,\"\u2802\"],"
+                              "[1,19,\"\u2803\"]]}") != std::string::npos);
+  BOOST_CHECK(json.str().find("{\"frame\":9,\"width\":2,\"height\":4,"
+                              "\"braille\":\"\u2800\\n\"}]") != std::string::npos);
+}
+
+static std::size_t
+raised_dots(braille_cells const &cells)
+{
+  std::size_t dots = 0;
+  for (unsigned char cell: cells.bytes())
+    for (; cell; cell &= cell - 1) ++dots;
+  return dots;
+}
+
+BOOST_AUTO_TEST_CASE(dither_1) {
+  dither_mode mode;
+  BOOST_CHECK(parse_dither_mode("floyd-steinberg", mode) and
+              mode == dither_mode::floyd_steinberg);
+  BOOST_CHECK(not parse_dither_mode("atkinson", mode));
+
+  // Two clusters of grey, the threshold has to go between them
+  std::vector<unsigned char> pixels(64 * 64, 40);
+  std::fill(pixels.begin() + pixels.size() / 3, pixels.end(), 200);
+  unsigned char const threshold = otsu_threshold(pixels.data(), pixels.size());
+  BOOST_CHECK(threshold >= 40 and threshold < 200);
+  braille_cells cells;
+  dither(pixels.data(), 64, 64, dither_mode::otsu, cells);
+  BOOST_CHECK_EQUAL(raised_dots(cells), pixels.size() / 3);
+
+  // Ordered dithering must follow the matrix exactly, vectorized or not
+  std::size_t const width = 37, height = 9;
+  std::mt19937 random;
+  std::uniform_int_distribution<int> byte(0, 255);
+  std::vector<unsigned char> noise(width * height), expected(width * height);
+  unsigned char const bayer[4][4] = {
+    { 0, 8, 2, 10 }, { 12, 4, 14, 6 }, { 3, 11, 1, 9 }, { 15, 7, 13, 5 }
+  };
+  for (std::size_t y = 0; y < height; ++y)
+    for (std::size_t x = 0; x < width; ++x) {
+      noise[y * width + x] = byte(random);
+      expected[y * width + x] =
+        noise[y * width + x] < bayer[y % 4][x % 4] * 16 + 8? 0: 255;
+    }
+  braille_cells ordered, reference;
+  dither(noise.data(), width, height, dither_mode::bayer, ordered);
+  dither(expected.data(), width, height, dither_mode::bilevel, reference);
+  BOOST_CHECK(ordered.bytes() == reference.bytes());
+
+  // Both dithers keep the average darkness of a flat grey
+  for (dither_mode flat: { dither_mode::bayer, dither_mode::floyd_steinberg }) {
+    for (unsigned grey: { 0, 64, 191, 255 }) {
+      std::vector<unsigned char> const plain(64 * 64, grey);
+      dither(plain.data(), 64, 64, flat, cells);
+      double const expected_dots = plain.size() * (255 - grey) / 255.0;
+      BOOST_CHECK_MESSAGE(std::abs(raised_dots(cells) - expected_dots) <= plain.size() * 0.04,
+                          dither_name(flat) << " grey " << grey << ": "
+                          << raised_dots(cells) << " dots");
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(gray_1) {
+  gray_image image(6, 5);
+  std::fill(image.pixels.begin(), image.pixels.end(), 200);
+  BOOST_CHECK(trim_box(image).width == 1 and trim_box(image).height == 1);
+  image.row(1)[2] = 10;
+  image.row(3)[4] = 90;
+  gray_box const box = trim_box(image);
+  BOOST_CHECK(box.x == 2 and box.y == 1 and box.width == 3 and box.height == 3);
+
+  // Every output pixel averages exactly its share of the input
+  gray_image ramp(3, 2);
+  unsigned char const values[] = { 0, 90, 180, 30, 120, 210 };
+  std::copy(values, values + 6, ramp.pixels.begin());
+  gray_histogram histogram;
+  gray_image const half = downscale(ramp, gray_box{ 0, 0, 3, 2 }, 2, 1, histogram);
+  BOOST_REQUIRE_EQUAL(half.pixels.size(), 2);
+  BOOST_CHECK_EQUAL(int(half.pixels[0]), 45);  // (0 + 30 + (90 + 120) / 2) / 3
+  BOOST_CHECK_EQUAL(int(half.pixels[1]), 165);
+  BOOST_CHECK_EQUAL(histogram[45] + histogram[165], 2);
+  gray_image const cropped = downscale(image, box, 3, 3, histogram);
+  BOOST_CHECK_EQUAL(int(cropped.row(0)[0]), 10);
+  BOOST_CHECK_EQUAL(histogram[200], 7);
+
+  histogram.fill(0);
+  histogram[50] = histogram[200] = 1000;
+  histogram[120] = 2000;
+  std::array<unsigned char, 256> const curve = tone_curve(histogram, true, false);
+  BOOST_CHECK_EQUAL(int(curve[50]), 0);
+  BOOST_CHECK_EQUAL(int(curve[125]), 128);
+  BOOST_CHECK_EQUAL(int(curve[200]), 255);
+  BOOST_CHECK_EQUAL(int(tone_curve(histogram, false, true)[50]), 205);
+
+  std::size_t width = 1600, height = 1200;
+  fit_columns(40, width, height);
+  BOOST_CHECK(width == 80 and height == 60);
+  width = 70, height = 46;
+  fit_columns(40, width, height);
+  BOOST_CHECK(width == 70 and height == 46);
+}
+
+BOOST_AUTO_TEST_CASE(pyramid_1) {
+  // Random dots, packed to braille like ubrl does
+  std::size_t const width = 37, height = 23;
+  std::mt19937 random;
+  std::bernoulli_distribution raised(0.1);
+  std::vector<unsigned char> pixels(width * (height + 3) / 4 * 4, 0xFF);
+  for (std::size_t i = 0; i < width * height; ++i)
+    if (raised(random)) pixels[i] = 0;
+  braille_cells cells(width, height);
+  for (std::size_t y = 0; y < height; y += 4) {
+    unsigned char const *const row[4] = {
+      &pixels[y * width], &pixels[(y + 1) * width],
+      &pixels[(y + 2) * width], &pixels[(y + 3) * width]
+    };
+    pack_kernels().front().pack(row, width, 0x80, cells.row(y / 4));
+  }
+  std::string const braille = cells.utf8();
+
+  dot_pyramid const pyramid(cells);
+  BOOST_REQUIRE_EQUAL(pyramid.size(), 6);
+  for (std::size_t y = 0; y < height; ++y)
+    for (std::size_t x = 0; x < width; ++x)
+      BOOST_CHECK_EQUAL(pyramid[0].dot(x, y), pixels[y * width + x] == 0);
+  for (std::size_t zoom = 1; zoom < pyramid.size(); ++zoom) {
+    dot_pyramid::level const &below = pyramid[zoom - 1], &level = pyramid[zoom];
+    BOOST_CHECK_EQUAL(level.width, (below.width + 1) / 2);
+    for (std::size_t y = 0; y < level.height; ++y)
+      for (std::size_t x = 0; x < level.width; ++x) {
+        bool any = false;
+        for (std::size_t dy = 0; dy < 2; ++dy)
+          for (std::size_t dx = 0; dx < 2; ++dx)
+            if (2 * x + dx < below.width and 2 * y + dy < below.height)
+              any = any or below.dot(2 * x + dx, 2 * y + dy);
+        BOOST_CHECK_EQUAL(level.dot(x, y), any);
+      }
+  }
+  BOOST_CHECK_EQUAL(pyramid[5].width, 2);
+  BOOST_CHECK_EQUAL(pyramid[5].height, 1);
+
+  // Viewports are slices of the full conversion, clipped at the edges
+  BOOST_CHECK_EQUAL(pyramid.view(0, 0, 0, 100, 100).utf8(), braille);
+  std::string const line = braille.substr(3 * 19 + 1, 3 * 19 + 1);
+  BOOST_CHECK_EQUAL(pyramid.view(0, 15, 1, 2, 1).utf8(), line.substr(3 * 15, 6) + '\n');
+  BOOST_CHECK_EQUAL(pyramid.view(0, 17, 1, 5, 1).utf8(), line.substr(3 * 17));
+  BOOST_CHECK(pyramid.view(0, 19, 0, 1, 1).bytes().empty());
+  BOOST_CHECK(pyramid.view(6, 0, 0, 1, 1).bytes().empty());
+
+  std::stringstream stream;
+  pyramid.serialize(stream);
+  std::string const serialized = stream.str();
+  dot_pyramid copy;
+  BOOST_REQUIRE(copy.deserialize(stream, 32768, 100000000));
+  BOOST_REQUIRE_EQUAL(copy.size(), pyramid.size());
+  for (std::size_t zoom = 0; zoom < copy.size(); ++zoom)
+    BOOST_CHECK(copy.view(zoom, 0, 0, 100, 100).bytes() ==
+                pyramid.view(zoom, 0, 0, 100, 100).bytes());
+
+  // Damaged or foreign cache entries are refused before allocating levels
+  std::istringstream smaller(serialized);
+  BOOST_CHECK(not copy.deserialize(smaller, 36, 100000000));
+  std::istringstream fewer_dots(serialized);
+  BOOST_CHECK(not copy.deserialize(fewer_dots, 32768, 37 * 22));
+  std::istringstream empty("1:0\n");
+  BOOST_CHECK(not copy.deserialize(empty, 32768, 100000000));
+  std::istringstream huge("1:1\n10:4000000000\n10:4000000000\n0:\n");
+  BOOST_CHECK(not copy.deserialize(huge, 32768, 100000000));
+  std::istringstream truncated(serialized.substr(0, serialized.size() / 2));
+  BOOST_CHECK(not copy.deserialize(truncated, 32768, 100000000));
+  BOOST_CHECK_EQUAL(copy.size(), pyramid.size());
+}
+
+BOOST_AUTO_TEST_CASE(response_1) {
+  // Special characters anywhere in and around the 16 byte blocks
+  std::string const filler(40, 'x');
+  for (std::size_t at = 0; at < 34; ++at) {
+    std::string json, html;
+    std::string text = filler;
+    text.insert(at, "\"a\\b\n\x01<&>'");
+    append_json_escaped(json, text.data(), text.size());
+    BOOST_CHECK_EQUAL(json, filler.substr(0, at) + "\\\"a\\\\b\\n\\u0001<&>'"
+                            + filler.substr(at));
+    append_html_escaped(html, text.data(), text.size());
+    BOOST_CHECK_EQUAL(html, filler.substr(0, at) + "&quot;a\\b\n\x01&lt;&amp;&gt;&#39;"
+                            + filler.substr(at));
+  }
+  // UTF-8 passes through untouched
+  std::string json;
+  std::string const braille = "⠁⣿⡀ éÄ⠀⠁⣿⡀ é";
+  append_json_escaped(json, braille.data(), braille.size());
+  BOOST_CHECK_EQUAL(json, braille);
+
+  braille_cells cells(3, 5);
+  cells.row(0)[0] = 0xFF;
+  cells.row(1)[1] = 0x01;
+  std::ostringstream out;
+  {
+    response_writer response(out);
+    response.raw('{').key("label").json("say \"hi\"").raw(',')
+            .key("width").number(std::size_t(3)).raw(',')
+            .key("seconds").number(0.25).raw(',')
+            .key("braille").json_braille(cells).raw('}');
+    BOOST_CHECK(out.str().empty());
+    response.flush();
+    response.braille(cells).flush();
+  }
+  BOOST_CHECK_EQUAL(out.str(),
+                    "{\"label\":\"say \\\"hi\\\"\",\"width\":3,\"seconds\":0.25,"
+                    "\"braille\":\"⣿⠀\\n⠀⠁\\n\"}"
+                    "⣿⠀\n⠀⠁\n");
+}
+
+BOOST_AUTO_TEST_CASE(response_2) {
+  // Ill formed UTF-8 becomes U+FFFD, one per maximal subpart, in and around
+  // the 16 byte blocks
+  std::string const replacement = "\xEF\xBF\xBD";
+  std::pair<std::string, std::string> const cases[] = {
+    { "a\x80z", "a" + replacement + "z" },
+    { "\xC3", replacement },
+    { "\xC0\xAF", replacement + replacement }, // overlong
+    { "\xED\xA0\x80", replacement + replacement + replacement }, // surrogate
+    { "\xF4\x90\x80\x80", replacement + replacement + replacement + replacement },
+    { "\xE2\x82x", replacement + "x" },
+    { "\xF0\x9F\x98", replacement },
+    { "\xFF\"", replacement + "\\\"" },
+    { "\xF0\x9F\x98\x80\xE2\xA3\xBF", "\xF0\x9F\x98\x80\xE2\xA3\xBF" }
+  };
+  std::string const filler(40, 'x');
+  for (auto const &each: cases)
+    for (std::size_t at = 0; at < 34; ++at) {
+      std::string json;
+      std::string text = filler;
+      text.insert(at, each.first);
+      append_json_escaped(json, text.data(), text.size());
+      BOOST_CHECK_EQUAL(json, filler.substr(0, at) + each.second
+                              + filler.substr(at));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(timings_1) {
+  stage_timings timings;
+  {
+    stage_timer timer(&timings, stage::decode);
+    stage_timer ignored(nullptr, stage::trim);
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+  BOOST_CHECK(timings[stage::decode] >= std::chrono::milliseconds(2));
+  BOOST_CHECK(timings[stage::trim] == stage_timings::clock_type::duration::zero());
+
+  // 90 requests rendering in about 1ms and 10 in about 100ms
+  for (int i = 0; i < 100; ++i) {
+    request_timings request;
+    request.add(stage::render, std::chrono::microseconds(i < 90? 1000: 100000));
+  }
+  std::string const text = stage_metrics();
+  BOOST_CHECK(text.find("# TYPE img2brl_stage_seconds summary\n") != std::string::npos);
+  BOOST_CHECK(text.find("img2brl_stage_seconds_count{stage=\"render\"} 100\n")
+              != std::string::npos);
+  BOOST_CHECK(text.find("img2brl_stage_seconds_sum{stage=\"render\"} 1.09\n")
+              != std::string::npos);
+  BOOST_CHECK(text.find("stage=\"total\"") != std::string::npos);
+  BOOST_CHECK(text.find("stage=\"decode\"") == std::string::npos);
+  auto quantile = [&text](char const *q) {
+    std::string const prefix =
+      std::string("img2brl_stage_seconds{stage=\"render\",quantile=\"") + q + "\"} ";
+    std::size_t const at = text.find(prefix);
+    BOOST_REQUIRE(at != std::string::npos);
+    return std::strtod(text.c_str() + at + prefix.size(), nullptr);
+  };
+  BOOST_CHECK(quantile("0.5") >= 0.001 and quantile("0.5") <= 0.00125);
+  BOOST_CHECK(quantile("0.95") >= 0.1 and quantile("0.95") <= 0.125);
+  BOOST_CHECK_EQUAL(quantile("0.99"), quantile("0.95"));
+}
+
+BOOST_AUTO_TEST_CASE(work_stealing_1) {
+  // Every index runs exactly once, whatever the number of threads
+  for (std::size_t count: { 0, 1, 7, 1000 }) {
+    for (std::size_t threads: { 0, 1, 3, 16 }) {
+      std::vector<std::atomic<int>> runs(count);
+      for (std::atomic<int> &run: runs) run = 0;
+      steal_work(count, threads, [&runs](std::size_t i) { ++runs[i]; });
+      BOOST_CHECK(std::all_of(runs.begin(), runs.end(),
+                              [](std::atomic<int> const &run) { return run == 1; }));
+    }
+  }
+
+  // One slow item at the front must not leave the rest of its share waiting
+  std::atomic<std::size_t> done{0};
+  std::size_t const steals = steal_work(64, 2, [&done](std::size_t i) {
+    if (i == 0) std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    ++done;
+  });
+  BOOST_CHECK_EQUAL(done, 64);
+  BOOST_CHECK(steals >= 1);
+}
+
+static std::string
+temporary_directory()
+{
+  char name[] = "/tmp/img2brl_test.XXXXXX";
+  BOOST_REQUIRE(mkdtemp(name));
+  return name;
+}
+
+BOOST_AUTO_TEST_CASE(sha256_1) {
+  BOOST_CHECK_EQUAL(sha256().hex_digest(),
+    "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+  BOOST_CHECK_EQUAL(sha256().update("abc").hex_digest(),
+    "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+  std::string const two_blocks =
+    "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+  BOOST_CHECK_EQUAL(sha256().update(two_blocks).hex_digest(),
+    "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+
+  // Pieces of any size give the same digest as the whole
+  std::string const million(1000000, 'a');
+  for (std::size_t piece: { 1, 63, 64, 65, 4096 }) {
+    sha256 hash;
+    for (std::size_t i = 0; i < million.size(); i += piece)
+      hash.update(million.substr(i, piece));
+    BOOST_CHECK_EQUAL(hash.hex_digest(),
+      "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+  }
+}
+
+BOOST_AUTO_TEST_CASE(result_cache_1) {
+  result_cache cache(temporary_directory(), 1 << 20);
+  BOOST_REQUIRE(cache.enabled());
+
+  conversion_options options;
+  std::string const key = cache.key("image data", options);
+  options.negate = true;
+  BOOST_CHECK_NE(key, cache.key("image data", options));
+  BOOST_CHECK_NE(key, cache.key("other data", conversion_options()));
+
+  conversion result;
+  BOOST_CHECK(not cache.find(key, result));
+  conversion stored;
+  stored.format = "Portable Network Graphics";
+  stored.comment = "two\nlines";
+  stored.source_width = 3;
+  stored.source_height = 5;
+  stored.braille = braille_cells(3, 5);
+  stored.braille.row(0)[0] = 0xFF;
+  stored.braille.row(0)[1] = 0x01;
+  cache.insert(key, stored);
+  BOOST_REQUIRE(cache.find(key, result));
+  BOOST_CHECK_EQUAL(result.format, stored.format);
+  BOOST_CHECK(result.label.empty());
+  BOOST_CHECK_EQUAL(result.comment, stored.comment);
+  BOOST_CHECK_EQUAL(result.source_width, 3);
+  BOOST_CHECK_EQUAL(result.braille.height(), 5);
+  BOOST_CHECK(result.braille.bytes() == stored.braille.bytes());
+  BOOST_CHECK_EQUAL(result.braille.utf8(), "\u28FF\u2801\n\u2800\u2800\n");
+
+  // Raw values and conversions do not mistake each other
+  std::string value;
+  BOOST_CHECK(not cache.find(key, value));
+  cache.insert(key + "-raw", std::string("\0binary\n", 8));
+  BOOST_REQUIRE(cache.find(key + "-raw", value));
+  BOOST_CHECK_EQUAL(value, std::string("\0binary\n", 8));
+  BOOST_CHECK(not cache.find(key + "-raw", result));
+}
+
+BOOST_AUTO_TEST_CASE(result_cache_2) {
+  // Room for about three entries, the oldest ones have to go
+  result_cache cache(temporary_directory(), 3500);
+  conversion entry;
+  entry.braille = braille_cells(200, 40);
+  for (char const *data: { "a", "b", "c", "d", "e" }) {
+    cache.insert(cache.key(data, conversion_options()), entry);
+    // Modification times may only advance with the timer tick
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+  BOOST_CHECK(not cache.find(cache.key("a", conversion_options()), entry));
+  BOOST_CHECK(not cache.find(cache.key("b", conversion_options()), entry));
+  BOOST_CHECK(cache.find(cache.key("e", conversion_options()), entry));
+}
+
+BOOST_AUTO_TEST_CASE(shared_cache_1) {
+  std::string const path = temporary_directory() + "/segment";
+  shared_cache writer(path, 4096, 16);
+  BOOST_REQUIRE(writer.enabled());
+  // A second mapping of the same file sees what the first one stores
+  shared_cache reader(path, 4096, 16);
+  BOOST_REQUIRE(reader.enabled());
+  BOOST_CHECK(not shared_cache(path, 8192, 16).enabled());
+
+  std::string value;
+  BOOST_CHECK(not reader.find("key", value));
+  writer.insert("key", "value");
+  BOOST_REQUIRE(reader.find("key", value));
+  BOOST_CHECK_EQUAL(value, "value");
+  writer.insert("key", "newer value");
+  BOOST_REQUIRE(reader.find("key", value));
+  BOOST_CHECK_EQUAL(value, "newer value");
+
+  // Once the ring buffer wrapped around, old values are gone
+  for (int i = 0; i < 32; ++i)
+    writer.insert(std::to_string(i), std::string(200, 'x'));
+  BOOST_CHECK(not reader.find("key", value));
+  BOOST_REQUIRE(reader.find("31", value));
+  BOOST_CHECK_EQUAL(value, std::string(200, 'x'));
+
+  // Values with a time to live expire regardless of the max_age asked for
+  writer.insert("brief", "value", std::chrono::seconds(1));
+  writer.insert("lasting", "value", std::chrono::seconds(3600));
+  BOOST_CHECK(reader.find("brief", value));
+  std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+  BOOST_CHECK(not reader.find("brief", value));
+  BOOST_CHECK(reader.find("lasting", value));
+
+  // Where the ring overtook a record, an uploaded value may now look like
+  // its header, claiming more bytes than are left in the mapping
+  shared_cache ring(temporary_directory() + "/segment", 4096, 16);
+  ring.insert("a", std::string(900, 'x'));   // offsets 0 to 952
+  ring.insert("key", "value");               // 952 to 1008
+  for (char const *filler: { "b", "c", "d" }) // up to 3864
+    ring.insert(filler, std::string(900, 'x'));
+  BOOST_REQUIRE(ring.find("key", value));
+  std::string const key = "key";
+  std::uint64_t const k0 = fnv1a(key);
+  std::uint64_t const forged[6] = { k0, fnv1a(key, k0), key.size(), 4000, 0, 0 };
+  // Wraps to offset 0, its value starts at 49 and the forged header at 952
+  std::string hostile(903, 'x');
+  hostile.append(reinterpret_cast<char const *>(forged), sizeof forged);
+  ring.insert("e", hostile);
+  BOOST_CHECK(not ring.find("key", value));
+}
+
+// Answers HTTP requests on a loopback port with whatever respond returns for
+// the request head, keeping connections open like a real server would.
+class stand_in_server
+{
+  int listener;
+  std::function<std::string(std::string const &)> respond;
+  std::mutex mutex;
+  std::vector<int> connections;
+  std::vector<std::thread> threads;
+  std::thread acceptor;
+
+  void serve(int connection)
+  {
+    std::string buffer;
+    char chunk[4096];
+    ssize_t count;
+    while ((count = read(connection, chunk, sizeof chunk)) > 0) {
+      buffer.append(chunk, count);
+      std::string::size_type end;
+      while ((end = buffer.find("\r\n\r\n")) != std::string::npos) {
+        std::string const response = respond(buffer.substr(0, end + 4));
+        buffer.erase(0, end + 4);
+        if (send(connection, response.data(), response.size(), MSG_NOSIGNAL) < 0)
+          return;
+      }
+    }
+  }
+
+public:
+  unsigned short port;
+  std::atomic<unsigned> accepted{0};
+
+  stand_in_server(std::function<std::string(std::string const &)> respond)
+  : listener{socket(AF_INET, SOCK_STREAM, 0)}, respond{respond}
+  {
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof address;
+    BOOST_REQUIRE(bind(listener, reinterpret_cast<sockaddr *>(&address), length) == 0);
+    BOOST_REQUIRE(listen(listener, 16) == 0);
+    getsockname(listener, reinterpret_cast<sockaddr *>(&address), &length);
+    port = ntohs(address.sin_port);
+    acceptor = std::thread([this] {
+      int connection;
+      while ((connection = accept(listener, nullptr, nullptr)) != -1) {
+        ++accepted;
+        std::lock_guard<std::mutex> lock(mutex);
+        connections.push_back(connection);
+        threads.emplace_back(&stand_in_server::serve, this, connection);
+      }
+    });
+  }
+
+  ~stand_in_server()
+  {
+    shutdown(listener, SHUT_RDWR);
+    acceptor.join();
+    for (int connection: connections) shutdown(connection, SHUT_RDWR);
+    for (std::thread &thread: threads) thread.join();
+    for (int connection: connections) close(connection);
+    close(listener);
+  }
+
+  std::string url(std::string const &path) const
+  {
+    return "http://127.0.0.1:" + std::to_string(port) + path;
+  }
+};
+
+BOOST_AUTO_TEST_CASE(fetch_1) {
+  BOOST_CHECK_EQUAL(freshness_lifetime(""), 0);
+  BOOST_CHECK_EQUAL(freshness_lifetime("max-age=60"), 60);
+  BOOST_CHECK_EQUAL(freshness_lifetime("public, Max-Age=60 , s-maxage=10"), 10);
+  BOOST_CHECK_EQUAL(freshness_lifetime("max-age=60, no-cache"), 0);
+  BOOST_CHECK_EQUAL(freshness_lifetime("no-store"), -1);
+  BOOST_CHECK_EQUAL(freshness_lifetime("private, max-age=60"), -1);
+}
+
+BOOST_AUTO_TEST_CASE(fetch_2) {
+  std::atomic<unsigned> requests{0}, revalidations{0};
+  stand_in_server server([&](std::string const &request) -> std::string {
+    ++requests;
+    if (request.find("If-None-Match: \"v1\"") != std::string::npos) {
+      ++revalidations;
+      return "HTTP/1.1 304 Not Modified\r\nETag: \"v1\"\r\n"
+             "Cache-Control: max-age=60\r\nContent-Length: 0\r\n\r\n";
+    }
+    if (request.find("GET /fresh ") == 0)
+      return "HTTP/1.1 200 OK\r\nContent-Type: image/png\r\n"
+             "Cache-Control: max-age=60\r\nContent-Length: 5\r\n\r\nfresh";
+    return "HTTP/1.1 200 OK\r\nContent-Type: image/gif\r\nETag: \"v1\"\r\n"
+           "Content-Length: 5\r\n\r\nstale";
+  });
+  fetch_initialize();
+  fetch_cache cache(temporary_directory(), 1 << 20);
+
+  // Fresh responses are served without asking the server again
+  fetched response = fetch(server.url("/fresh"), "test", cache);
+  BOOST_CHECK_EQUAL(response.status, 200);
+  BOOST_CHECK(not response.from_cache);
+  response = fetch(server.url("/fresh"), "test", cache);
+  BOOST_CHECK_EQUAL(response.status, 200);
+  BOOST_CHECK(response.from_cache);
+  BOOST_CHECK_EQUAL(response.body, "fresh");
+  BOOST_CHECK_EQUAL(response.content_type, "image/png");
+  BOOST_CHECK_EQUAL(requests, 1);
+
+  // Stale responses are revalidated and reused on 304
+  response = fetch(server.url("/stale"), "test", cache);
+  BOOST_CHECK(not response.from_cache);
+  response = fetch(server.url("/stale"), "test", cache);
+  BOOST_CHECK_EQUAL(response.status, 200);
+  BOOST_CHECK(response.from_cache);
+  BOOST_CHECK_EQUAL(response.body, "stale");
+  BOOST_CHECK_EQUAL(response.content_type, "image/gif");
+  BOOST_CHECK_EQUAL(revalidations, 1);
+  // The 304 came with max-age, so now it is fresh
+  fetch(server.url("/stale"), "test", cache);
+  BOOST_CHECK_EQUAL(requests, 3);
+
+  fetch_finalize();
+}
+
+BOOST_AUTO_TEST_CASE(fetch_3) {
+  stand_in_server server([](std::string const &) -> std::string {
+    return "HTTP/1.1 200 OK\r\nContent-Type: image/png\r\n"
+           "Cache-Control: no-store\r\nContent-Length: 5\r\n\r\nimage";
+  });
+  fetch_initialize();
+  fetch_cache cache("", 0);
+
+  // Every fetch goes to the server, but over the same connection
+  for (int i = 0; i < 3; ++i)
+    BOOST_CHECK_EQUAL(fetch(server.url("/"), "test", cache).body, "image");
+  std::thread other([&] {
+    BOOST_CHECK_EQUAL(fetch(server.url("/"), "test", cache).body, "image");
+  });
+  other.join();
+  BOOST_CHECK_EQUAL(server.accepted, 1);
+
+  fetch_finalize();
+}
+
+BOOST_AUTO_TEST_CASE(fetch_4) {
+  BOOST_CHECK(clearly_not_an_image("text/html; charset=utf-8", ""));
+  BOOST_CHECK(clearly_not_an_image("application/octet-stream",
+                                   "\n  <!DOCTYPE html><html>"));
+  BOOST_CHECK(not clearly_not_an_image("image/svg+xml", "<?xml version=\"1.0\"?>"));
+  BOOST_CHECK(not clearly_not_an_image("", "\x89PNG\r\n\x1a\n"));
+
+  stand_in_server server([](std::string const &request) -> std::string {
+    if (request.find("GET /large ") == 0)
+      return "HTTP/1.1 200 OK\r\nContent-Length: 2000\r\n\r\n"
+           + std::string(2000, 'x');
+    if (request.find("GET /chunked ") == 0)
+      return "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+             "7d0\r\n" + std::string(2000, 'x') + "\r\n0\r\n\r\n";
+    if (request.find("GET /page ") == 0)
+      return "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n"
+             "Content-Length: 13\r\n\r\n<html></html>";
+    if (request.find("GET /missing ") == 0)
+      return "HTTP/1.1 404 Not Found\r\nContent-Type: text/html\r\n"
+             "Content-Length: 13\r\n\r\n<html></html>";
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    return "HTTP/1.1 200 OK\r\nContent-Length: 1\r\n\r\nx";
+  });
+  fetch_initialize();
+  fetch_cache cache("", 0);
+  fetch_limits limits;
+  limits.max_size = 1000;
+  limits.timeout = std::chrono::milliseconds(100);
+
+  fetched response = fetch(server.url("/large"), "test", cache, limits);
+  BOOST_CHECK_EQUAL(response.status, 413);
+  BOOST_CHECK(response.body.empty());
+  BOOST_CHECK_EQUAL(fetch(server.url("/chunked"), "test", cache, limits).status, 413);
+  BOOST_CHECK_EQUAL(fetch(server.url("/page"), "test", cache, limits).status, 415);
+  BOOST_CHECK_EQUAL(fetch(server.url("/missing"), "test", cache, limits).status, 404);
+  BOOST_CHECK_EQUAL(fetch(server.url("/slow"), "test", cache, limits).status, 504);
+
+  fetch_finalize();
+}
+
+BOOST_AUTO_TEST_CASE(fetch_5) {
+  stand_in_server server([](std::string const &request) -> std::string {
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    if (request.find("GET /missing ") == 0)
+      return "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+    std::string const path = request.substr(4, request.find(' ', 4) - 4);
+    return "HTTP/1.1 200 OK\r\nContent-Type: image/png\r\nContent-Length: "
+         + std::to_string(path.size()) + "\r\n\r\n" + path;
+  });
+  fetch_initialize();
+  fetch_cache cache("", 0);
+
+  std::vector<std::string> urls;
+  for (char const *path: { "/a", "/b", "/missing", "/c", "/d" })
+    urls.push_back(server.url(path));
+  auto const start = std::chrono::steady_clock::now();
+  std::vector<fetched> const responses = fetch_all(urls, "test", cache);
+  // Sequentially this would take a second
+  BOOST_CHECK(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(800));
+  BOOST_REQUIRE_EQUAL(responses.size(), urls.size());
+  BOOST_CHECK_EQUAL(responses[0].body, "/a");
+  BOOST_CHECK_EQUAL(responses[1].body, "/b");
+  BOOST_CHECK_EQUAL(responses[2].status, 404);
+  BOOST_CHECK_EQUAL(responses[3].body, "/c");
+  BOOST_CHECK_EQUAL(responses[4].url, urls[4]);
+
+  fetch_finalize();
+}
@@ -0,0 +1,73 @@
+#include "thread_pool.h"
+#include <algorithm>
+
+thread_pool::thread_pool(std::size_t threads, std::size_t capacity)
+: capacity{capacity}, stopping{false}
+{
+  if (not threads) threads = std::max(1u, std::thread::hardware_concurrency());
+  counters = statistics{ threads, capacity, 0, 0, 0, 0,
+                         clock_type::duration::zero(),
+                         clock_type::duration::zero() };
+  for (std::size_t i = 0; i < threads; ++i)
+    workers.emplace_back(&thread_pool::work, this);
+}
+
+thread_pool::~thread_pool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  available.notify_all();
+  for (std::thread &worker: workers) worker.join();
+}
+
+bool
+thread_pool::try_submit(std::function<void()> work)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (jobs.size() >= capacity) {
+      ++counters.rejected;
+      return false;
+    }
+    jobs.push_back(job{std::move(work), clock_type::now()});
+    counters.queued = jobs.size();
+  }
+  available.notify_one();
+  return true;
+}
+
+void
+thread_pool::work()
+{
+  for (;;) {
+    job next;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      available.wait(lock, [this] { return stopping or not jobs.empty(); });
+      if (jobs.empty()) return;
+      next = std::move(jobs.front());
+      jobs.pop_front();
+      clock_type::duration const wait = clock_type::now() - next.queued;
+      counters.queued = jobs.size();
+      ++counters.active;
+      counters.total_wait += wait;
+      counters.max_wait = std::max(counters.max_wait, wait);
+    }
+    try {
+      next.work();
+    } catch (...) {
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    --counters.active;
+    ++counters.completed;
+  }
+}
+
+thread_pool::statistics
+thread_pool::stats() const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return counters;
+}
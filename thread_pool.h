@@ -0,0 +1,58 @@
+#ifndef IMG2BRL_THREAD_POOL_H
+#define IMG2BRL_THREAD_POOL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed number of worker threads fed from a bounded queue.  Work which
+// does not fit into the queue is refused instead of piling up, so callers
+// can shed load early.
+class thread_pool
+{
+public:
+  typedef std::chrono::steady_clock clock_type;
+
+  struct statistics
+  {
+    std::size_t threads, capacity;
+    std::size_t queued, active;
+    unsigned long long completed, rejected;
+    clock_type::duration total_wait, max_wait; // time spent in the queue
+  };
+
+private:
+  struct job
+  {
+    std::function<void()> work;
+    clock_type::time_point queued;
+  };
+
+  mutable std::mutex mutex;
+  std::condition_variable available;
+  std::deque<job> jobs;
+  std::vector<std::thread> workers;
+  std::size_t const capacity;
+  bool stopping;
+  statistics counters;
+
+  void work();
+
+public:
+  // threads == 0 means one per core
+  thread_pool(std::size_t threads, std::size_t capacity);
+  ~thread_pool();
+  thread_pool(thread_pool const &) = delete;
+  thread_pool &operator=(thread_pool const &) = delete;
+
+  // Queue work unless the queue is full.
+  bool try_submit(std::function<void()> work);
+
+  statistics stats() const;
+};
+
+#endif
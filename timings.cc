@@ -0,0 +1,115 @@
+#include "timings.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+
+namespace /* anonymous */ {
+
+// Microseconds, in four buckets per power of two from 4us up to days
+std::size_t const bucket_count = 160;
+
+std::size_t
+bucket_of(std::uint64_t microseconds)
+{
+  if (microseconds < 4) return microseconds;
+  int const log = 63 - __builtin_clzll(microseconds);
+  std::size_t const bucket = (log - 1) * 4 + (microseconds >> (log - 2) & 3);
+  return bucket < bucket_count? bucket: bucket_count - 1;
+}
+
+// The smallest value of a bucket
+std::uint64_t
+lower_bound(std::size_t bucket)
+{
+  if (bucket < 4) return bucket;
+  return std::uint64_t(4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+struct histogram
+{
+  std::atomic<std::uint64_t> buckets[bucket_count];
+  std::atomic<std::uint64_t> count, sum; // sum in microseconds
+
+  histogram(): count{0}, sum{0}
+  { for (auto &bucket: buckets) bucket.store(0, std::memory_order_relaxed); }
+
+  void add(std::uint64_t microseconds)
+  {
+    buckets[bucket_of(microseconds)].fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(microseconds, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Upper end of the bucket holding the given fraction of all values
+  double quantile(double fraction, std::uint64_t total) const
+  {
+    std::uint64_t const rank = std::uint64_t(fraction * total + 0.5);
+    std::uint64_t seen = 0;
+    for (std::size_t bucket = 0; bucket < bucket_count; ++bucket) {
+      seen += buckets[bucket].load(std::memory_order_relaxed);
+      if (seen >= rank and seen) return lower_bound(bucket + 1) / 1e6;
+    }
+    return lower_bound(bucket_count) / 1e6;
+  }
+};
+
+histogram histograms[stage_count];
+
+}
+
+char const *
+stage_name(stage which)
+{
+  static char const *const names[stage_count] = {
+    "fetch", "decode", "trim", "scale", "normalize", "negate", "resize",
+    "convert", "render", "total"
+  };
+  return names[std::size_t(which)];
+}
+
+void
+stage_timings::add(stage_timings const &other)
+{
+  for (std::size_t i = 0; i < stage_count; ++i) spent[i] += other.spent[i];
+}
+
+request_timings::~request_timings()
+{
+  add(stage::total, clock_type::now() - start);
+  for (std::size_t i = 0; i < stage_count; ++i) {
+    clock_type::duration const duration = (*this)[stage(i)];
+    if (duration != clock_type::duration::zero())
+      histograms[i].add(std::chrono::duration_cast<std::chrono::microseconds>
+                        (duration).count());
+  }
+}
+
+std::string
+stage_metrics()
+{
+  std::string text =
+    "# HELP img2brl_stage_seconds Time requests spent in each stage.\n"
+    "# TYPE img2brl_stage_seconds summary\n";
+  char line[160];
+  for (std::size_t i = 0; i < stage_count; ++i) {
+    histogram const &stage_histogram = histograms[i];
+    std::uint64_t const count = stage_histogram.count.load(std::memory_order_relaxed);
+    if (not count) continue;
+    char const *name = stage_name(stage(i));
+    for (double fraction: { 0.5, 0.95, 0.99 }) {
+      std::snprintf(line, sizeof line,
+                    "img2brl_stage_seconds{stage=\"%s\",quantile=\"%g\"} %g\n",
+                    name, fraction, stage_histogram.quantile(fraction, count));
+      text += line;
+    }
+    std::snprintf(line, sizeof line,
+                  "img2brl_stage_seconds_sum{stage=\"%s\"} %g\n"
+                  "img2brl_stage_seconds_count{stage=\"%s\"} %llu\n",
+                  name,
+                  stage_histogram.sum.load(std::memory_order_relaxed) / 1e6,
+                  name, static_cast<unsigned long long>(count));
+    text += line;
+  }
+  return text;
+}
@@ -0,0 +1,77 @@
+#ifndef IMG2BRL_TIMINGS_H
+#define IMG2BRL_TIMINGS_H
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <string>
+
+// The stages a request goes through, in order
+enum class stage
+{
+  fetch, decode, trim, scale, normalize, negate, resize, convert, render,
+  total
+};
+
+std::size_t const stage_count = std::size_t(stage::total) + 1;
+
+char const *stage_name(stage);
+
+// Time spent in each stage by one request.  Stages which did not run stay
+// at zero.
+class stage_timings
+{
+public:
+  typedef std::chrono::steady_clock clock_type;
+
+private:
+  std::array<clock_type::duration, stage_count> spent;
+
+public:
+  stage_timings() { spent.fill(clock_type::duration::zero()); }
+
+  void add(stage which, clock_type::duration duration)
+  { spent[std::size_t(which)] += duration; }
+  void add(stage_timings const &);
+
+  clock_type::duration operator[](stage which) const
+  { return spent[std::size_t(which)]; }
+};
+
+// Adds the time from construction to destruction to a stage.  A null
+// timings pointer turns it into a no-op.
+class stage_timer
+{
+  stage_timings *timings;
+  stage which;
+  stage_timings::clock_type::time_point start;
+
+public:
+  stage_timer(stage_timings *timings, stage which)
+  : timings{timings}, which{which}
+  , start{timings? stage_timings::clock_type::now()
+                 : stage_timings::clock_type::time_point()}
+  {}
+  ~stage_timer()
+  { if (timings) timings->add(which, stage_timings::clock_type::now() - start); }
+  stage_timer(stage_timer const &) = delete;
+  stage_timer &operator=(stage_timer const &) = delete;
+};
+
+// The timings of a request, added to the process wide statistics along with
+// its total time once the request is done
+class request_timings: public stage_timings
+{
+  clock_type::time_point start;
+
+public:
+  request_timings(): start{clock_type::now()} {}
+  ~request_timings();
+};
+
+// Process wide distribution of stage times as Prometheus text, with the
+// 50th, 95th and 99th percentile, sum and count of every stage which ran.
+// Percentiles are accurate to within a quarter of their power of two.
+std::string stage_metrics();
+
+#endif
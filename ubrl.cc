@@ -1,42 +1,83 @@
 #include "ubrl.h"
-#include <Magick++/Blob.h>
-#define BOOST_SPIRIT_NO_PREDEFINED_TERMINALS
-#include <boost/spirit/include/qi_char_.hpp>
-#include <boost/spirit/include/qi_eol.hpp>
-#include <boost/spirit/include/qi_eoi.hpp>
-#include <boost/spirit/include/qi_expect.hpp>
-#include <boost/spirit/include/qi_kleene.hpp>
-#include <boost/spirit/include/qi_lit.hpp>
-#include <boost/spirit/include/qi_optional.hpp>
-#include <boost/spirit/include/qi_parse_attr.hpp>
-#include <boost/spirit/include/qi_rule.hpp>
-#include <boost/spirit/include/qi_sequence.hpp>
-#include <boost/spirit/include/qi_uint.hpp>
-
-ubrl::ubrl(Magick::Image const &image)
+#include "pack.h"
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+namespace /* anonymous */ {
+
+double
+luma(MagickCore::PixelPacket const &pixel)
+{
+  return 0.298839 * pixel.red + 0.586811 * pixel.green + 0.114350 * pixel.blue;
+}
+
+}
+
+// Pack the pixels of image into braille cells, raising exactly the dots
+// ImageMagick's "ubrl" coder would write after its header.
+ubrl::ubrl(Magick::Image const &image, dither_mode mode)
+: data{image.columns(), image.rows()}
 {
-  Magick::Blob blob;
-  Magick::Image(image).write(&blob, "ubrl");
-
-  using namespace boost::spirit::qi;
-  char const *begin = static_cast<char const *>(blob.data());
-  char const *const end = begin + blob.length();
-  char_type char_;
-  eoi_type eoi;
-  eol_type eol;
-  lit_type lit;
-  uint_type uint_;
-
-  boost::optional<std::string> title;
-  boost::optional<std::size_t> x, y;
-  rule<char const *, std::string()> label = lit("Title: ") > *~char_('\n') > eol;
-  rule<char const *, std::size_t()> x_offset = lit("X: ") > uint_ > eol;
-  rule<char const *, std::size_t()> y_offset = lit("Y: ") > uint_ > eol;
-  rule<char const *, std::size_t()> width = lit("Width: ") > uint_ > eol;
-  rule<char const *, std::size_t()> height = lit("Height: ") > uint_ > eol;
-  if (not
-  parse( begin, end
-	 , -label >> -x_offset >> -y_offset >> width >> height >> eol >> *char_ > eoi
-	 , title, x, y, w, h, data))
-    throw std::runtime_error("ubrl parse failed"+std::string(begin, end));
+  std::size_t const w = data.width(), h = data.height();
+
+  if (mode != dither_mode::bilevel) {
+    Magick::Image gray(image);
+    std::vector<unsigned char> luminance(w * h);
+    if (not luminance.empty())
+      gray.write(0, 0, w, h, "I", Magick::CharPixel, luminance.data());
+    dither(luminance.data(), w, h, mode, data);
+    return;
+  }
+
+  // The coder reduces the image to two colours first, do the same.
+  Magick::Image bilevel(image);
+  bilevel.type(Magick::BilevelType);
+  if (bilevel.classType() != Magick::PseudoClass)
+    throw std::runtime_error("ubrl: bilevel image has no colormap");
+
+  std::vector<unsigned char> luminance(w * h);
+  if (not luminance.empty())
+    bilevel.write(0, 0, w, h, "I", Magick::CharPixel, luminance.data());
+
+  // The coder raises dots for pixels whose colormap index equals polarity,
+  // which selects the darker of the two colours.  Translate that into a
+  // luminance threshold the packing kernels understand.
+  MagickCore::Image const *core = bilevel.constImage();
+  MagickCore::IndexPacket polarity =
+    luma(core->colormap[0]) >= MagickCore::QuantumRange / 2;
+  if (core->colors == 2)
+    polarity = luma(core->colormap[0]) >= luma(core->colormap[1]);
+  unsigned char const dark =
+    MagickCore::ScaleQuantumToChar(core->colormap[polarity].red);
+  unsigned char threshold = 0;
+  if (core->colors == 2) {
+    unsigned char const light =
+      MagickCore::ScaleQuantumToChar(core->colormap[1 - polarity].red);
+    if (dark < light) {
+      threshold = light;
+    } else {
+      // Both colours collapse onto the same 8 bit value, fall back to
+      // marking dots by colormap index.
+      for (std::size_t y = 0; y < h; ++y) {
+        bilevel.getConstPixels(0, y, w, 1);
+        MagickCore::IndexPacket const *indexes = bilevel.getConstIndexes();
+        for (std::size_t x = 0; x < w; ++x)
+          luminance[y * w + x] = indexes[x] == polarity ? 0 : 0xFF;
+      }
+      threshold = 0x80;
+    }
+  } else if (polarity == 0) {
+    // A single dark colour, every pixel is a dot
+    threshold = dark + 1;
+  }
+
+  pack_kernel const &kernel = best_pack_kernel();
+  std::vector<unsigned char> const blank(w, 0xFF);
+  for (std::size_t y = 0; y < h; y += 4) {
+    unsigned char const *row[4];
+    for (std::size_t dy = 0; dy < 4; ++dy)
+      row[dy] = y + dy < h ? &luminance[(y + dy) * w] : blank.data();
+    kernel.pack(row, w, threshold, data.row(y / 4));
+  }
 }
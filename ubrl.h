@@ -1,12 +1,17 @@
 #include <Magick++/Image.h>
 
+#include "cells.h"
+#include "dither.h"
+
 class ubrl
 {
-  std::size_t w, h;
-  std::string data;
+  braille_cells data;
 public:
-  ubrl(Magick::Image const &);
-  std::size_t width() const { return w; }
-  std::size_t height() const { return h; }
-  std::string const &string() const { return data; }
+  // Dots as ImageMagick's "ubrl" coder would raise them, or as dither
+  // raises them on the luminance of image for the other modes
+  ubrl(Magick::Image const &, dither_mode = dither_mode::bilevel);
+  std::size_t width() const { return data.width(); }
+  std::size_t height() const { return data.height(); }
+  braille_cells const &cells() const { return data; }
+  std::string string() const { return data.utf8(); }
 };
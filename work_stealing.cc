@@ -0,0 +1,93 @@
+#include "work_stealing.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace /* anonymous */ {
+
+// The indices [begin, end) a worker has not started yet
+struct share
+{
+  std::mutex mutex;
+  std::size_t begin, end;
+};
+
+// Move the back half of the largest share into own, false if all are empty.
+// Only one lock is held at a time, so workers stealing from each other can
+// not deadlock.
+bool
+steal(std::vector<std::unique_ptr<share>> const &shares, share &own)
+{
+  for (;;) {
+    share *victim = nullptr;
+    std::size_t largest = 0;
+    for (std::unique_ptr<share> const &other: shares) {
+      std::lock_guard<std::mutex> lock(other->mutex);
+      if (other->end - other->begin > largest) {
+        largest = other->end - other->begin;
+        victim = other.get();
+      }
+    }
+    if (not victim) return false;
+
+    std::size_t begin, end;
+    {
+      std::lock_guard<std::mutex> lock(victim->mutex);
+      if (victim->begin == victim->end) continue; // somebody was faster
+      end = victim->end;
+      begin = victim->end -= (end - victim->begin + 1) / 2;
+    }
+    std::lock_guard<std::mutex> lock(own.mutex);
+    own.begin = begin;
+    own.end = end;
+    return true;
+  }
+}
+
+}
+
+std::size_t
+steal_work( std::size_t count, std::size_t threads
+          , std::function<void(std::size_t)> const &work
+          )
+{
+  if (not threads) threads = std::max(1U, std::thread::hardware_concurrency());
+  threads = std::max<std::size_t>(1, std::min(threads, count));
+
+  std::vector<std::unique_ptr<share>> shares;
+  for (std::size_t i = 0; i < threads; ++i) {
+    shares.emplace_back(new share);
+    shares.back()->begin = count * i / threads;
+    shares.back()->end = count * (i + 1) / threads;
+  }
+
+  std::atomic<std::size_t> steals{0};
+  auto worker = [&](share &own) {
+    for (;;) {
+      std::size_t next;
+      {
+        std::lock_guard<std::mutex> lock(own.mutex);
+        next = own.begin < own.end? own.begin++: count;
+      }
+      if (next < count) {
+        work(next);
+      } else if (steal(shares, own)) {
+        ++steals;
+      } else {
+        return;
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (std::size_t i = 1; i < threads; ++i)
+    workers.emplace_back(worker, std::ref(*shares[i]));
+  worker(*shares[0]);
+  for (std::thread &thread: workers) thread.join();
+
+  return steals;
+}
@@ -0,0 +1,19 @@
+#ifndef IMG2BRL_WORK_STEALING_H
+#define IMG2BRL_WORK_STEALING_H
+
+#include <cstddef>
+#include <functional>
+
+// Call work(i) for every i below count on threads workers, one per core if
+// threads is 0, and return once all calls have returned.
+//
+// Each worker starts with an equal contiguous share of the indices and takes
+// them from its front.  A worker which runs dry steals the back half of the
+// largest share left.  Neighbouring items, like the files of one directory,
+// thereby stay on one thread, while a few slow items can not hold up the
+// rest.  work must not throw.  Returns how often a worker had to steal.
+std::size_t steal_work( std::size_t count, std::size_t threads
+                      , std::function<void(std::size_t)> const &work
+                      );
+
+#endif